@@ -156,6 +156,7 @@
     __declspec(dllimport) HANDLE __stdcall GetStdHandle(DWORD nStdHandle);
     __declspec(dllimport) BOOL __stdcall GetConsoleMode(HANDLE hConsoleHandle, DWORD* lpMode);
     __declspec(dllimport) BOOL __stdcall SetConsoleMode(HANDLE hConsoleHandle, DWORD dwMode);
+    __declspec(dllimport) BOOL __stdcall GetNumberOfConsoleInputEvents(HANDLE hConsoleInput, DWORD* lpcNumberOfEvents);
     __declspec(dllimport) BOOL __stdcall ReadConsoleInputA(HANDLE hConsoleInput, INPUT_RECORD* lpBuffer, DWORD nLength, DWORD* lpNumberOfEventsRead);
     __declspec(dllimport) BOOL __stdcall GetConsoleScreenBufferInfo(HANDLE hConsoleOutput, CONSOLE_SCREEN_BUFFER_INFO* lpConsoleScreenBufferInfo);
     __declspec(dllimport) BOOL __stdcall FillConsoleOutputCharacterA(HANDLE hConsoleOutput, char cCharacter, DWORD nLength, COORD dwWriteCoord, DWORD* lpNumberOfCharsWritten);
@@ -168,6 +169,8 @@
     __declspec(dllimport) void* __stdcall GetProcAddress(HMODULE hModule, LPCSTR lpProcName);
     __declspec(dllimport) void __stdcall ExitProcess(UINT uExitCode);
     __declspec(dllimport) DWORD __stdcall GetLastError(void);
+    __declspec(dllimport) BOOL __stdcall QueryPerformanceCounter(long long *lpPerformanceCount);
+    __declspec(dllimport) BOOL __stdcall QueryPerformanceFrequency(long long *lpFrequency);
     __declspec(dllimport) HANDLE __stdcall CreateFileA(LPCSTR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, SECURITY_ATTRIBUTES* lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile);
     __declspec(dllimport) BOOL __stdcall WriteFile(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite, DWORD* lpNumberOfBytesWritten, void* lpOverlapped);
     __declspec(dllimport) BOOL __stdcall ReadFile(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead, DWORD* lpNumberOfBytesRead, void* lpOverlapped);
@@ -175,12 +178,27 @@
     __declspec(dllimport) char* __stdcall GetCommandLineA(void);
     __declspec(dllimport) int __stdcall _chdir(const char* dirname);
     __declspec(dllimport) char* __stdcall _getcwd(char* buffer, int maxlen);
+    __declspec(dllimport) int __stdcall _mkdir(const char* dirname);
+    __declspec(dllimport) HANDLE __stdcall CreateThread(SECURITY_ATTRIBUTES* lpThreadAttributes, size_t dwStackSize, DWORD (__stdcall *lpStartAddress)(LPVOID), LPVOID lpParameter, DWORD dwCreationFlags, DWORD* lpThreadId);
+    __declspec(dllimport) DWORD __stdcall WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds);
+    __declspec(dllimport) BOOL __stdcall SwitchToThread(void);
+    __declspec(dllimport) DWORD __stdcall GetActiveProcessorCount(WORD GroupNumber);
+    __declspec(dllimport) DWORD __stdcall GetFileSize(HANDLE hFile, DWORD* lpFileSizeHigh);
+    __declspec(dllimport) HANDLE __stdcall CreateFileMappingA(HANDLE hFile, SECURITY_ATTRIBUTES* lpAttributes, DWORD flProtect, DWORD dwMaximumSizeHigh, DWORD dwMaximumSizeLow, LPCSTR lpName);
+    __declspec(dllimport) LPVOID __stdcall MapViewOfFile(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, size_t dwNumberOfBytesToMap);
+    __declspec(dllimport) BOOL __stdcall UnmapViewOfFile(LPCVOID lpBaseAddress);
+    
+    #define INFINITE 0xFFFFFFFF
+    #define ALL_PROCESSOR_GROUPS 0xffff
+    #define PAGE_READONLY 0x02
+    #define FILE_MAP_READ 0x0004
     
     #define ReadConsoleInput ReadConsoleInputA
     #define FindFirstFile FindFirstFileA
     #define FindNextFile FindNextFileA
     #define LoadLibrary LoadLibraryA
     #define CreateFile CreateFileA
+    #define CreateFileMapping CreateFileMappingA
     #define GetCommandLine GetCommandLineA
     #define getcwd _getcwd
     #define chdir _chdir
@@ -202,6 +220,7 @@
     typedef unsigned int gid_t;
     typedef long blksize_t;
     typedef long blkcnt_t;
+    typedef unsigned long pthread_t;
     
     #define STDIN_FILENO 0
     #define STDOUT_FILENO 1
@@ -234,6 +253,18 @@
     #define O_RDWR 02
     #define O_CREAT 0100
     #define EAGAIN 11
+    #define POLLIN 0x001
+    #define POLLOUT 0x004
+    #define PROT_READ 0x1
+    #define MAP_PRIVATE 0x02
+    #define MAP_FAILED ((void *)-1)
+    #if defined(__APPLE__)
+        #define _SC_NPROCESSORS_ONLN 58
+    #elif defined(__ANDROID__)
+        #define _SC_NPROCESSORS_ONLN 97
+    #else
+        #define _SC_NPROCESSORS_ONLN 84
+    #endif
     
     typedef unsigned char cc_t;
     typedef unsigned int speed_t;
@@ -284,10 +315,17 @@
     
     typedef struct __dirstream DIR;
     
+    struct pollfd {
+        int fd;
+        short events;
+        short revents;
+    };
+    
     /* Unix system call declarations */
     extern ssize_t read(int fd, void *buf, size_t count);
     extern ssize_t write(int fd, const void *buf, size_t count);
     extern int ioctl(int fd, unsigned long request, ...);
+    extern int poll(struct pollfd *fds, unsigned long nfds, int timeout);
     extern int tcgetattr(int fd, struct termios *termios_p);
     extern int tcsetattr(int fd, int optional_actions, const struct termios *termios_p);
     extern int open(const char *pathname, int flags, ...);
@@ -306,8 +344,16 @@
     extern int isatty(int fd);
     extern char *getcwd(char *buf, size_t size);
     extern int chdir(const char *path);
+    extern int mkdir(const char *pathname, mode_t mode);
     extern void exit(int status);
     extern void perror(const char *s);
+    extern long sysconf(int name);
+    extern int pthread_create(pthread_t *thread, const void *attr, void *(*start_routine)(void *), void *arg);
+    extern int pthread_join(pthread_t thread, void **retval);
+    extern int sched_yield(void);
+    extern off_t lseek(int fd, off_t offset, int whence);
+    extern void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+    extern int munmap(void *addr, size_t length);
 #endif
 
 /* Version information */
@@ -318,9 +364,16 @@
 #define EDE_MAX_LINE_LENGTH 4096
 #define EDE_TAB_SIZE 4
 #define EDE_UNDO_STACK_SIZE 1000
-#define EDE_MAX_SEARCH_RESULTS 1000
 #define EDE_MAX_MODULES 64
 #define EDE_MODULE_NAME_MAX 256
+#define MAX_PATH_LENGTH 512
+#define EDE_SYNTAX_IDLE_ROWS 1024
+#define EDE_SYNTAX_CHECKPOINT 256
+#define EDE_SYNTAX_SYNC_ROWS 4096
+#define EDE_HL_CACHE_SPARE 4096
+#define EDE_BRACKET_BLOCK 64
+#define EDE_BRACKET_LEX_ROWS 1024
+#define EDE_BENCH_ITERATIONS 20
 
 /* Key codes */
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -346,7 +399,13 @@ typedef enum {
     COLOR_FUNCTION,
     COLOR_PREPROCESSOR,
     COLOR_OPERATOR,
-    COLOR_TYPE
+    COLOR_TYPE,
+    COLOR_LINENR,
+    COLOR_BRACKET1,     /* rainbow brackets, by depth modulo 3 */
+    COLOR_BRACKET2,
+    COLOR_BRACKET3,
+    COLOR_MATCH,        /* search matches, drawn over the other classes */
+    COLOR_COUNT
 } ColorType;
 
 /* Editor modes */
@@ -406,9 +465,13 @@ typedef struct EditorRow {
     int rsize;
     char *chars;
     char *render;
-    unsigned char *hl;
+    unsigned char *hl;          /* points into hl_entry, see HlCache */
+    struct HlEntry *hl_entry;
+    struct BracketSummary *brackets; /* in hl_entry, NULL while stale */
+    int hl_in_comment;
     int hl_open_comment;
     int idx;
+    unsigned int version;       /* new on every render change, never reused */
 } EditorRow;
 
 /* Syntax highlighting structure */
@@ -420,6 +483,8 @@ typedef struct Syntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct KeywordTable *keyword_table; /* built on first use */
+    struct Lexer *lexer; /* compiled lexer of a syntax file, NULL for HLDB */
 } Syntax;
 
 /* Editor configuration */
@@ -451,8 +516,14 @@ typedef struct EditorConfig {
     Module modules[EDE_MAX_MODULES];
     int module_count;
     int show_line_numbers;
+    int relative_line_numbers;
+    int rainbow_brackets;
+    int gutter_width;
+    int gutter_lo, gutter_hi;
     int ctrl_c_pressed;
     time_t ctrl_c_time;
+    int sync_output;
+    int headless;
 #ifdef EDE_WINDOWS
     HANDLE hStdout;
     HANDLE hStdin;
@@ -469,6 +540,9 @@ EditorConfig E;
 /* Syntax highlighting definitions */
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
+#define HL_HIGHLIGHT_FUNCTIONS (1<<2)     /* identifier followed by ( */
+#define HL_HIGHLIGHT_PREPROCESSOR (1<<3)  /* # directive at line start */
+#define HL_HIGHLIGHT_OPERATORS (1<<4)
 
 /* C/C++ keywords */
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", ".hpp", ".cc", NULL };
@@ -504,30 +578,61 @@ char *JS_HL_keywords[] = {
 /* Syntax database */
 Syntax HLDB[] = {
     {
-        "c",
-        C_HL_extensions,
-        C_HL_keywords,
-        "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        .filetype = "c",
+        .filematch = C_HL_extensions,
+        .keywords = C_HL_keywords,
+        .singleline_comment_start = "//",
+        .multiline_comment_start = "/*",
+        .multiline_comment_end = "*/",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_FUNCTIONS |
+                 HL_HIGHLIGHT_PREPROCESSOR | HL_HIGHLIGHT_OPERATORS
     },
     {
-        "python",
-        PY_HL_extensions,
-        PY_HL_keywords,
-        "#", "\"\"\"", "\"\"\"",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        .filetype = "python",
+        .filematch = PY_HL_extensions,
+        .keywords = PY_HL_keywords,
+        .singleline_comment_start = "#",
+        .multiline_comment_start = "\"\"\"",
+        .multiline_comment_end = "\"\"\"",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
     },
     {
-        "javascript",
-        JS_HL_extensions,
-        JS_HL_keywords,
-        "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        .filetype = "javascript",
+        .filematch = JS_HL_extensions,
+        .keywords = JS_HL_keywords,
+        .singleline_comment_start = "//",
+        .multiline_comment_start = "/*",
+        .multiline_comment_end = "*/",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
     },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+/* Output queue, defined with the string buffer below */
+void editorQueueOutput(const char *s, int len);
+int editorFlushOutput(void);
+void editorClearScreen(void);
+
+/* Headless mode, defined with the VT screen emulation below */
+int headlessReadByte(char *c);
+int headlessInputPending(void);
+void headlessWrite(const char *s, int len);
+void headlessRecordFrame(long long build_ns, int bytes);
+int editorDecodeKey(char c);
+
+/* Deferred syntax work, defined with the highlighter below */
+void editorRunIdle(void);
+int editorSyntaxEnsure(int from, int to, int budget);
+int editorSyntaxLexedRows(void);
+
+/* Background searches, defined with search and replace, the line
+   finder and project search below */
+int searchIdle(void);
+int finderIdle(void);
+int grepIdle(void);
+void editorRefreshScreen(void);
+
 /*** Terminal control - Bare metal implementation ***/
 
 #ifdef EDE_WINDOWS
@@ -586,11 +691,30 @@ void enableRawMode(void) {
     atexit(disableRawMode);
 }
 
+int editorReadByte(char *c) {
+    if (E.headless) return headlessReadByte(c);
+    return 0;
+}
+
+int editorInputPending(void) {
+    DWORD events = 0;
+    if (E.headless) return headlessInputPending();
+    GetNumberOfConsoleInputEvents(E.hStdin, &events);
+    return events > 0;
+}
+
 int editorReadKey(void) {
     DWORD nread;
     char c;
     INPUT_RECORD irInBuf;
     
+    editorRunIdle();
+    
+    if (E.headless) {
+        if (editorReadByte(&c) != 1) return '\x1b';
+        return editorDecodeKey(c);
+    }
+    
     while (1) {
         if (!ReadConsoleInput(E.hStdin, &irInBuf, 1, &nread)) {
             die("ReadConsoleInput");
@@ -692,8 +816,9 @@ int getWindowSize(int *rows, int *cols) {
 #else /* Unix/Linux/macOS */
 
 void die(const char *s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    int saved_errno = errno;
+    editorClearScreen();
+    errno = saved_errno;
     perror(s);
     exit(1);
 }
@@ -719,22 +844,151 @@ void enableRawMode(void) {
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 }
 
+/* Bytes read ahead of the key loop: keys typed while startup waited for
+   a terminal reply */
+char input_ahead[128];
+int input_ahead_len = 0;
+int input_ahead_pos = 0;
+
+int editorReadByte(char *c) {
+    if (E.headless) return headlessReadByte(c);
+    if (input_ahead_pos < input_ahead_len) {
+        *c = input_ahead[input_ahead_pos++];
+        return 1;
+    }
+    return read(STDIN_FILENO, c, 1);
+}
+
+int editorInputPending(void) {
+    if (E.headless) return headlessInputPending();
+    if (input_ahead_pos < input_ahead_len) return 1;
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
 int editorReadKey(void) {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    
+    editorRunIdle();
+    
+    while ((nread = editorReadByte(&c)) != 1) {
+        if (E.headless) return '\x1b';
         if (nread == -1 && errno != EAGAIN) die("read");
+        int changed = searchIdle();
+        changed |= grepIdle();
+        if (changed) editorRefreshScreen();
+    }
+    
+    return editorDecodeKey(c);
+}
+
+int getWindowSize(int *rows, int *cols) {
+    struct winsize ws;
+    
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        return -1;
+    } else {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+void handleSigwinch(int sig) {
+    (void)sig;
+    getWindowSize(&E.screenrows, &E.screencols);
+    E.screenrows -= 2;
+}
+
+/* Length of the terminal reply ESC [ ? <digits and ;> <final> at s, 0
+   if there is none, or -1 if s[0..n) could be the start of one. final
+   gets its last byte, 'c' for DA1 and 'y' for DECRPM. */
+int editorTermReply(const char *s, int n, char *final) {
+    static const char lead[] = "\x1b[?";
+    for (int i = 0; i < 3; i++) {
+        if (i == n) return -1;
+        if (s[i] != lead[i]) return 0;
+    }
+    int i = 3;
+    while (i < n && (isdigit((unsigned char)s[i]) || s[i] == ';')) i++;
+    if (i == n) return -1;
+    if (s[i] == 'c') {
+        *final = 'c';
+        return i + 1;
+    }
+    if (s[i] != '$') return 0;
+    if (i + 1 == n) return -1;
+    if (s[i + 1] != 'y') return 0;
+    *final = 'y';
+    return i + 2;
+}
+
+int editorDetectSyncOutput(void) {
+    /* Ask for the state of DEC private mode 2026 (DECRQM), then send a
+       primary device attributes request. Every VT100-compatible terminal
+       answers DA1, so its reply tells us when to stop waiting for the
+       first one. */
+    char buf[128];
+    int len = 0;
+    int idle = 0;
+    int answered = 0;
+    int sync = 0;
+    
+    editorQueueOutput("\x1b[?2026$p\x1b[c", 13);
+    if (editorFlushOutput() == -1) return 0;
+    
+    while (!answered && len < (int)sizeof(buf) && idle < 3) {
+        int nread = read(STDIN_FILENO, &buf[len], sizeof(buf) - len);
+        if (nread <= 0) {
+            idle++;
+            continue;
+        }
+        len += nread;
+        
+        /* Take the replies out; anything else was typed and goes back to
+           the key loop. A reply cut short stays in buf for the next read. */
+        int i = 0;
+        while (i < len) {
+            char final;
+            int n = editorTermReply(&buf[i], len - i, &final);
+            if (n < 0) break;
+            if (n > 0) {
+                /* DECRPM: ESC [ ? 2026 ; Ps $ y, Ps 1/2 = set/reset, 3 = always set */
+                if (final == 'y' && n > 9 && strncmp(&buf[i], "\x1b[?2026;", 8) == 0)
+                    sync = buf[i + 8] == '1' || buf[i + 8] == '2' || buf[i + 8] == '3';
+                if (final == 'c') answered = 1;
+                i += n;
+            } else if (input_ahead_len < (int)sizeof(input_ahead)) {
+                input_ahead[input_ahead_len++] = buf[i++];
+            } else {
+                i++;
+            }
+        }
+        memmove(buf, &buf[i], len - i);
+        len -= i;
     }
     
+    /* An unanswered tail was typed too */
+    for (int i = 0; i < len && input_ahead_len < (int)sizeof(input_ahead); i++)
+        input_ahead[input_ahead_len++] = buf[i];
+    return sync;
+}
+
+#endif
+
+/* Decode a VT key sequence starting with byte c, reading the rest of it
+   through editorReadByte */
+int editorDecodeKey(char c) {
     if (c == '\x1b') {
         char seq[3];
         
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (editorReadByte(&seq[0]) != 1) return '\x1b';
+        if (editorReadByte(&seq[1]) != 1) return '\x1b';
         
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if (editorReadByte(&seq[2]) != 1) return '\x1b';
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return KEY_HOME;
@@ -769,41 +1023,40 @@ int editorReadKey(void) {
     }
 }
 
-int getWindowSize(int *rows, int *cols) {
-    struct winsize ws;
-    
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        return -1;
-    } else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
-    }
-}
-
-void handleSigwinch(int sig) {
-    (void)sig;
-    getWindowSize(&E.screenrows, &E.screencols);
-    E.screenrows -= 2;
-}
-
+long long editorNowNs(void) {
+#ifdef EDE_WINDOWS
+    long long count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (long long)((double)count * 1e9 / (double)freq);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 #endif
+}
 
 /*** String buffer for efficient screen rendering ***/
 
 typedef struct StringBuffer {
     char *b;
     int len;
+    int cap;
 } StringBuffer;
 
-#define STRBUF_INIT {NULL, 0}
+#define STRBUF_INIT {NULL, 0, 0}
 
 void sbAppend(StringBuffer *sb, const char *s, int len) {
-    char *new = realloc(sb->b, sb->len + len);
-    
-    if (new == NULL) return;
-    memcpy(&new[sb->len], s, len);
-    sb->b = new;
+    if (sb->len + len > sb->cap) {
+        int newcap = sb->cap ? sb->cap * 2 : 4096;
+        while (newcap < sb->len + len) newcap *= 2;
+        
+        char *new = realloc(sb->b, newcap);
+        if (new == NULL) return;
+        sb->b = new;
+        sb->cap = newcap;
+    }
+    memcpy(&sb->b[sb->len], s, len);
     sb->len += len;
 }
 
@@ -811,6 +1064,461 @@ void sbFree(StringBuffer *sb) {
     free(sb->b);
 }
 
+/*** Output queue ***/
+
+/* Everything sent to the terminal is queued here and leaves in a single
+   write per frame. The buffer keeps its capacity between frames. */
+StringBuffer output_queue = STRBUF_INIT;
+
+void editorQueueOutput(const char *s, int len) {
+    sbAppend(&output_queue, s, len);
+}
+
+int editorFlushOutput(void) {
+    const char *p = output_queue.b;
+    int left = output_queue.len;
+    
+    if (E.headless) {
+        headlessWrite(p, left);
+        output_queue.len = 0;
+        return 0;
+    }
+    
+#ifdef EDE_WINDOWS
+    while (left > 0) {
+        DWORD written;
+        if (!WriteFile(E.hStdout, p, left, &written, NULL) || written == 0) break;
+        p += written;
+        left -= written;
+    }
+#else
+    while (left > 0) {
+        ssize_t n = write(STDOUT_FILENO, p, left);
+        if (n > 0) {
+            p += n;
+            left -= n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            /* Non-blocking tty is full: wait until it drains */
+            struct pollfd pfd = { STDOUT_FILENO, POLLOUT, 0 };
+            poll(&pfd, 1, 100);
+        } else {
+            break;
+        }
+    }
+#endif
+    
+    output_queue.len = 0;
+    return left == 0 ? 0 : -1;
+}
+
+void editorClearScreen(void) {
+    editorQueueOutput("\x1b[2J\x1b[H", 7);
+    editorFlushOutput();
+}
+
+/*** Character classes ***/
+
+/* One table classifies every byte for the highlighter and the word
+   scanners, and the scan helpers below test 16 bytes at a time with
+   SSE2 or NEON where available. The vector masks spell out the same sets
+   as charClassInit and must be kept in step with it. */
+
+#if defined(__SSE2__) && defined(__GNUC__)
+    /* <emmintrin.h> brings in C library declarations that clash with the
+       bare metal ones, so the few SSE2 operations used here are spelled
+       with the compiler's vector extensions instead */
+    typedef long long __m128i __attribute__((vector_size(16), may_alias));
+    typedef long long EdeM128Unaligned __attribute__((vector_size(16), may_alias, aligned(1)));
+    typedef char EdeBytes __attribute__((vector_size(16)));
+    typedef unsigned char EdeUBytes __attribute__((vector_size(16)));
+    #define _mm_loadu_si128(p) (*(const EdeM128Unaligned *)(p))
+    #define _mm_setzero_si128() ((__m128i){0, 0})
+    #define _mm_set1_epi8(c) ((__m128i)((EdeBytes){0} + (char)(c)))
+    #define _mm_and_si128(a, b) ((a) & (b))
+    #define _mm_or_si128(a, b) ((a) | (b))
+    #define _mm_cmpeq_epi8(a, b) ((__m128i)((EdeBytes)(a) == (EdeBytes)(b)))
+    #define _mm_max_epu8(a, b) (((__m128i)((EdeUBytes)(a) > (EdeUBytes)(b)) & (a)) | \
+                                (~(__m128i)((EdeUBytes)(a) > (EdeUBytes)(b)) & (b)))
+    #define _mm_min_epu8(a, b) (((__m128i)((EdeUBytes)(a) < (EdeUBytes)(b)) & (a)) | \
+                                (~(__m128i)((EdeUBytes)(a) < (EdeUBytes)(b)) & (b)))
+    #define _mm_movemask_epi8(a) __builtin_ia32_pmovmskb128((EdeBytes)(a))
+    #define EDE_SIMD_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+    #define EDE_SIMD_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define EDE_SIMD_NEON 1
+#endif
+
+#if defined(EDE_SIMD_NEON)
+/* No movemask on NEON: weight each lane by its bit and add up halves */
+unsigned int simdMovemask(uint8x16_t m) {
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t bits = vandq_u8(m, vld1q_u8(weights));
+    return vaddv_u8(vget_low_u8(bits)) | (vaddv_u8(vget_high_u8(bits)) << 8);
+}
+#endif
+
+#define CHAR_SPACE (1<<0)  /* isspace */
+#define CHAR_SEP   (1<<1)  /* ends a token: whitespace, NUL, punctuation */
+#define CHAR_IDENT (1<<2)  /* [A-Za-z0-9_] */
+#define CHAR_DIGIT (1<<3)  /* [0-9] */
+#define CHAR_ALPHA (1<<4)  /* [A-Za-z] */
+#define CHAR_BRACKET (1<<5) /* ()[]{} */
+#define CHAR_OPERATOR (1<<6) /* arithmetic, comparison and logic */
+
+unsigned char char_class[256];
+unsigned char char_fold[256];  /* ASCII letters to lower case */
+
+void charClassInit(void) {
+    for (int c = 0; c < 256; c++) {
+        int cls = 0;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) cls |= CHAR_SPACE | CHAR_SEP;
+        if (c == '\0' || (c && strchr(",.()+-/*=~%<>[];", c))) cls |= CHAR_SEP;
+        if (c >= '0' && c <= '9') cls |= CHAR_DIGIT | CHAR_IDENT;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) cls |= CHAR_ALPHA | CHAR_IDENT;
+        if (c == '_') cls |= CHAR_IDENT;
+        if (c && strchr("()[]{}", c)) cls |= CHAR_BRACKET;
+        if (c && strchr("+-*/%=<>!&|^~?:", c)) cls |= CHAR_OPERATOR;
+        char_class[c] = cls;
+        char_fold[c] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+    }
+}
+
+#define charIs(c, cls) (char_class[(unsigned char)(c)] & (cls))
+
+/* Bit i of the result is set if p[i] is in any of the classes in `cls`,
+   for CHAR_SEP, CHAR_IDENT, CHAR_DIGIT and CHAR_BRACKET */
+unsigned int charClassMask16(const char *p, int cls) {
+#if defined(EDE_SIMD_SSE2)
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i m = _mm_setzero_si128();
+#define SSE_EQ(c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define SSE_RANGE(x, lo, hi) _mm_and_si128( \
+        _mm_cmpeq_epi8(_mm_max_epu8(x, _mm_set1_epi8(lo)), x), \
+        _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(hi)), x))
+    if (cls & CHAR_SEP) {
+        /* The punctuation is mostly the ranges '(' to '/' and ';' to '>' */
+        m = _mm_or_si128(m, _mm_or_si128(SSE_EQ(' '), SSE_EQ('\0')));
+        m = _mm_or_si128(m, SSE_RANGE(v, '\t', '\r'));
+        m = _mm_or_si128(m, SSE_RANGE(v, '(', '/'));
+        m = _mm_or_si128(m, SSE_RANGE(v, ';', '>'));
+        m = _mm_or_si128(m, _mm_or_si128(SSE_EQ('%'), SSE_EQ('~')));
+        m = _mm_or_si128(m, _mm_or_si128(SSE_EQ('['), SSE_EQ(']')));
+    }
+    if (cls & (CHAR_DIGIT | CHAR_IDENT)) m = _mm_or_si128(m, SSE_RANGE(v, '0', '9'));
+    if (cls & CHAR_IDENT) {
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        m = _mm_or_si128(m, _mm_or_si128(SSE_RANGE(lower, 'a', 'z'), SSE_EQ('_')));
+    }
+    if (cls & CHAR_BRACKET) {
+        /* '[' and ']' are '{' and '}' with bit 5 clear */
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        m = _mm_or_si128(m, SSE_RANGE(v, '(', ')'));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                                         _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))));
+    }
+#undef SSE_EQ
+#undef SSE_RANGE
+    return (unsigned int)_mm_movemask_epi8(m);
+#elif defined(EDE_SIMD_NEON)
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    uint8x16_t m = vdupq_n_u8(0);
+#define NEON_EQ(c) vceqq_u8(v, vdupq_n_u8(c))
+#define NEON_RANGE(x, lo, hi) vcleq_u8(vsubq_u8(x, vdupq_n_u8(lo)), vdupq_n_u8((hi) - (lo)))
+    if (cls & CHAR_SEP) {
+        m = vorrq_u8(m, vorrq_u8(NEON_EQ(' '), NEON_EQ('\0')));
+        m = vorrq_u8(m, NEON_RANGE(v, '\t', '\r'));
+        m = vorrq_u8(m, NEON_RANGE(v, '(', '/'));
+        m = vorrq_u8(m, NEON_RANGE(v, ';', '>'));
+        m = vorrq_u8(m, vorrq_u8(NEON_EQ('%'), NEON_EQ('~')));
+        m = vorrq_u8(m, vorrq_u8(NEON_EQ('['), NEON_EQ(']')));
+    }
+    if (cls & (CHAR_DIGIT | CHAR_IDENT)) m = vorrq_u8(m, NEON_RANGE(v, '0', '9'));
+    if (cls & CHAR_IDENT) {
+        uint8x16_t lower = vorrq_u8(v, vdupq_n_u8(0x20));
+        m = vorrq_u8(m, vorrq_u8(NEON_RANGE(lower, 'a', 'z'), NEON_EQ('_')));
+    }
+    if (cls & CHAR_BRACKET) {
+        uint8x16_t lower = vorrq_u8(v, vdupq_n_u8(0x20));
+        m = vorrq_u8(m, NEON_RANGE(v, '(', ')'));
+        m = vorrq_u8(m, vorrq_u8(vceqq_u8(lower, vdupq_n_u8('{')), vceqq_u8(lower, vdupq_n_u8('}'))));
+    }
+#undef NEON_EQ
+#undef NEON_RANGE
+    return simdMovemask(m);
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < 16; i++)
+        if (charIs(p[i], cls)) mask |= 1u << i;
+    return mask;
+#endif
+}
+
+int charLowestBit(unsigned int mask) {
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* Index of the first byte of s[from, n) in one of the classes, or n */
+int charFindClass(const char *s, int from, int n, int cls) {
+    int i = from;
+    while (i + 16 <= n) {
+        unsigned int mask = charClassMask16(&s[i], cls);
+        if (mask) return i + charLowestBit(mask);
+        i += 16;
+    }
+    while (i < n && !charIs(s[i], cls)) i++;
+    return i;
+}
+
+/* Index of the first byte of s[from, n) in none of the classes, or n */
+int charSkipClass(const char *s, int from, int n, int cls) {
+    int i = from;
+    while (i + 16 <= n) {
+        unsigned int mask = ~charClassMask16(&s[i], cls) & 0xffff;
+        if (mask) return i + charLowestBit(mask);
+        i += 16;
+    }
+    while (i < n && charIs(s[i], cls)) i++;
+    return i;
+}
+
+/*** Threads ***/
+
+/* Just enough threading for fork-join work over row ranges: start a
+   worker, join it, and count the CPUs to size the pool. Shared counters
+   go through the atomic macros below, and the few shared lists through
+   a spin lock. */
+
+#define EDE_MAX_THREADS 16
+
+#if defined(_MSC_VER)
+    long _InterlockedExchangeAdd(long volatile *addend, long value);
+    long _InterlockedExchange(long volatile *target, long value);
+    #define atomicAdd(p, v) (_InterlockedExchangeAdd((long volatile *)(p), (v)) + (v))
+    #define atomicLoad(p) (*(volatile int *)(p))
+    #define atomicStore(p, v) _InterlockedExchange((long volatile *)(p), (v))
+    #define atomicSwap(p, v) _InterlockedExchange((long volatile *)(p), (v))
+#else
+    #define atomicAdd(p, v) __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+    #define atomicLoad(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+    #define atomicStore(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+    #define atomicSwap(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#endif
+
+typedef struct EdeThread {
+#ifdef EDE_WINDOWS
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    void *(*fn)(void *);
+    void *arg;
+} EdeThread;
+
+#ifdef EDE_WINDOWS
+DWORD __stdcall threadTrampoline(LPVOID param) {
+    EdeThread *t = param;
+    t->fn(t->arg);
+    return 0;
+}
+#endif
+
+/* Returns 0 on success */
+int threadStart(EdeThread *t, void *(*fn)(void *), void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+#ifdef EDE_WINDOWS
+    t->handle = CreateThread(NULL, 0, threadTrampoline, t, 0, NULL);
+    return t->handle ? 0 : -1;
+#else
+    return pthread_create(&t->handle, NULL, fn, arg);
+#endif
+}
+
+void threadJoin(EdeThread *t) {
+#ifdef EDE_WINDOWS
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->handle, NULL);
+#endif
+}
+
+void threadYield(void) {
+#ifdef EDE_WINDOWS
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+/* Only for a handful of instructions at a time, like a push or a pop */
+void spinLock(int *lock) {
+    while (atomicSwap(lock, 1)) threadYield();
+}
+
+void spinUnlock(int *lock) {
+    atomicStore(lock, 0);
+}
+
+int threadCount(void) {
+    static int count = 0;
+    if (count == 0) {
+#ifdef EDE_WINDOWS
+        long n = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#else
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (n < 1) n = 1;
+        if (n > EDE_MAX_THREADS) n = EDE_MAX_THREADS;
+        count = n;
+    }
+    return count;
+}
+
+/*** Substring search ***/
+
+/* Literal search over row bytes. With SSE2 or NEON, 16 candidate
+   positions are tested at once by comparing the pattern's first and last
+   bytes against two overlapping loads; only positions where both agree
+   are compared in full. Elsewhere, Horspool's bad-character shifts skip
+   ahead by up to the pattern length.
+   
+   Ignoring case never folds the text. A lower case pattern letter p
+   matches exactly the bytes x with (x | 0x20) == p, so each pattern byte
+   gets a case mask, 0x20 for letters and 0 otherwise, and text bytes are
+   ORed with it before an ordinary compare. That is one extra operation
+   per vector, and none when the mask is 0. */
+
+typedef struct Searcher {
+    unsigned char *pat;    /* folded when ignoring case */
+    unsigned char *mask;   /* case mask per pattern byte, all 0 when matching case */
+    int len;
+    int ignore_case;
+    int shift[256];        /* Horspool shift for the byte under the last position */
+} Searcher;
+
+void searcherInit(Searcher *s, const char *pattern, int len, int ignore_case) {
+    s->pat = malloc(len + 1);
+    s->mask = malloc(len + 1);
+    s->len = len;
+    s->ignore_case = ignore_case;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = pattern[i];
+        s->pat[i] = ignore_case ? char_fold[c] : c;
+        s->mask[i] = (ignore_case && char_fold[c] != toupper(c)) ? 0x20 : 0;
+    }
+    s->pat[len] = '\0';
+    s->mask[len] = 0;
+    
+    for (int c = 0; c < 256; c++) s->shift[c] = len;
+    for (int i = 0; i + 1 < len; i++) {
+        s->shift[s->pat[i]] = len - 1 - i;
+        if (ignore_case && s->pat[i] != (unsigned char)toupper(s->pat[i]))
+            s->shift[toupper(s->pat[i])] = len - 1 - i;
+    }
+}
+
+void searcherFree(Searcher *s) {
+    free(s->pat);
+    free(s->mask);
+    s->pat = NULL;
+    s->mask = NULL;
+}
+
+int searcherVerify(Searcher *s, const unsigned char *t) {
+    if (!s->ignore_case) return memcmp(t, s->pat, s->len) == 0;
+    int i = 0;
+#if defined(EDE_SIMD_SSE2)
+    for (; i + 16 <= s->len; i += 16) {
+        __m128i x = _mm_or_si128(_mm_loadu_si128((const __m128i *)&t[i]),
+                                 _mm_loadu_si128((const __m128i *)&s->mask[i]));
+        __m128i p = _mm_loadu_si128((const __m128i *)&s->pat[i]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, p)) != 0xffff) return 0;
+    }
+#elif defined(EDE_SIMD_NEON)
+    for (; i + 16 <= s->len; i += 16) {
+        uint8x16_t x = vorrq_u8(vld1q_u8(&t[i]), vld1q_u8(&s->mask[i]));
+        if (vminvq_u8(vceqq_u8(x, vld1q_u8(&s->pat[i]))) != 0xff) return 0;
+    }
+#endif
+    for (; i < s->len; i++)
+        if ((t[i] | s->mask[i]) != s->pat[i]) return 0;
+    return 1;
+}
+
+int searcherHorspool(Searcher *s, const unsigned char *t, int from, int n) {
+    int m = s->len;
+    unsigned char last = s->pat[m - 1];
+    unsigned char last_case = s->mask[m - 1];
+    
+    for (int i = from; i + m <= n; ) {
+        unsigned char c = t[i + m - 1];
+        if ((c | last_case) == last && searcherVerify(s, &t[i])) return i;
+        i += s->shift[c];
+    }
+    return -1;
+}
+
+/* Index of the first match in text[from, n), or -1 */
+int searcherFind(Searcher *s, const char *text, int from, int n) {
+    const unsigned char *t = (const unsigned char *)text;
+    int m = s->len;
+    if (m == 0) return from <= n ? from : -1;
+    if (n - from < m) return -1;
+    
+    int i = from;
+    int last = n - m;  /* last position a match can start at */
+    
+#if defined(EDE_SIMD_SSE2)
+    __m128i first = _mm_set1_epi8(s->pat[0]);
+    __m128i final = _mm_set1_epi8(s->pat[m - 1]);
+    __m128i first_case = _mm_set1_epi8(s->mask[0]);
+    __m128i final_case = _mm_set1_epi8(s->mask[m - 1]);
+    for (; i + 15 <= last; i += 16) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)&t[i]), first_case);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)&t[i + m - 1]), final_case);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+        while (mask) {
+            int k = charLowestBit(mask);
+            if (searcherVerify(s, &t[i + k])) return i + k;
+            mask &= mask - 1;
+        }
+    }
+#elif defined(EDE_SIMD_NEON)
+    uint8x16_t first = vdupq_n_u8(s->pat[0]);
+    uint8x16_t final = vdupq_n_u8(s->pat[m - 1]);
+    uint8x16_t first_case = vdupq_n_u8(s->mask[0]);
+    uint8x16_t final_case = vdupq_n_u8(s->mask[m - 1]);
+    for (; i + 15 <= last; i += 16) {
+        uint8x16_t a = vorrq_u8(vld1q_u8(&t[i]), first_case);
+        uint8x16_t b = vorrq_u8(vld1q_u8(&t[i + m - 1]), final_case);
+        unsigned int mask = simdMovemask(vandq_u8(vceqq_u8(a, first), vceqq_u8(b, final)));
+        while (mask) {
+            int k = charLowestBit(mask);
+            if (searcherVerify(s, &t[i + k])) return i + k;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    
+    return searcherHorspool(s, t, i, n);
+}
+
 /*** Undo/Redo system ***/
 
 void addUndoAction(ActionType type, int row, int col, const char *text, int text_len) {
@@ -878,11 +1586,12 @@ void performRedo(void) {
 /*** Advanced Module System ***/
 
 /* Forward declarations to resolve order dependencies */
+/* Matches are kept in one array sorted by (row, col), so next/prev is a
+   binary search from the cursor rather than a walk */
 typedef struct SearchMatch {
     int row;
     int col;
     int length;
-    struct SearchMatch *next;
 } SearchMatch;
 
 typedef struct SearchContext {
@@ -891,14 +1600,30 @@ typedef struct SearchContext {
     int query_len;
     int replace_len;
     SearchMatch *matches;
-    SearchMatch *current_match;
     int match_count;
+    int match_cap;
+    int current_match;      /* index into matches, -1 when none */
     int case_sensitive;
     int whole_word;
     int use_regex;
+    int ignore_case;        /* :set ignorecase */
+    int smart_case;         /* :set smartcase, upper case in a query matches case */
 } SearchContext;
 
-SearchContext search_ctx = {0};
+SearchContext search_ctx = {.current_match = -1};
+
+/* Whether a typed query should match case under the ignorecase and
+   smartcase options. Escaped letters in a regex (\W, \S) are classes,
+   not upper case. */
+int searchCaseSensitive(const char *query) {
+    if (!search_ctx.ignore_case) return 1;
+    if (!search_ctx.smart_case) return 0;
+    for (const char *p = query; *p; p++) {
+        if (search_ctx.use_regex && *p == '\\' && p[1]) p++;
+        else if (isupper((unsigned char)*p)) return 1;
+    }
+    return 0;
+}
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorUpdateRow(EditorRow *row);
@@ -907,6 +1632,7 @@ void editorDelRow(int at);
 int editorSave(void);
 void findAllMatches(void);
 void replaceAllMatches(void);
+void searchFinish(void);
 void editorRefreshScreen(void);
 
 /* Module scripting language support */
@@ -1135,7 +1861,7 @@ int moduleTokenize(ModuleScript *script, const char *source) {
         char c = source[pos];
         
         /* Skip whitespace */
-        if (isspace(c)) {
+        if (charIs(c, CHAR_SPACE)) {
             if (c == '\n') {
                 line++;
                 col = 1;
@@ -1170,10 +1896,10 @@ int moduleTokenize(ModuleScript *script, const char *source) {
         }
         
         /* Numbers */
-        if (isdigit(c)) {
+        if (charIs(c, CHAR_DIGIT)) {
             token->type = MODTOKEN_NUMBER;
             int val_pos = 0;
-            while (pos < script->source_len && (isdigit(source[pos]) || source[pos] == '.') && val_pos < 255) {
+            while (pos < script->source_len && (charIs(source[pos], CHAR_DIGIT) || source[pos] == '.') && val_pos < 255) {
                 token->value[val_pos++] = source[pos++];
             }
             token->value[val_pos] = '\0';
@@ -1181,9 +1907,9 @@ int moduleTokenize(ModuleScript *script, const char *source) {
         }
         
         /* Keywords and identifiers */
-        if (isalpha(c) || c == '_') {
+        if (charIs(c, CHAR_ALPHA) || c == '_') {
             int val_pos = 0;
-            while (pos < script->source_len && (isalnum(source[pos]) || source[pos] == '_') && val_pos < 255) {
+            while (pos < script->source_len && charIs(source[pos], CHAR_IDENT) && val_pos < 255) {
                 token->value[val_pos++] = source[pos++];
             }
             token->value[val_pos] = '\0';
@@ -1569,1021 +2295,4617 @@ void unloadModules(void) {
     E.module_count = 0;
 }
 
-/*** Syntax highlighting ***/
+/*** Regular expressions ***/
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+/* A small regex engine shared by syntax definitions and search. Patterns
+   are parsed into a Thompson NFA, which syntax lexers turn into a DFA up
+   front. Supported: literals, ".", [...] and [^...] with ranges, the
+   escapes \d \w \s \t \n and escaped metacharacters, (...), | * + ? */
+
+#define REGEX_MAX_DFA_STATES 4096
+
+typedef struct NfaState {
+    int set;      /* byte set consumed by this state, -1 if none */
+    int out;      /* state reached after consuming a byte of the set */
+    int eps[2];   /* epsilon moves, -1 if unused */
+    int accept;   /* rule number + 1 on accepting states */
+} NfaState;
+
+typedef struct Nfa {
+    NfaState *states;
+    int count;
+    int cap;
+    unsigned char (*sets)[32];
+    int nsets;
+    int setcap;
+    int start;
+} Nfa;
+
+typedef struct NfaFrag {
+    int start;
+    int end;
+} NfaFrag;
+
+typedef struct RegexParser {
+    const char *p;
+    Nfa *nfa;
+    const char *error;
+    int ignore_case;
+} RegexParser;
+
+int nfaAddState(Nfa *nfa) {
+    if (nfa->count == nfa->cap) {
+        nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+        nfa->states = realloc(nfa->states, sizeof(NfaState) * nfa->cap);
+    }
+    NfaState *st = &nfa->states[nfa->count];
+    st->set = -1;
+    st->out = -1;
+    st->eps[0] = st->eps[1] = -1;
+    st->accept = 0;
+    return nfa->count++;
 }
 
-void editorUpdateSyntax(EditorRow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, COLOR_NORMAL, row->rsize);
-    
-    if (E.syntax == NULL) return;
-    
-    char **keywords = E.syntax->keywords;
-    
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
-    
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
-    
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
-    
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : COLOR_NORMAL;
-        
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], COLOR_COMMENT, row->rsize - i);
-                break;
+int nfaAddSet(Nfa *nfa, const unsigned char *set) {
+    if (nfa->nsets == nfa->setcap) {
+        nfa->setcap = nfa->setcap ? nfa->setcap * 2 : 32;
+        nfa->sets = realloc(nfa->sets, 32 * nfa->setcap);
+    }
+    memcpy(nfa->sets[nfa->nsets], set, 32);
+    return nfa->nsets++;
+}
+
+void nfaEps(Nfa *nfa, int from, int to) {
+    NfaState *st = &nfa->states[from];
+    if (st->eps[0] < 0) st->eps[0] = to;
+    else st->eps[1] = to;
+}
+
+void nfaFree(Nfa *nfa) {
+    free(nfa->states);
+    free(nfa->sets);
+    memset(nfa, 0, sizeof(Nfa));
+}
+
+void regexSetAdd(unsigned char *set, int c) {
+    set[(c & 0xff) >> 3] |= 1 << (c & 7);
+}
+
+int regexSetHas(const unsigned char *set, int c) {
+    return (set[(c & 0xff) >> 3] >> (c & 7)) & 1;
+}
+
+void regexSetRange(unsigned char *set, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) regexSetAdd(set, c);
+}
+
+/* Add what an escape like \d or \. stands for */
+void regexSetEscape(unsigned char *set, char c) {
+    switch (c) {
+        case 'd': regexSetRange(set, '0', '9'); break;
+        case 'w':
+            regexSetRange(set, '0', '9');
+            regexSetRange(set, 'a', 'z');
+            regexSetRange(set, 'A', 'Z');
+            regexSetAdd(set, '_');
+            break;
+        case 's':
+            regexSetAdd(set, ' ');
+            regexSetRange(set, '\t', '\r');
+            break;
+        case 't': regexSetAdd(set, '\t'); break;
+        case 'n': regexSetAdd(set, '\n'); break;
+        default: regexSetAdd(set, c);
+    }
+}
+
+/* Let every letter in the set match either case */
+void regexSetFoldCase(unsigned char *set) {
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (regexSetHas(set, c) || regexSetHas(set, c - 'a' + 'A')) {
+            regexSetAdd(set, c);
+            regexSetAdd(set, c - 'a' + 'A');
+        }
+    }
+}
+
+NfaFrag regexSetFrag(Nfa *nfa, const unsigned char *set) {
+    NfaFrag f;
+    f.start = nfaAddState(nfa);
+    f.end = nfaAddState(nfa);
+    nfa->states[f.start].set = nfaAddSet(nfa, set);
+    nfa->states[f.start].out = f.end;
+    return f;
+}
+
+NfaFrag regexParseAlt(RegexParser *rp);
+
+NfaFrag regexParseAtom(RegexParser *rp) {
+    unsigned char set[32] = {0};
+    char c = *rp->p++;
+    
+    if (c == '(') {
+        NfaFrag f = regexParseAlt(rp);
+        if (*rp->p == ')') rp->p++;
+        else if (!rp->error) rp->error = "missing )";
+        return f;
+    } else if (c == '[') {
+        int negate = (*rp->p == '^');
+        if (negate) rp->p++;
+        /* A ] right after [ or [^ is a literal */
+        int first = 1;
+        while (*rp->p && (*rp->p != ']' || first)) {
+            int lo = (unsigned char)*rp->p++;
+            first = 0;
+            if (lo == '\\' && *rp->p) {
+                regexSetEscape(set, *rp->p++);
+                continue;
+            }
+            if (rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']') {
+                regexSetRange(set, lo, (unsigned char)rp->p[1]);
+                rp->p += 2;
+            } else {
+                regexSetAdd(set, lo);
             }
         }
-        
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = COLOR_COMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], COLOR_COMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], COLOR_COMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
+        if (*rp->p == ']') rp->p++;
+        else rp->error = "missing ]";
+        if (rp->ignore_case) regexSetFoldCase(set);
+        if (negate) for (int i = 0; i < 32; i++) set[i] = ~set[i];
+        return regexSetFrag(rp->nfa, set);
+    } else if (c == '.') {
+        memset(set, 0xff, 32);
+        set['\n' >> 3] &= ~(1 << ('\n' & 7));
+    } else if (c == '\\') {
+        if (*rp->p == '\0') rp->error = "trailing backslash";
+        else regexSetEscape(set, *rp->p++);
+    } else if (c == '*' || c == '+' || c == '?') {
+        rp->error = "nothing to repeat";
+    } else {
+        regexSetAdd(set, c);
+    }
+    if (rp->ignore_case) regexSetFoldCase(set);
+    return regexSetFrag(rp->nfa, set);
+}
+
+NfaFrag regexParseRepeat(RegexParser *rp) {
+    Nfa *nfa = rp->nfa;
+    NfaFrag f = regexParseAtom(rp);
+    
+    while (*rp->p == '*' || *rp->p == '+' || *rp->p == '?') {
+        char op = *rp->p++;
+        int end = nfaAddState(nfa);
+        if (op == '+') {
+            nfaEps(nfa, f.end, f.start);
+            nfaEps(nfa, f.end, end);
+        } else {
+            int start = nfaAddState(nfa);
+            nfaEps(nfa, start, f.start);
+            nfaEps(nfa, start, end);
+            if (op == '*') nfaEps(nfa, f.end, f.start);
+            nfaEps(nfa, f.end, end);
+            f.start = start;
         }
-        
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = COLOR_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = COLOR_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) in_string = 0;
-                i++;
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = COLOR_STRING;
-                    i++;
-                    continue;
-                }
-            }
+        f.end = end;
+    }
+    return f;
+}
+
+NfaFrag regexParseConcat(RegexParser *rp) {
+    NfaFrag f;
+    f.start = f.end = nfaAddState(rp->nfa);
+    
+    while (*rp->p && *rp->p != '|' && *rp->p != ')' && !rp->error) {
+        NfaFrag next = regexParseRepeat(rp);
+        nfaEps(rp->nfa, f.end, next.start);
+        f.end = next.end;
+    }
+    return f;
+}
+
+NfaFrag regexParseAlt(RegexParser *rp) {
+    NfaFrag f = regexParseConcat(rp);
+    
+    while (*rp->p == '|' && !rp->error) {
+        rp->p++;
+        NfaFrag rhs = regexParseConcat(rp);
+        NfaFrag alt;
+        alt.start = nfaAddState(rp->nfa);
+        alt.end = nfaAddState(rp->nfa);
+        nfaEps(rp->nfa, alt.start, f.start);
+        nfaEps(rp->nfa, alt.start, rhs.start);
+        nfaEps(rp->nfa, f.end, alt.end);
+        nfaEps(rp->nfa, rhs.end, alt.end);
+        f = alt;
+    }
+    return f;
+}
+
+/* Make fragment f an alternative of the NFA accepting as rule `rule` */
+void nfaAddAlternative(Nfa *nfa, NfaFrag f, int rule) {
+    nfa->states[f.end].accept = rule + 1;
+    int head = nfaAddState(nfa);
+    nfa->states[head].eps[0] = f.start;
+    nfa->states[head].eps[1] = nfa->start;
+    nfa->start = head;
+}
+
+/* Add a pattern as rule `rule`. Returns NULL or an error message. */
+const char *nfaAddRegex(Nfa *nfa, const char *pattern, int rule) {
+    if (nfa->count == 0) nfa->start = -1;
+    
+    RegexParser rp = {.p = pattern, .nfa = nfa};
+    NfaFrag f = regexParseAlt(&rp);
+    if (!rp.error && *rp.p == ')') rp.error = "unmatched )";
+    if (rp.error) return rp.error;
+    
+    nfaAddAlternative(nfa, f, rule);
+    return NULL;
+}
+
+/* Add a string matched literally as rule `rule` */
+void nfaAddLiteral(Nfa *nfa, const char *s, int rule) {
+    if (nfa->count == 0) nfa->start = -1;
+    
+    NfaFrag f;
+    f.start = f.end = nfaAddState(nfa);
+    for (; *s; s++) {
+        unsigned char set[32] = {0};
+        regexSetAdd(set, *s);
+        NfaFrag c = regexSetFrag(nfa, set);
+        nfaEps(nfa, f.end, c.start);
+        f.end = c.end;
+    }
+    nfaAddAlternative(nfa, f, rule);
+}
+
+/* DFA built from an NFA by subset construction. Bytes the NFA never
+   tells apart share an equivalence class, which keeps the transition
+   table small. State 0 is the dead state and state 1 the start. */
+typedef struct Dfa {
+    unsigned char classes[256];
+    int nclasses;
+    int nstates;
+    unsigned short *next;   /* [state * nclasses + class] */
+    unsigned char *accept;  /* rule number + 1, 0 if not accepting */
+} Dfa;
+
+typedef struct DfaBuilder {
+    Nfa *nfa;
+    Dfa *dfa;
+    int **lists;   /* NFA states making up each DFA state */
+    int *lens;
+    int cap;
+    int *table;    /* hash of a list -> DFA state + 1 */
+    int tsize;
+    int *mark;
+    int gen;
+    int *stack;
+} DfaBuilder;
+
+int intCompare(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Epsilon closure of `in`, keeping only the states that consume a byte or
+   accept, sorted. Returns the number of states written to `out`. */
+int dfaClosure(DfaBuilder *b, int *in, int n, int *out) {
+    int sp = 0, len = 0;
+    b->gen++;
+    for (int i = 0; i < n; i++) {
+        if (b->mark[in[i]] != b->gen) {
+            b->mark[in[i]] = b->gen;
+            b->stack[sp++] = in[i];
         }
-        
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == COLOR_NUMBER)) ||
-                (c == '.' && prev_hl == COLOR_NUMBER)) {
-                row->hl[i] = COLOR_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
+    }
+    while (sp > 0) {
+        NfaState *st = &b->nfa->states[b->stack[--sp]];
+        if (st->set >= 0 || st->accept) out[len++] = st - b->nfa->states;
+        for (int e = 0; e < 2; e++) {
+            int t = st->eps[e];
+            if (t >= 0 && b->mark[t] != b->gen) {
+                b->mark[t] = b->gen;
+                b->stack[sp++] = t;
             }
         }
-        
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
-                
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? COLOR_TYPE : COLOR_KEYWORD, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
+    }
+    qsort(out, len, sizeof(int), intCompare);
+    return len;
+}
+
+/* Find or add the DFA state for a closure. Returns -1 past the limit. */
+int dfaState(DfaBuilder *b, int *list, int len) {
+    Dfa *dfa = b->dfa;
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) h = (h ^ list[i]) * 16777619u;
+    
+    unsigned int slot = h & (b->tsize - 1);
+    while (b->table[slot]) {
+        int s = b->table[slot] - 1;
+        if (b->lens[s] == len && !memcmp(b->lists[s], list, sizeof(int) * len)) return s;
+        slot = (slot + 1) & (b->tsize - 1);
+    }
+    if (dfa->nstates >= REGEX_MAX_DFA_STATES) return -1;
+    
+    int s = dfa->nstates++;
+    if (s == b->cap) {
+        b->cap *= 2;
+        b->lists = realloc(b->lists, sizeof(int *) * b->cap);
+        b->lens = realloc(b->lens, sizeof(int) * b->cap);
+        dfa->next = realloc(dfa->next, sizeof(unsigned short) * b->cap * dfa->nclasses);
+        dfa->accept = realloc(dfa->accept, b->cap);
+    }
+    b->lists[s] = malloc(sizeof(int) * (len ? len : 1));
+    memcpy(b->lists[s], list, sizeof(int) * len);
+    b->lens[s] = len;
+    b->table[slot] = s + 1;
+    
+    int accept = 0;
+    for (int i = 0; i < len; i++) {
+        int a = b->nfa->states[list[i]].accept;
+        if (a && (!accept || a < accept)) accept = a;
+    }
+    dfa->accept[s] = accept;
+    return s;
+}
+
+/* Refine byte classes by every set in the NFA */
+void dfaClasses(Dfa *dfa, Nfa *nfa) {
+    memset(dfa->classes, 0, 256);
+    dfa->nclasses = 1;
+    for (int s = 0; s < nfa->nsets; s++) {
+        int remap[512];
+        int n = 0;
+        for (int i = 0; i < 512; i++) remap[i] = -1;
+        for (int c = 0; c < 256; c++) {
+            int key = dfa->classes[c] * 2 + regexSetHas(nfa->sets[s], c);
+            if (remap[key] < 0) remap[key] = n++;
+            dfa->classes[c] = remap[key];
+        }
+        dfa->nclasses = n;
+    }
+}
+
+void dfaBuilderInit(DfaBuilder *b, Dfa *dfa, Nfa *nfa) {
+    b->nfa = nfa;
+    b->dfa = dfa;
+    b->cap = 64;
+    b->lists = malloc(sizeof(int *) * b->cap);
+    b->lens = malloc(sizeof(int) * b->cap);
+    b->tsize = REGEX_MAX_DFA_STATES * 2;
+    b->table = calloc(b->tsize, sizeof(int));
+    b->mark = calloc(nfa->count, sizeof(int));
+    b->gen = 0;
+    b->stack = malloc(sizeof(int) * nfa->count);
+    dfa->nstates = 0;
+    dfa->next = malloc(sizeof(unsigned short) * b->cap * dfa->nclasses);
+    dfa->accept = malloc(b->cap);
+}
+
+/* Forget every DFA state, keeping the buffers */
+void dfaBuilderReset(DfaBuilder *b) {
+    for (int s = 0; s < b->dfa->nstates; s++) free(b->lists[s]);
+    memset(b->table, 0, sizeof(int) * b->tsize);
+    b->dfa->nstates = 0;
+}
+
+/* Free the builder's bookkeeping; the DFA it built stays */
+void dfaBuilderFree(DfaBuilder *b) {
+    for (int s = 0; s < b->dfa->nstates; s++) free(b->lists[s]);
+    free(b->lists);
+    free(b->lens);
+    free(b->table);
+    free(b->mark);
+    free(b->stack);
+}
+
+/* The state DFA state s moves to on byte c: 0 when dead, -1 past
+   REGEX_MAX_DFA_STATES. `list` and `moved` are scratch space for one int
+   per NFA state. */
+int dfaTransition(DfaBuilder *b, int s, int c, int *list, int *moved) {
+    int n = 0;
+    for (int i = 0; i < b->lens[s]; i++) {
+        NfaState *st = &b->nfa->states[b->lists[s][i]];
+        if (st->set >= 0 && regexSetHas(b->nfa->sets[st->set], c)) moved[n++] = st->out;
+    }
+    if (n == 0) return 0;
+    int len = dfaClosure(b, moved, n, list);
+    return dfaState(b, list, len);
+}
+
+/* Returns 0, or -1 if the DFA would exceed REGEX_MAX_DFA_STATES */
+int dfaBuild(Dfa *dfa, Nfa *nfa) {
+    dfaClasses(dfa, nfa);
+    
+    DfaBuilder b;
+    dfaBuilderInit(&b, dfa, nfa);
+    int *list = malloc(sizeof(int) * nfa->count);
+    int *moved = malloc(sizeof(int) * nfa->count);
+    int ok = 0;
+    
+    dfaState(&b, list, 0);
+    int len = dfaClosure(&b, &nfa->start, 1, list);
+    dfaState(&b, list, len);
+    
+    for (int s = 1; s < dfa->nstates && ok == 0; s++) {
+        for (int cls = 0; cls < dfa->nclasses; cls++) {
+            int c = 0;
+            while (dfa->classes[c] != cls) c++;
+            
+            int t = dfaTransition(&b, s, c, list, moved);
+            if (t < 0) {
+                ok = -1;
+                break;
             }
+            dfa->next[s * dfa->nclasses + cls] = t;
+        }
+    }
+    for (int cls = 0; cls < dfa->nclasses; cls++) dfa->next[cls] = 0;
+    
+    dfaBuilderFree(&b);
+    free(list);
+    free(moved);
+    return ok;
+}
+
+/* Search runs the same NFAs through a DFA built lazily instead: a
+   transition is worked out the first time it is taken and cached, and
+   when the cache fills it starts over from the current state. Every
+   byte costs one table lookup or one subset step, never a backtrack, so
+   a search is linear in the text whatever the pattern. */
+
+#define DFA_UNKNOWN 0xffff
+
+typedef struct LazyDfa {
+    Dfa dfa;
+    DfaBuilder b;
+    int *list;
+    int *moved;
+    int filled;    /* states whose transitions have been set to unknown */
+    int resets;    /* times the cache filled up and started over */
+} LazyDfa;
+
+void lazyDfaFill(LazyDfa *lz) {
+    Dfa *dfa = &lz->dfa;
+    for (; lz->filled < dfa->nstates; lz->filled++) {
+        for (int cls = 0; cls < dfa->nclasses; cls++)
+            dfa->next[lz->filled * dfa->nclasses + cls] = DFA_UNKNOWN;
+    }
+}
+
+/* Dead state 0 and the start state 1 */
+void lazyDfaStart(LazyDfa *lz) {
+    Nfa *nfa = lz->b.nfa;
+    dfaState(&lz->b, lz->list, 0);
+    int len = dfaClosure(&lz->b, &nfa->start, 1, lz->list);
+    dfaState(&lz->b, lz->list, len);
+    lz->filled = 0;
+    lazyDfaFill(lz);
+}
+
+void lazyDfaInit(LazyDfa *lz, Nfa *nfa) {
+    dfaClasses(&lz->dfa, nfa);
+    dfaBuilderInit(&lz->b, &lz->dfa, nfa);
+    lz->list = malloc(sizeof(int) * nfa->count);
+    lz->moved = malloc(sizeof(int) * nfa->count);
+    lazyDfaStart(lz);
+}
+
+void lazyDfaFree(LazyDfa *lz) {
+    dfaBuilderFree(&lz->b);
+    free(lz->dfa.next);
+    free(lz->dfa.accept);
+    free(lz->list);
+    free(lz->moved);
+}
+
+int lazyDfaStep(LazyDfa *lz, int s, unsigned char c) {
+    Dfa *dfa = &lz->dfa;
+    int cls = dfa->classes[c];
+    int t = dfa->next[s * dfa->nclasses + cls];
+    if (t != DFA_UNKNOWN) return t;
+    
+    t = dfaTransition(&lz->b, s, c, lz->list, lz->moved);
+    if (t < 0) {
+        /* Cache full: start over, carrying the current state across */
+        int len = lz->b.lens[s];
+        int *carry = malloc(sizeof(int) * (len ? len : 1));
+        memcpy(carry, lz->b.lists[s], sizeof(int) * len);
+        dfaBuilderReset(&lz->b);
+        lazyDfaStart(lz);
+        lz->resets++;
+        s = dfaState(&lz->b, carry, len);
+        free(carry);
+        t = dfaTransition(&lz->b, s, c, lz->list, lz->moved);
+    }
+    lazyDfaFill(lz);
+    dfa->next[s * dfa->nclasses + cls] = t;
+    return t;
+}
+
+/* A compiled search pattern. Matches are leftmost-longest and never
+   empty. A right-to-left pass of the reversed pattern marks where
+   matches start in a row; a left-to-right pass of the pattern then finds
+   the longest match from the leftmost mark. When every match begins
+   with the same literal, the substring searcher finds the candidate
+   positions and rows without one are never run through either DFA.
+   
+   Left-to-right passes from successive starts can cover the same text
+   again, as `a|a.*b` does on a row of a's. Each pass records the
+   (position, DFA state) pairs it goes through; a later pass reaching one
+   of them would only repeat an earlier pass that found no match beyond
+   it, so it stops. No pair is visited twice, which keeps a row linear. */
+typedef struct Regex {
+    Nfa fwd;              /* anchored at the start of a match */
+    Nfa rev;              /* reversed, and free to end anywhere */
+    LazyDfa fwd_dfa;
+    LazyDfa rev_dfa;
+    Searcher prefix;      /* len 0 when matches share no literal prefix */
+    unsigned char *starts;
+    int starts_cap;
+    const char *row;      /* the row `starts` was marked for */
+    int row_n;
+    int row_from;
+    long long *visited;   /* hash set of position * REGEX_MAX_DFA_STATES + state + 1 */
+    int visited_cap;
+    int visited_count;
+    int visited_resets;   /* fwd_dfa.resets the set was filled under */
+    int last_end;         /* end of the last match returned for this row */
+} Regex;
+
+/* Add an epsilon move even when both slots are taken, through a new
+   state holding the old second move and the new one */
+void nfaEpsAny(Nfa *nfa, int from, int to) {
+    if (nfa->states[from].eps[1] < 0) {
+        nfaEps(nfa, from, to);
+        return;
+    }
+    int via = nfaAddState(nfa);
+    nfa->states[via].eps[0] = nfa->states[from].eps[1];
+    nfa->states[via].eps[1] = to;
+    nfa->states[from].eps[1] = via;
+}
+
+/* Reverse fragment f of nfa into rev, accepting at f's start. A loop on
+   every byte in front lets the reversed match begin anywhere, which
+   means the original may end anywhere. */
+void nfaReverse(Nfa *rev, Nfa *nfa, NfaFrag f) {
+    memset(rev, 0, sizeof(Nfa));
+    for (int i = 0; i < nfa->count; i++) nfaAddState(rev);
+    for (int i = 0; i < nfa->nsets; i++) nfaAddSet(rev, nfa->sets[i]);
+    
+    /* Each state is the target of at most one byte move */
+    for (int u = 0; u < nfa->count; u++) {
+        NfaState *st = &nfa->states[u];
+        if (st->set >= 0) {
+            rev->states[st->out].set = st->set;
+            rev->states[st->out].out = u;
+        }
+        for (int e = 0; e < 2; e++) {
+            if (st->eps[e] >= 0) nfaEpsAny(rev, st->eps[e], u);
         }
-        
-        prev_sep = is_separator(c);
-        i++;
     }
+    rev->states[f.start].accept = 1;
     
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    unsigned char any[32];
+    memset(any, 0xff, 32);
+    int loop = nfaAddState(rev);
+    int skip = nfaAddState(rev);
+    rev->states[skip].set = nfaAddSet(rev, any);
+    rev->states[skip].out = loop;
+    rev->states[loop].eps[0] = f.end;
+    rev->states[loop].eps[1] = skip;
+    rev->start = loop;
 }
 
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case COLOR_KEYWORD: return 33; /* Yellow */
-        case COLOR_STRING: return 32; /* Green */
-        case COLOR_COMMENT: return 36; /* Cyan */
-        case COLOR_NUMBER: return 35; /* Magenta */
-        case COLOR_TYPE: return 34; /* Blue */
-        case COLOR_FUNCTION: return 31; /* Red */
-        case COLOR_PREPROCESSOR: return 35; /* Magenta */
-        case COLOR_OPERATOR: return 37; /* White */
-        default: return 37; /* White */
+/* The literal every match of the pattern starts with: the plain bytes up
+   to the first metacharacter, less one made optional by * or ?. Nothing
+   when | splits the pattern at the top level. Returns its length. */
+int regexLiteralPrefix(const char *pattern, char *out, int cap) {
+    int depth = 0;
+    for (const char *p = pattern; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '[') {
+            p++;
+            if (*p == '^') p++;
+            if (*p == ']') p++;
+            while (*p && *p != ']') p += (*p == '\\' && p[1]) ? 2 : 1;
+            if (!*p) break;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            depth--;
+        } else if (*p == '|' && depth == 0) {
+            return 0;
+        }
+    }
+    
+    int len = 0;
+    const char *p = pattern;
+    while (*p && len < cap) {
+        const char *next = p + 1;
+        char c = *p;
+        if (c == '\\') {
+            if (!p[1] || p[1] == 'd' || p[1] == 'w' || p[1] == 's') break;
+            c = p[1] == 't' ? '\t' : p[1] == 'n' ? '\n' : p[1];
+            next = p + 2;
+        } else if (strchr(".[()|*+?", c)) {
+            break;
+        }
+        if (*next == '*' || *next == '?') break;
+        out[len++] = c;
+        if (*next == '+') break;
+        p = next;
+    }
+    return len;
+}
+
+/* Returns NULL, or an error message with nothing left to free */
+const char *regexCompile(Regex *re, const char *pattern, int ignore_case) {
+    memset(re, 0, sizeof(Regex));
+    re->fwd.start = -1;
+    
+    RegexParser rp = {.p = pattern, .nfa = &re->fwd, .ignore_case = ignore_case};
+    NfaFrag f = regexParseAlt(&rp);
+    if (!rp.error && *rp.p == ')') rp.error = "unmatched )";
+    if (rp.error) {
+        nfaFree(&re->fwd);
+        return rp.error;
+    }
+    
+    re->fwd.start = f.start;
+    re->fwd.states[f.end].accept = 1;
+    nfaReverse(&re->rev, &re->fwd, f);
+    lazyDfaInit(&re->fwd_dfa, &re->fwd);
+    lazyDfaInit(&re->rev_dfa, &re->rev);
+    
+    char prefix[256];
+    int len = regexLiteralPrefix(pattern, prefix, sizeof(prefix));
+    if (len > 0) searcherInit(&re->prefix, prefix, len, ignore_case);
+    return NULL;
+}
+
+void regexFree(Regex *re) {
+    lazyDfaFree(&re->fwd_dfa);
+    lazyDfaFree(&re->rev_dfa);
+    nfaFree(&re->fwd);
+    nfaFree(&re->rev);
+    if (re->prefix.len > 0) searcherFree(&re->prefix);
+    free(re->starts);
+    free(re->visited);
+}
+
+void regexVisitedClear(Regex *re) {
+    if (re->visited_count > 0) {
+        /* Drop a table a long row grew rather than clear it for every row */
+        if (re->visited_cap > 4096) {
+            free(re->visited);
+            re->visited = NULL;
+            re->visited_cap = 0;
+        } else {
+            memset(re->visited, 0, sizeof(long long) * re->visited_cap);
+        }
     }
+    re->visited_count = 0;
+    re->visited_resets = re->fwd_dfa.resets;
 }
 
-void editorSelectSyntaxHighlight(void) {
-    E.syntax = NULL;
-    if (E.filename == NULL) return;
+/* Record that a forward pass was in `state` before reading text[pos].
+   Returns 0 if an earlier pass already was. */
+int regexVisit(Regex *re, int pos, int state) {
+    /* State numbers change when the DFA cache starts over */
+    if (re->visited_resets != re->fwd_dfa.resets) regexVisitedClear(re);
     
-    char *ext = strrchr(E.filename, '.');
+    if (re->visited_count * 2 >= re->visited_cap) {
+        long long *old = re->visited;
+        int old_cap = re->visited_cap;
+        re->visited_cap = old_cap ? old_cap * 2 : 256;
+        re->visited = calloc(re->visited_cap, sizeof(long long));
+        re->visited_count = 0;
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i]) regexVisit(re, (old[i] - 1) / REGEX_MAX_DFA_STATES, (old[i] - 1) % REGEX_MAX_DFA_STATES);
+        }
+        free(old);
+    }
     
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        Syntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
-                
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
-                
-                return;
+    long long key = (long long)pos * REGEX_MAX_DFA_STATES + state + 1;
+    unsigned int slot = (unsigned int)((unsigned long long)key * 0x9E3779B97F4A7C15ull >> 40) & (re->visited_cap - 1);
+    while (re->visited[slot]) {
+        if (re->visited[slot] == key) return 0;
+        slot = (slot + 1) & (re->visited_cap - 1);
+    }
+    re->visited[slot] = key;
+    re->visited_count++;
+    return 1;
+}
+
+/* Mark text[i] for every i >= from where a match starts */
+void regexMarkStarts(Regex *re, const unsigned char *t, int from, int n) {
+    if (n + 1 > re->starts_cap) {
+        re->starts_cap = n + 1 > re->starts_cap * 2 ? n + 1 : re->starts_cap * 2;
+        re->starts = realloc(re->starts, re->starts_cap);
+    }
+    LazyDfa *lz = &re->rev_dfa;
+    Dfa *dfa = &lz->dfa;
+    int s = 1;
+    for (int i = n - 1; i >= from; i--) {
+        int next = dfa->next[s * dfa->nclasses + dfa->classes[t[i]]];
+        s = next != DFA_UNKNOWN ? next : lazyDfaStep(lz, s, t[i]);
+        re->starts[i] = dfa->accept[s];
+    }
+    re->row = (const char *)t;
+    re->row_n = n;
+    re->row_from = from;
+}
+
+/* Forget the marked row, for new text that may sit at the same address */
+void regexForget(Regex *re) {
+    re->row = NULL;
+}
+
+/* Find the leftmost-longest match in text[from..n). Returns its start
+   and sets *len, or returns -1. Successive calls on the same row with
+   increasing `from` share one marking pass; from == 0 starts afresh. */
+int regexFind(Regex *re, const char *text, int from, int n, int *len) {
+    const unsigned char *t = (const unsigned char *)text;
+    int pos = from;
+    if (re->prefix.len > 0 && (pos = searcherFind(&re->prefix, text, from, n)) < 0) return -1;
+    if (pos >= n) return -1;
+    
+    if (from == 0 || re->row != text || re->row_n != n || pos < re->row_from) {
+        regexMarkStarts(re, t, pos, n);
+        regexVisitedClear(re);
+        re->last_end = 0;
+    }
+    /* Passes that went past `from` may have matched beyond it */
+    if (from < re->last_end) regexVisitedClear(re);
+    
+    while (pos >= 0 && pos < n) {
+        if (re->starts[pos]) {
+            LazyDfa *lz = &re->fwd_dfa;
+            int s = 1, end = pos;
+            for (int j = pos; j < n && s && regexVisit(re, j, s); j++) {
+                s = lazyDfaStep(lz, s, t[j]);
+                if (lz->dfa.accept[s]) end = j + 1;
             }
-            i++;
+            /* A pattern that can match nothing is only reported where it
+               matches something */
+            if (end > pos) {
+                *len = end - pos;
+                re->last_end = end;
+                return pos;
+            }
+        }
+        if (re->prefix.len > 0) {
+            pos = searcherFind(&re->prefix, text, pos + 1, n);
+        } else {
+            unsigned char *mark = memchr(&re->starts[pos + 1], 1, n - pos - 1);
+            pos = mark ? (int)(mark - re->starts) : -1;
         }
     }
+    return -1;
 }
 
-/*** Row operations ***/
-
-int editorRowCxToRx(EditorRow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += (EDE_TAB_SIZE - 1) - (rx % EDE_TAB_SIZE);
-        rx++;
+/*** Bracket index ***/
+
+/* Every row is summarized by how it changes the depth of each bracket
+   type, counting only brackets the highlighter left outside strings and
+   comments. Rows are grouped into blocks of about EDE_BRACKET_BLOCK, and
+   the blocks, in file order, are the nodes of a treap keyed implicitly
+   by position: each node holds its row count and summary and those of
+   its subtree. Inserting or deleting a row changes the count of one
+   block, splitting a block that grew to twice the size or dropping one
+   that emptied, in O(log n). A changed row marks its block dirty and the
+   path above it stale, and syncing recomputes only those.
+   
+   Finding the bracket that closes a given one descends the tree to the
+   first block where the depth drops to zero, then scans rows of that
+   block by their summaries and one row by its text. Forward searches lex
+   only as far as they get. The prefix depth of any row, for rainbow
+   brackets, is a sum along one path. */
+
+#define BRACKET_TYPES 3  /* () [] {} */
+
+typedef struct BracketSummary {
+    int delta[BRACKET_TYPES];  /* opening minus closing brackets */
+    int min[BRACKET_TYPES];    /* lowest depth reached scanning forward (<= 0) */
+    int max[BRACKET_TYPES];    /* highest opening minus closing of a suffix (>= 0) */
+} BracketSummary;
+
+typedef struct BracketBlock {
+    int left, right;       /* children, -1 for none */
+    unsigned int priority; /* above both children's */
+    int rows;              /* rows in this block */
+    int total;             /* rows in the subtree */
+    unsigned char dirty;   /* a row of this block changed */
+    unsigned char stale;   /* some block in the subtree is dirty */
+    BracketSummary own;    /* this block's rows */
+    BracketSummary sum;    /* the subtree's blocks in order */
+} BracketBlock;
+
+typedef struct BracketIndex {
+    BracketBlock *node;
+    int count;
+    int cap;
+    int free_list;         /* linked through left */
+    int root;
+    int built;             /* 0 until the first sync and after a reset */
+    unsigned int seed;
+    int hint_from, hint_to; /* rows of a block already marked dirty */
+} BracketIndex;
+
+BracketIndex bracket_index = {.root = -1, .free_list = -1, .seed = 2463534242u};
+
+/* Type of bracket c, or -1; *open tells which side it is */
+int bracketTypeOf(int c, int *open) {
+    switch (c) {
+        case '(': *open = 1; return 0;
+        case ')': *open = 0; return 0;
+        case '[': *open = 1; return 1;
+        case ']': *open = 0; return 1;
+        case '{': *open = 1; return 2;
+        case '}': *open = 0; return 2;
     }
-    return rx;
+    return -1;
 }
 
-int editorRowRxToCx(EditorRow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (EDE_TAB_SIZE - 1) - (cur_rx % EDE_TAB_SIZE);
-        cur_rx++;
-        
-        if (cur_rx > rx) return cx;
-    }
-    return cx;
+/* A bracket counts unless it was highlighted as part of a string or a
+   comment. hl may be NULL for rows not highlighted yet. */
+int bracketInCode(const unsigned char *hl, int i) {
+    return hl == NULL || (hl[i] != COLOR_STRING && hl[i] != COLOR_COMMENT);
 }
 
-void editorUpdateRow(EditorRow *row) {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
-    
-    free(row->render);
-    row->render = malloc(row->size + tabs * (EDE_TAB_SIZE - 1) + 1);
-    
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % EDE_TAB_SIZE != 0) row->render[idx++] = ' ';
+void bracketSummarize(BracketSummary *s, const char *text, const unsigned char *hl, int len) {
+    memset(s, 0, sizeof(*s));
+    for (int i = charFindClass(text, 0, len, CHAR_BRACKET); i < len;
+         i = charFindClass(text, i + 1, len, CHAR_BRACKET)) {
+        int open;
+        int t = bracketTypeOf(text[i], &open);
+        if (t < 0 || !bracketInCode(hl, i)) continue;
+        if (open) {
+            s->delta[t]++;
         } else {
-            row->render[idx++] = row->chars[j];
+            s->delta[t]--;
+            if (s->delta[t] < s->min[t]) s->min[t] = s->delta[t];
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-    
-    editorUpdateSyntax(row);
+    /* Best suffix = total minus the lowest prefix */
+    for (int t = 0; t < BRACKET_TYPES; t++) s->max[t] = s->delta[t] - s->min[t];
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
-    
-    E.row = realloc(E.row, sizeof(EditorRow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(EditorRow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-    
-    E.row[at].idx = at;
-    
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-    
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
-    
-    E.numrows++;
-    E.dirty++;
+/* out = a followed by b; out may be a */
+void bracketCombine(BracketSummary *out, const BracketSummary *a, const BracketSummary *b) {
+    for (int t = 0; t < BRACKET_TYPES; t++) {
+        int d = a->delta[t];
+        int lo = d + b->min[t];
+        int hi = b->delta[t] + a->max[t];
+        out->min[t] = a->min[t] < lo ? a->min[t] : lo;
+        out->max[t] = b->max[t] > hi ? b->max[t] : hi;
+        out->delta[t] = d + b->delta[t];
+    }
 }
 
-void editorFreeRow(EditorRow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
-}
+BracketSummary bracket_none;
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(EditorRow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+/* Summary of a row, shared with its highlight result. Rows that have not
+   been highlighted count as having no brackets: queries lex the rows
+   they search first, and the rows above a drawn view are always
+   highlighted, so they are never seen by anything that needs them. */
+BracketSummary *bracketRowSummary(EditorRow *row) {
+    return row->brackets ? row->brackets : &bracket_none;
 }
 
-void editorRowInsertChar(EditorRow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+int bracketTotal(int n) {
+    return n < 0 ? 0 : bracket_index.node[n].total;
 }
 
-void editorRowAppendString(EditorRow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+/* Recompute a node from its children */
+void bracketPull(int n) {
+    BracketBlock *b = &bracket_index.node[n];
+    b->total = b->rows;
+    b->stale = b->dirty;
+    b->sum = bracket_none;
+    if (b->left >= 0) {
+        BracketBlock *l = &bracket_index.node[b->left];
+        b->total += l->total;
+        b->stale |= l->stale;
+        b->sum = l->sum;
+    }
+    bracketCombine(&b->sum, &b->sum, &b->own);
+    if (b->right >= 0) {
+        BracketBlock *r = &bracket_index.node[b->right];
+        b->total += r->total;
+        b->stale |= r->stale;
+        bracketCombine(&b->sum, &b->sum, &r->sum);
+    }
 }
 
-void editorRowDelChar(EditorRow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+int bracketNewBlock(int rows, unsigned int priority) {
+    BracketIndex *bi = &bracket_index;
+    int n = bi->free_list;
+    if (n >= 0) {
+        bi->free_list = bi->node[n].left;
+    } else {
+        if (bi->count == bi->cap) {
+            bi->cap = bi->cap ? bi->cap * 2 : 64;
+            bi->node = realloc(bi->node, sizeof(BracketBlock) * bi->cap);
+        }
+        n = bi->count++;
+    }
+    BracketBlock *b = &bi->node[n];
+    memset(b, 0, sizeof(*b));
+    b->left = b->right = -1;
+    b->priority = priority;
+    b->rows = rows;
+    b->dirty = 1;
+    bracketPull(n);
+    return n;
+}
+
+unsigned int bracketRandom(void) {
+    unsigned int x = bracket_index.seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return bracket_index.seed = x;
+}
+
+/* Split subtree n into the blocks starting before row k and the rest */
+void bracketSplit(int n, int k, int *a, int *b) {
+    if (n < 0) {
+        *a = *b = -1;
+        return;
+    }
+    BracketBlock *node = &bracket_index.node[n];
+    int lt = bracketTotal(node->left);
+    if (k <= lt) {
+        bracketSplit(node->left, k, a, &node->left);
+        *b = n;
+    } else {
+        bracketSplit(node->right, k - lt - node->rows, &node->right, b);
+        *a = n;
+    }
+    bracketPull(n);
+}
+
+/* Subtree a followed by subtree b */
+int bracketMerge(int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    BracketBlock *na = &bracket_index.node[a], *nb = &bracket_index.node[b];
+    if (na->priority > nb->priority) {
+        na->right = bracketMerge(na->right, b);
+        bracketPull(a);
+        return a;
+    }
+    nb->left = bracketMerge(a, nb->left);
+    bracketPull(b);
+    return b;
+}
+
+/* Block holding row `at`, or the last block if at == E.numrows. Sets
+   *start to its first row. */
+int bracketBlockAt(int at, int *start) {
+    int n = bracket_index.root, base = 0;
+    while (n >= 0) {
+        BracketBlock *b = &bracket_index.node[n];
+        int lt = bracketTotal(b->left);
+        if (at < base + lt) {
+            n = b->left;
+            continue;
+        }
+        base += lt;
+        if (at < base + b->rows || b->right < 0) break;
+        base += b->rows;
+        n = b->right;
+    }
+    *start = base;
+    return n;
+}
+
+/* Take the block holding row `at` out of the tree. *before and *after
+   get the blocks on either side, *start its first row. */
+int bracketDetach(int at, int *before, int *after, int *start) {
+    int n = bracketBlockAt(at, start);
+    int rest;
+    bracketSplit(bracket_index.root, *start, before, &rest);
+    bracketSplit(rest, bracket_index.node[n].rows, &n, after);
+    return n;
+}
+
+/* Balanced tree over blocks [lo, hi) of EDE_BRACKET_BLOCK rows, with
+   priorities falling by level so that it is a heap */
+int bracketBuild(int lo, int hi, int level) {
+    if (lo >= hi) return -1;
+    int mid = (lo + hi) / 2;
+    int rows = E.numrows - mid * EDE_BRACKET_BLOCK;
+    if (rows > EDE_BRACKET_BLOCK) rows = EDE_BRACKET_BLOCK;
+    unsigned int band = 0xffffffffu >> level;
+    int n = bracketNewBlock(rows, band - (bracketRandom() & (band >> 1)));
+    int left = bracketBuild(lo, mid, level + 1);
+    int right = bracketBuild(mid + 1, hi, level + 1);
+    bracket_index.node[n].left = left;
+    bracket_index.node[n].right = right;
+    bracketPull(n);
+    return n;
+}
+
+/* Forget the tree; the next sync builds it again from the rows */
+void bracketIndexReset(void) {
+    BracketIndex *bi = &bracket_index;
+    bi->count = 0;
+    bi->free_list = -1;
+    bi->root = -1;
+    bi->built = 0;
+    bi->hint_from = bi->hint_to = 0;
+}
+
+void bracketIndexRowChanged(int at) {
+    BracketIndex *bi = &bracket_index;
+    if (!bi->built || bi->root < 0) return;
+    if (at >= bi->hint_from && at < bi->hint_to) return;
+    
+    int n = bi->root, base = 0;
+    while (n >= 0) {
+        BracketBlock *b = &bi->node[n];
+        b->stale = 1;
+        int lt = bracketTotal(b->left);
+        if (at < base + lt) {
+            n = b->left;
+            continue;
+        }
+        base += lt;
+        if (at < base + b->rows || b->right < 0) {
+            b->dirty = 1;
+            bi->hint_from = base;
+            bi->hint_to = base + b->rows;
+            return;
+        }
+        base += b->rows;
+        n = b->right;
+    }
 }
 
-/*** Editor operations ***/
-
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+/* A row was inserted at `at` */
+void bracketIndexInsertRow(int at) {
+    BracketIndex *bi = &bracket_index;
+    if (!bi->built) return;
+    bi->hint_from = bi->hint_to = 0;
+    if (bi->root < 0) {
+        bi->root = bracketNewBlock(1, bracketRandom());
+        return;
     }
     
-    char ch = c;
-    addUndoAction(ACTION_INSERT_CHAR, E.cy, E.cx, &ch, 1);
-    
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    int before, after, start;
+    int n = bracketDetach(at, &before, &after, &start);
+    BracketBlock *b = &bi->node[n];
+    b->rows++;
+    b->dirty = 1;
+    if (b->rows >= 2 * EDE_BRACKET_BLOCK) {
+        /* Split it in two */
+        int rest = b->rows - EDE_BRACKET_BLOCK;
+        b->rows = EDE_BRACKET_BLOCK;
+        after = bracketMerge(bracketNewBlock(rest, bracketRandom()), after);
+    }
+    bracketPull(n);
+    bi->root = bracketMerge(bracketMerge(before, n), after);
+}
+
+/* The row at `at` was deleted */
+void bracketIndexDeleteRow(int at) {
+    BracketIndex *bi = &bracket_index;
+    if (!bi->built || bi->root < 0) return;
+    bi->hint_from = bi->hint_to = 0;
+    
+    int before, after, start;
+    int n = bracketDetach(at, &before, &after, &start);
+    BracketBlock *b = &bi->node[n];
+    b->rows--;
+    b->dirty = 1;
+    if (b->rows == 0) {
+        b->left = bi->free_list;
+        bi->free_list = n;
+        n = -1;
+    } else {
+        bracketPull(n);
+    }
+    bi->root = bracketMerge(bracketMerge(before, n), after);
 }
 
-void editorInsertNewline(void) {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        EditorRow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+/* Recompute the dirty blocks of subtree n, whose rows start at `base` */
+void bracketSyncNode(int n, int base) {
+    BracketBlock *b = &bracket_index.node[n];
+    if (!b->stale) return;
+    int start = base + bracketTotal(b->left);
+    if (b->left >= 0) bracketSyncNode(b->left, base);
+    if (b->dirty) {
+        b->own = bracket_none;
+        for (int r = start; r < start + b->rows; r++)
+            bracketCombine(&b->own, &b->own, bracketRowSummary(&E.row[r]));
+        b->dirty = 0;
     }
-    E.cy++;
-    E.cx = 0;
+    if (b->right >= 0) bracketSyncNode(b->right, start + b->rows);
+    bracketPull(n);
 }
 
-void editorDelChar(void) {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+/* Bring the tree up to date with the rows */
+void bracketIndexSync(void) {
+    BracketIndex *bi = &bracket_index;
+    if (!bi->built) {
+        bracketIndexReset();
+        bi->built = 1;
+        bi->root = bracketBuild(0, (E.numrows + EDE_BRACKET_BLOCK - 1) / EDE_BRACKET_BLOCK, 0);
+    }
+    if (bi->root >= 0) bracketSyncNode(bi->root, 0);
+    bi->hint_from = bi->hint_to = 0;
+}
+
+/* Highlight row `at` from its true state, which also covers every row
+   above it, then sync the tree */
+void bracketIndexPrepare(int at) {
+    editorSyntaxEnsure(at, at + 1, E.numrows);
+    bracketIndexSync();
+}
+
+/* Net bracket depth, all types together, at the start of row `at`. The
+   tree must be in sync. */
+int bracketDepthBefore(int at) {
+    int n = bracket_index.root, base = 0;
+    int depth = 0;
     
-    EditorRow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        char ch = row->chars[E.cx - 1];
-        addUndoAction(ACTION_DELETE_CHAR, E.cy, E.cx - 1, &ch, 1);
-        
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+    while (n >= 0) {
+        BracketBlock *b = &bracket_index.node[n];
+        int lt = bracketTotal(b->left);
+        if (at < base + lt) {
+            n = b->left;
+            continue;
+        }
+        BracketSummary *s = b->left >= 0 ? &bracket_index.node[b->left].sum : &bracket_none;
+        for (int t = 0; t < BRACKET_TYPES; t++) depth += s->delta[t];
+        base += lt;
+        if (at < base + b->rows || b->right < 0) break;
+        for (int t = 0; t < BRACKET_TYPES; t++) depth += b->own.delta[t];
+        base += b->rows;
+        n = b->right;
+    }
+    for (int row = base; row < at; row++) {
+        BracketSummary *s = bracketRowSummary(&E.row[row]);
+        for (int t = 0; t < BRACKET_TYPES; t++) depth += s->delta[t];
+    }
+    return depth;
+}
+
+/* Rainbow class of the bracket c at nesting depth *depth, which it then
+   opens or closes */
+int bracketRainbowClass(int c, int *depth) {
+    int open = 0;
+    bracketTypeOf(c, &open);
+    if (!open) (*depth)--;
+    int cls = COLOR_BRACKET1 + ((*depth % 3) + 3) % 3;
+    if (open) (*depth)++;
+    return cls;
+}
+
+/* First row of the first block of subtree n (its rows starting at
+   `base`) that starts at or after `from` and in which the depth of type
+   t, *depth on entry, drops to zero. *depth is advanced past the blocks
+   skipped. Only blocks ending by `limit` are looked at: the search stops
+   at the first that does not and sets *resume to its first row. */
+int bracketSearchForward(int n, int base, int from, int limit, int t, int *depth, int *resume) {
+    if (n < 0 || *resume >= 0) return -1;
+    BracketBlock *b = &bracket_index.node[n];
+    int end = base + b->total;
+    if (end <= from) return -1;
+    if (base >= from && end <= limit && *depth + b->sum.min[t] > 0) {
+        *depth += b->sum.delta[t];
+        return -1;
     }
-}
-
-/*** File I/O ***/
-
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
     
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+    int found = bracketSearchForward(b->left, base, from, limit, t, depth, resume);
+    if (found >= 0 || *resume >= 0) return found;
+    int start = base + bracketTotal(b->left);
+    if (start >= from) {
+        if (start + b->rows > limit) {
+            *resume = start;
+            return -1;
+        }
+        if (*depth + b->own.min[t] <= 0) return start;
+        *depth += b->own.delta[t];
     }
-    
-    return buf;
+    return bracketSearchForward(b->right, start + b->rows, from, limit, t, depth, resume);
 }
 
-/* Bare metal getline implementation */
-ssize_t bare_getline(char **lineptr, size_t *n, FILE *stream) {
-    if (lineptr == NULL || n == NULL || stream == NULL) {
+/* First row of the last block of subtree n that ends by row `to` and in
+   which, scanning backwards, the count of unmatched closing brackets of
+   type t (*depth) drops to zero */
+int bracketSearchBackward(int n, int base, int to, int t, int *depth) {
+    if (n < 0 || base >= to) return -1;
+    BracketBlock *b = &bracket_index.node[n];
+    if (base + b->total <= to && b->sum.max[t] < *depth) {
+        *depth -= b->sum.delta[t];
         return -1;
     }
     
-    if (*lineptr == NULL || *n == 0) {
-        *n = 128;
-        *lineptr = malloc(*n);
-        if (*lineptr == NULL) return -1;
+    int start = base + bracketTotal(b->left);
+    int found = bracketSearchBackward(b->right, start + b->rows, to, t, depth);
+    if (found >= 0) return found;
+    if (start + b->rows <= to) {
+        if (b->own.max[t] >= *depth) return start;
+        *depth -= b->own.delta[t];
     }
-    
-    size_t pos = 0;
-    int c;
-    
-    while ((c = fgetc(stream)) != EOF) {
-        if (pos + 1 >= *n) {
-            size_t new_size = *n * 2;
-            char *new_ptr = realloc(*lineptr, new_size);
-            if (new_ptr == NULL) return -1;
-            *lineptr = new_ptr;
-            *n = new_size;
+    return bracketSearchBackward(b->left, base, to, t, depth);
+}
+
+/* Scan render columns [from, to) of a row (backwards if dir < 0) for the
+   column where the depth of type t reaches zero */
+int bracketScanRow(EditorRow *row, int from, int to, int dir, int t, int *depth) {
+    const unsigned char *hl = row->hl_in_comment >= 0 ? row->hl : NULL;
+    for (int i = dir > 0 ? from : to - 1; i >= from && i < to; i += dir) {
+        int open = 0;
+        if (bracketTypeOf(row->render[i], &open) != t || !bracketInCode(hl, i)) continue;
+        *depth += (open == (dir > 0)) ? 1 : -1;
+        if (*depth == 0) return i;
+    }
+    return -1;
+}
+
+/* Scan rows from r + dir up to (not including) edge by their summaries
+   for the one where the depth of type t can reach zero. Returns it, or
+   edge with *depth advanced past the rest. */
+int bracketScanRows(int r, int edge, int dir, int t, int *depth) {
+    for (r += dir; r != edge; r += dir) {
+        BracketSummary *s = bracketRowSummary(&E.row[r]);
+        if (dir > 0 ? *depth + s->min[t] <= 0 : s->max[t] >= *depth) break;
+        *depth += dir > 0 ? s->delta[t] : -s->delta[t];
+    }
+    return r;
+}
+
+/* Find the bracket matching the one at render column rx of row `at`.
+   Returns 1 and its position, or 0 if it is unmatched. */
+int bracketMatch(int at, int rx, int *match_row, int *match_rx) {
+    EditorRow *row = &E.row[at];
+    int open;
+    int t = bracketTypeOf(row->render[rx], &open);
+    if (t < 0) return 0;
+    
+    bracketIndexPrepare(at);
+    if (!bracketInCode(row->hl, rx)) return 0;
+    
+    int dir = open ? 1 : -1;
+    int depth = 1;
+    int i = open ? bracketScanRow(row, rx + 1, row->rsize, 1, t, &depth)
+                 : bracketScanRow(row, 0, rx, -1, t, &depth);
+    int r = at;
+    
+    if (i < 0) {
+        /* Rest of this block, row by row */
+        int start;
+        int b = bracketBlockAt(at, &start);
+        int end = start + bracket_index.node[b].rows;
+        if (open) {
+            editorSyntaxEnsure(at, end, E.numrows);
+            bracketIndexSync();
         }
+        r = bracketScanRows(at, open ? end : start - 1, dir, t, &depth);
         
-        (*lineptr)[pos++] = (char)c;
+        if (r == (open ? end : start - 1)) {
+            /* Then the first block further on where it can close. Going
+               forward, blocks are only trusted up to the rows lexed so
+               far, and the search lexes further in steps as it goes. */
+            int found;
+            if (open) {
+                int limit = editorSyntaxLexedRows();
+                for (;;) {
+                    int resume = -1;
+                    found = bracketSearchForward(bracket_index.root, 0, end, limit, t, &depth, &resume);
+                    if (found >= 0 || resume < 0) break;
+                    end = resume;
+                    limit = resume + EDE_BRACKET_LEX_ROWS;
+                    if (limit > E.numrows) limit = E.numrows;
+                    editorSyntaxEnsure(resume, limit, E.numrows);
+                    bracketIndexSync();
+                }
+            } else {
+                found = bracketSearchBackward(bracket_index.root, 0, start, t, &depth);
+            }
+            if (found < 0) return 0;
+            
+            b = bracketBlockAt(found, &start);
+            end = start + bracket_index.node[b].rows;
+            r = open ? bracketScanRows(start - 1, end, 1, t, &depth)
+                     : bracketScanRows(end, start - 1, -1, t, &depth);
+        }
         
-        if (c == '\n') break;
-    }
-    
-    if (pos == 0 && c == EOF) {
-        return -1;
+        i = bracketScanRow(&E.row[r], 0, E.row[r].rsize, dir, t, &depth);
+        if (i < 0) return 0;
     }
     
-    (*lineptr)[pos] = '\0';
-    return (ssize_t)pos;
+    *match_row = r;
+    *match_rx = i;
+    return 1;
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
-    
-    editorSelectSyntaxHighlight();
-    
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        /* New file */
-        return;
-    }
-    
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    
-    while ((linelen = bare_getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+/*** Syntax highlighting ***/
+
+int is_separator(int c) {
+    return charIs(c, CHAR_SEP);
+}
+
+/* Keywords are looked up through a perfect hash: the seed is chosen when
+   the table is built so that no two keywords share a slot, and a lookup
+   is one hash of the token plus one compare. A trailing '|' in the
+   keyword list marks a type and is stored as the slot's color. */
+typedef struct KeywordTable {
+    const char **words;
+    unsigned char *lens;
+    unsigned char *colors;
+    unsigned int mask;
+    unsigned int seed;
+    int min_len;
+    int max_len;
+} KeywordTable;
+
+/* FNV-1a with a seed, folded so the low bits mix in the high ones */
+unsigned int hashBytes(const char *s, int len, unsigned int seed) {
+    unsigned int h = 2166136261u ^ seed;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+int keywordTableFill(KeywordTable *kt, char **keywords) {
+    memset(kt->words, 0, sizeof(char *) * (kt->mask + 1));
+    
+    for (int j = 0; keywords[j]; j++) {
+        int len = strlen(keywords[j]);
+        int type = len > 0 && keywords[j][len - 1] == '|';
+        if (type) len--;
+        if (len == 0 || len > 255) continue;
+        
+        unsigned int slot = hashBytes(keywords[j], len, kt->seed) & kt->mask;
+        if (kt->words[slot]) {
+            /* A repeated keyword is not a collision */
+            if (kt->lens[slot] == len && !memcmp(kt->words[slot], keywords[j], len)) continue;
+            return -1;
+        }
+        kt->words[slot] = keywords[j];
+        kt->lens[slot] = len;
+        kt->colors[slot] = type ? COLOR_TYPE : COLOR_KEYWORD;
+        if (len < kt->min_len) kt->min_len = len;
+        if (len > kt->max_len) kt->max_len = len;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    return 0;
 }
 
-int editorSave(void) {
-    if (E.filename == NULL) {
-        return -1;
-    }
-    
-    int len;
-    char *buf = editorRowsToString(&len);
+KeywordTable *keywordTableBuild(char **keywords) {
+    KeywordTable *kt = calloc(1, sizeof(KeywordTable));
+    int n = 0;
+    while (keywords[n]) n++;
     
-    FILE *fp = fopen(E.filename, "w");
-    if (fp == NULL) {
-        free(buf);
-        return -1;
-    }
+    unsigned int size = 8;
+    while (size < (unsigned int)n * 2) size <<= 1;
     
-    if (fwrite(buf, 1, len, fp) != (size_t)len) {
-        fclose(fp);
-        free(buf);
-        return -1;
+    /* Try a few hundred seeds per size, doubling the table when none fits */
+    while (1) {
+        kt->mask = size - 1;
+        kt->words = realloc(kt->words, sizeof(char *) * size);
+        kt->lens = realloc(kt->lens, size);
+        kt->colors = realloc(kt->colors, size);
+        for (kt->seed = 0; kt->seed < 256; kt->seed++) {
+            kt->min_len = 255;
+            kt->max_len = 0;
+            if (keywordTableFill(kt, keywords) == 0) return kt;
+        }
+        size <<= 1;
     }
-    
-    fclose(fp);
-    free(buf);
-    E.dirty = 0;
+}
+
+/* Returns the color of the keyword s[0..len), or 0 if it is not one */
+int keywordLookup(KeywordTable *kt, const char *s, int len) {
+    if (len < kt->min_len || len > kt->max_len) return 0;
+    unsigned int slot = hashBytes(s, len, kt->seed) & kt->mask;
+    if (kt->words[slot] && kt->lens[slot] == len && !memcmp(kt->words[slot], s, len))
+        return kt->colors[slot];
     return 0;
 }
 
-/*** Search and Replace System ***/
+int is_ident_char(int c) {
+    return charIs(c, CHAR_IDENT);
+}
 
-void freeSearchMatches(void) {
-    SearchMatch *match = search_ctx.matches;
-    while (match) {
-        SearchMatch *next = match->next;
-        free(match);
-        match = next;
+/* Rows are highlighted on demand, when they are drawn. Each row keeps the
+   comment state it was highlighted from (hl_in_comment, -1 once its text
+   changes) and the one it ends in, and the incoming state of every
+   EDE_SYNTAX_CHECKPOINT-th row is saved, so any part of the file can be
+   highlighted by lexing forward from the nearest checkpoint. An edit only
+   lowers the count of valid checkpoints; they are recomputed when
+   something below the edit is drawn. */
+typedef struct SyntaxCheckpoints {
+    unsigned char *state; /* incoming comment state of row k * N */
+    int valid;            /* checkpoints [0, valid) are up to date */
+    int cap;
+} SyntaxCheckpoints;
+
+SyntaxCheckpoints syntax_cp = {NULL, 0, 0};
+
+void syntaxCheckpointSet(int k, int state) {
+    if (k < syntax_cp.valid) return;
+    if (k >= syntax_cp.cap) {
+        syntax_cp.cap = syntax_cp.cap ? syntax_cp.cap * 2 : 64;
+        syntax_cp.state = realloc(syntax_cp.state, syntax_cp.cap);
     }
-    search_ctx.matches = NULL;
-    search_ctx.current_match = NULL;
-    search_ctx.match_count = 0;
+    syntax_cp.state[k] = state;
+    syntax_cp.valid = k + 1;
 }
 
-int stringMatchAt(const char *text, const char *pattern, int pos, int case_sensitive) {
-    if (!case_sensitive) {
-        for (int i = 0; pattern[i]; i++) {
-            if (tolower(text[pos + i]) != tolower(pattern[i])) {
-                return 0;
-            }
-        }
-        return 1;
-    } else {
-        return strncmp(&text[pos], pattern, strlen(pattern)) == 0;
-    }
+/* The text of row `at` changed: checkpoints after it may be stale */
+void editorSyntaxInvalidate(int at) {
+    int k = at / EDE_SYNTAX_CHECKPOINT + 1;
+    if (syntax_cp.valid > k) syntax_cp.valid = k;
 }
 
-void findAllMatches(void) {
-    freeSearchMatches();
-    
-    if (search_ctx.query_len == 0) return;
-    
-    SearchMatch *last_match = NULL;
-    
-    for (int row = 0; row < E.numrows; row++) {
-        EditorRow *erow = &E.row[row];
-        char *line = erow->render;
-        int len = erow->rsize;
-        
-        for (int col = 0; col <= len - search_ctx.query_len; col++) {
-            if (stringMatchAt(line, search_ctx.query, col, search_ctx.case_sensitive)) {
-                /* Check whole word if needed */
-                if (search_ctx.whole_word) {
-                    int before_ok = (col == 0) || !isalnum(line[col - 1]);
-                    int after_ok = (col + search_ctx.query_len >= len) || 
-                                   !isalnum(line[col + search_ctx.query_len]);
-                    if (!before_ok || !after_ok) continue;
-                }
-                
-                SearchMatch *match = malloc(sizeof(SearchMatch));
-                match->row = row;
-                match->col = col;
-                match->length = search_ctx.query_len;
-                match->next = NULL;
-                
-                if (last_match) {
-                    last_match->next = match;
-                } else {
-                    search_ctx.matches = match;
-                }
-                last_match = match;
-                search_ctx.match_count++;
-                
-                if (search_ctx.match_count >= EDE_MAX_SEARCH_RESULTS) {
-                    return;
-                }
-                
-                col += search_ctx.query_len - 1;
+/* Rows known to be highlighted from their true state: those before the
+   last valid checkpoint */
+int editorSyntaxLexedRows(void) {
+    return syntax_cp.valid > 0 ? (syntax_cp.valid - 1) * EDE_SYNTAX_CHECKPOINT : 0;
+}
+
+void editorSyntaxInvalidateAll(void) {
+    for (int r = 0; r < E.numrows; r++) E.row[r].hl_in_comment = -1;
+    syntax_cp.valid = 0;
+}
+
+/* Highlight results are shared between rows. Source files repeat the same
+   lines over and over (closing braces, blank lines, "return 0;"), so rows
+   do not own their hl array: it points into an entry of this table, keyed
+   by a 64-bit hash of the rendered text together with the incoming
+   comment state and the syntax, and each distinct result is stored once.
+   The text itself is not compared on lookup; two different rows of the
+   same length, state and syntax would have to collide in all 64 bits for
+   one to show the other's colors. Entries are reference counted by the
+   rows using them; up to EDE_HL_CACHE_SPARE unused ones are kept around
+   for text that comes back (undo, paste, retyping a line). */
+typedef struct HlEntry {
+    uint64_t hash;
+    int len;
+    Syntax *syntax;
+    signed char in_comment;
+    signed char out_comment;
+    int refs;
+    struct HlEntry *next;
+    BracketSummary brackets;
+    unsigned char hl[];
+} HlEntry;
+
+typedef struct HlCache {
+    HlEntry **buckets;
+    int nbuckets;     /* power of two */
+    int count;        /* entries in the table */
+    int unused;       /* entries with no rows using them */
+    long long hits;
+    long long misses;
+    unsigned char *scratch;
+    int scratch_cap;
+} HlCache;
+
+HlCache hl_cache = {NULL, 0, 0, 0, 0, 0, NULL, 0};
+
+uint64_t hlCacheHash(const char *s, int len) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (uint64_t)len;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    for (; i < len; i++) h = (h ^ (unsigned char)s[i]) * 0x100000001b3ull;
+    return h ^ (h >> 29);
+}
+
+HlEntry *hlCacheFind(uint64_t hash, int len, int in_comment, Syntax *syntax) {
+    if (hl_cache.nbuckets == 0) return NULL;
+    HlEntry *e = hl_cache.buckets[hash & (hl_cache.nbuckets - 1)];
+    for (; e; e = e->next) {
+        if (e->hash == hash && e->len == len && e->in_comment == in_comment &&
+            e->syntax == syntax)
+            return e;
+    }
+    return NULL;
+}
+
+void hlCacheGrow(void) {
+    int n = hl_cache.nbuckets ? hl_cache.nbuckets * 2 : 1024;
+    HlEntry **buckets = calloc(n, sizeof(HlEntry *));
+    for (int b = 0; b < hl_cache.nbuckets; b++) {
+        HlEntry *e = hl_cache.buckets[b];
+        while (e) {
+            HlEntry *next = e->next;
+            e->next = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(hl_cache.buckets);
+    hl_cache.buckets = buckets;
+    hl_cache.nbuckets = n;
+}
+
+HlEntry *hlCacheAdd(uint64_t hash, int len, int in_comment, Syntax *syntax,
+                    const char *text, unsigned char *hl, int out_comment) {
+    if (hl_cache.count >= hl_cache.nbuckets) hlCacheGrow();
+    
+    HlEntry *e = malloc(sizeof(HlEntry) + len);
+    e->hash = hash;
+    e->len = len;
+    e->syntax = syntax;
+    e->in_comment = in_comment;
+    e->out_comment = out_comment;
+    e->refs = 0;
+    memcpy(e->hl, hl, len);
+    bracketSummarize(&e->brackets, text, hl, len);
+    
+    HlEntry **slot = &hl_cache.buckets[hash & (hl_cache.nbuckets - 1)];
+    e->next = *slot;
+    *slot = e;
+    hl_cache.count++;
+    hl_cache.unused++;
+    return e;
+}
+
+/* Free unused entries, keeping at most `keep` of them */
+void hlCacheTrim(int keep) {
+    for (int b = 0; b < hl_cache.nbuckets && hl_cache.unused > keep; b++) {
+        HlEntry **p = &hl_cache.buckets[b];
+        while (*p && hl_cache.unused > keep) {
+            HlEntry *e = *p;
+            if (e->refs == 0) {
+                *p = e->next;
+                free(e);
+                hl_cache.count--;
+                hl_cache.unused--;
+            } else {
+                p = &e->next;
             }
         }
     }
-    
-    search_ctx.current_match = search_ctx.matches;
 }
 
-void gotoNextMatch(void) {
-    if (!search_ctx.current_match) return;
-    
-    SearchMatch *match = search_ctx.current_match;
-    E.cy = match->row;
-    E.cx = editorRowRxToCx(&E.row[match->row], match->col);
-    E.rowoff = match->row;
-    
-    search_ctx.current_match = match->next;
-    if (!search_ctx.current_match) {
-        search_ctx.current_match = search_ctx.matches;
-    }
+void hlCacheRetain(HlEntry *e) {
+    if (e->refs++ == 0) hl_cache.unused--;
 }
 
-void gotoPrevMatch(void) {
-    if (!search_ctx.matches) return;
-    
-    SearchMatch *target = search_ctx.matches;
-    SearchMatch *prev = NULL;
-    
-    while (target && target != search_ctx.current_match) {
-        prev = target;
-        target = target->next;
-    }
-    
-    if (prev) {
-        search_ctx.current_match = prev;
-    } else {
-        /* Go to last match */
-        SearchMatch *last = search_ctx.matches;
-        while (last->next) last = last->next;
-        search_ctx.current_match = last;
-    }
-    
-    SearchMatch *match = search_ctx.current_match;
-    E.cy = match->row;
-    E.cx = editorRowRxToCx(&E.row[match->row], match->col);
-    E.rowoff = match->row;
+void hlCacheRelease(HlEntry *e) {
+    if (e == NULL) return;
+    if (--e->refs == 0 && ++hl_cache.unused > 2 * EDE_HL_CACHE_SPARE)
+        hlCacheTrim(EDE_HL_CACHE_SPARE);
 }
 
-void replaceCurrentMatch(void) {
-    if (!search_ctx.current_match) return;
-    
-    SearchMatch *match = search_ctx.current_match;
-    EditorRow *row = &E.row[match->row];
+/* Drop the highlighting of every row and all cached results */
+void hlCacheClear(void) {
+    for (int r = 0; r < E.numrows; r++) {
+        EditorRow *row = &E.row[r];
+        hlCacheRelease(row->hl_entry);
+        row->hl_entry = NULL;
+        row->hl = NULL;
+        row->brackets = NULL;
+        row->hl_in_comment = -1;
+    }
+    hlCacheTrim(0);
+    syntax_cp.valid = 0;
+    bracketIndexReset();
+}
+
+/* Token actions of a lexer compiled from a syntax definition file */
+#define LEX_COLOR 0          /* color the token with the rule's class */
+#define LEX_IDENT 1          /* identifier: color keywords and types */
+#define LEX_LINE_COMMENT 2   /* comment to the end of the row */
+#define LEX_BLOCK_COMMENT 3  /* comment up to multiline_comment_end */
+#define LEX_STRING 4         /* string closed by its opening byte */
+
+typedef struct LexRule {
+    unsigned char action;
+    unsigned char color;
+} LexRule;
+
+typedef struct Lexer {
+    Dfa dfa;
+    LexRule *rules;
+    int nrules;
+} Lexer;
+
+/* Highlight a row with a table-driven lexer: at each position the DFA
+   finds the longest token, rules listed first winning ties. */
+int lexerHighlightRow(Syntax *syntax, EditorRow *row, int in_comment) {
+    Lexer *lx = syntax->lexer;
+    Dfa *dfa = &lx->dfa;
+    char *s = row->render;
+    unsigned char *hl = row->hl;
+    int n = row->rsize;
+    char *mce = syntax->multiline_comment_end;
+    int mce_len = mce ? strlen(mce) : 0;
+    int i = 0;
     
-    /* Delete matched text */
-    int cx_pos = editorRowRxToCx(row, match->col);
-    for (int i = 0; i < search_ctx.query_len; i++) {
-        if (cx_pos < row->size) {
-            editorRowDelChar(row, cx_pos);
+    while (i < n) {
+        if (in_comment) {
+            int start = i;
+            while (i < n && !(s[i] == mce[0] && i + mce_len <= n && !memcmp(&s[i], mce, mce_len))) i++;
+            if (i < n) {
+                i += mce_len;
+                in_comment = 0;
+            }
+            memset(&hl[start], COLOR_COMMENT, i - start);
+            continue;
+        }
+        
+        int state = 1, end = 0, rule = 0;
+        for (int j = i; j < n; j++) {
+            state = dfa->next[state * dfa->nclasses + dfa->classes[(unsigned char)s[j]]];
+            if (!state) break;
+            if (dfa->accept[state]) {
+                end = j + 1;
+                rule = dfa->accept[state];
+            }
+        }
+        if (end <= i) {
+            i++;
+            continue;
+        }
+        
+        LexRule *r = &lx->rules[rule - 1];
+        switch (r->action) {
+            case LEX_COLOR:
+                memset(&hl[i], r->color, end - i);
+                break;
+            case LEX_IDENT: {
+                int color = keywordLookup(syntax->keyword_table, &s[i], end - i);
+                if (color) memset(&hl[i], color, end - i);
+                break;
+            }
+            case LEX_LINE_COMMENT:
+                end = n;
+                memset(&hl[i], COLOR_COMMENT, end - i);
+                break;
+            case LEX_BLOCK_COMMENT:
+                memset(&hl[i], COLOR_COMMENT, end - i);
+                in_comment = 1;
+                break;
+            case LEX_STRING: {
+                char delim = s[end - 1];
+                while (end < n && s[end] != delim) end += (s[end] == '\\') ? 2 : 1;
+                if (end < n) end++;
+                if (end > n) end = n;
+                memset(&hl[i], COLOR_STRING, end - i);
+                break;
+            }
         }
+        i = end;
     }
     
-    /* Insert replacement text */
-    for (int i = 0; i < search_ctx.replace_len; i++) {
-        editorRowInsertChar(row, cx_pos + i, search_ctx.replace_text[i]);
+    row->hl_open_comment = in_comment;
+    return in_comment;
+}
+
+/* Color the preprocessor directive starting with the '#' at i, and the
+   <file> of an #include. Returns where lexing continues. */
+int editorLexDirective(EditorRow *row, int i) {
+    char *s = row->render;
+    int n = row->rsize;
+    int start = i++;
+    
+    while (i < n && charIs(s[i], CHAR_SPACE)) i++;
+    int word = i;
+    i = charSkipClass(s, i, n, CHAR_IDENT);
+    memset(&row->hl[start], COLOR_PREPROCESSOR, i - start);
+    
+    if (i - word == 7 && !strncmp(&s[word], "include", 7)) {
+        int j = i;
+        while (j < n && charIs(s[j], CHAR_SPACE)) j++;
+        if (j < n && s[j] == '<') {
+            char *close = memchr(&s[j], '>', n - j);
+            if (close) {
+                int end = close - s + 1;
+                memset(&row->hl[j], COLOR_STRING, end - j);
+                return end;
+            }
+        }
     }
-    
-    /* Re-find matches after replacement */
-    findAllMatches();
+    return i;
 }
 
-void replaceAllMatches(void) {
-    int replaced = 0;
+/* Lex a row entered in comment state `in_comment` into row->hl, which
+   must have room for rsize bytes. Returns the state the row ends in. */
+int editorLexRow(EditorRow *row, int in_comment) {
+    memset(row->hl, COLOR_NORMAL, row->rsize);
     
-    while (search_ctx.matches) {
-        replaceCurrentMatch();
-        replaced++;
-        if (replaced > 10000) break; /* Safety limit */
+    if (E.syntax == NULL) {
+        row->hl_open_comment = 0;
+        return 0;
     }
+    if (E.syntax->lexer) return lexerHighlightRow(E.syntax, row, in_comment);
     
-    editorSetStatusMessage("Replaced %d occurrence%s", replaced, replaced == 1 ? "" : "s");
-}
-
-void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+    KeywordTable *kt = E.syntax->keyword_table;
     
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == KEY_ARROW_RIGHT || key == KEY_ARROW_DOWN) {
-        direction = 1;
-    } else if (key == KEY_ARROW_LEFT || key == KEY_ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+    
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+    
+    int flags = E.syntax->flags;
+    int prev_sep = 1;
+    int in_string = 0;
+    
+    /* A directive starts at the first non-blank byte, outside a comment */
+    int directive = -1;
+    if ((flags & HL_HIGHLIGHT_PREPROCESSOR) && !in_comment) {
+        int j = 0;
+        while (j < row->rsize && charIs(row->render[j], CHAR_SPACE)) j++;
+        if (j < row->rsize && row->render[j] == '#') directive = j;
     }
     
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
+    int i = 0;
+    while (i < row->rsize) {
+        char c = row->render[i];
+        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : COLOR_NORMAL;
         
-        EditorRow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-            break;
+        if (i == directive) {
+            i = editorLexDirective(row, i);
+            prev_sep = 1;
+            continue;
         }
-    }
-}
-
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
-    size_t buflen = 0;
-    buf[0] = '\0';
-    
-    while (1) {
-        editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
         
-        int c = editorReadKey();
-        if (c == KEY_DELETE || c == CTRL_KEY('h') || c == KEY_BACKSPACE) {
-            if (buflen != 0) buf[--buflen] = '\0';
-        } else if (c == '\x1b') {
-            editorSetStatusMessage("");
-            if (callback) callback(buf, c);
-            free(buf);
-            return NULL;
-        } else if (c == '\r') {
-            if (buflen != 0) {
-                editorSetStatusMessage("");
-                if (callback) callback(buf, c);
-                return buf;
+        if (scs_len && !in_string && !in_comment) {
+            if (!strncmp(&row->render[i], scs, scs_len)) {
+                memset(&row->hl[i], COLOR_COMMENT, row->rsize - i);
+                break;
             }
-        } else if (!iscntrl(c) && c < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
+        }
+        
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                row->hl[i] = COLOR_COMMENT;
+                if (!strncmp(&row->render[i], mce, mce_len)) {
+                    memset(&row->hl[i], COLOR_COMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                } else {
+                    i++;
+                    continue;
+                }
+            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+                memset(&row->hl[i], COLOR_COMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
             }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
         }
         
-        if (callback) callback(buf, c);
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                row->hl[i] = COLOR_STRING;
+                if (c == '\\' && i + 1 < row->rsize) {
+                    row->hl[i + 1] = COLOR_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string) in_string = 0;
+                i++;
+                prev_sep = 1;
+                continue;
+            } else {
+                if (c == '"' || c == '\'') {
+                    in_string = c;
+                    row->hl[i] = COLOR_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+        
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit(c) && (prev_sep || prev_hl == COLOR_NUMBER)) ||
+                (c == '.' && prev_hl == COLOR_NUMBER)) {
+                row->hl[i] = COLOR_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+        
+        if ((flags & HL_HIGHLIGHT_OPERATORS) && charIs(c, CHAR_OPERATOR)) {
+            row->hl[i] = COLOR_OPERATOR;
+            i++;
+            prev_sep = 1;
+            continue;
+        }
+        
+        if (prev_sep && !is_separator(c)) {
+            int end = charFindClass(row->render, i + 1, row->rsize, CHAR_SEP);
+            
+            int color = keywordLookup(kt, &row->render[i], end - i);
+            if (color) {
+                memset(&row->hl[i], color, end - i);
+                i = end;
+                prev_sep = 0;
+                continue;
+            }
+            
+            /* The rest of an identifier cannot start anything: skip it,
+               then look past any blanks for a call */
+            if (is_ident_char(c)) {
+                int start = i;
+                i = charSkipClass(row->render, i, row->rsize, CHAR_IDENT);
+                if (flags & HL_HIGHLIGHT_FUNCTIONS) {
+                    int j = i;
+                    while (j < row->rsize && row->render[j] == ' ') j++;
+                    if (j < row->rsize && row->render[j] == '(')
+                        memset(&row->hl[start], COLOR_FUNCTION, i - start);
+                }
+                prev_sep = 0;
+                continue;
+            }
+        }
+        
+        prev_sep = is_separator(c);
+        i++;
     }
+    
+    row->hl_open_comment = in_comment;
+    return in_comment;
 }
 
-void editorFind(void) {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+/* Highlight a single row entered in comment state `in_comment`, reusing
+   a cached result for the same text when there is one. Returns the state
+   the row ends in. */
+int editorHighlightRow(EditorRow *row, int in_comment) {
+    uint64_t hash = hlCacheHash(row->render, row->rsize);
+    HlEntry *e = hlCacheFind(hash, row->rsize, in_comment, E.syntax);
     
-    char *query = editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
-    
-    if (query) {
-        strncpy(search_ctx.query, query, sizeof(search_ctx.query) - 1);
-        search_ctx.query_len = strlen(query);
-        search_ctx.case_sensitive = 1;
-        search_ctx.whole_word = 0;
-        findAllMatches();
+    if (e) {
+        hl_cache.hits++;
+    } else {
+        hl_cache.misses++;
+        if (row->rsize > hl_cache.scratch_cap) {
+            hl_cache.scratch_cap = row->rsize * 2;
+            hl_cache.scratch = realloc(hl_cache.scratch, hl_cache.scratch_cap);
+        }
+        row->hl = hl_cache.scratch;
+        int out = editorLexRow(row, in_comment);
+        e = hlCacheAdd(hash, row->rsize, in_comment, E.syntax, row->render,
+                       hl_cache.scratch, out);
+    }
+    
+    hlCacheRetain(e);
+    hlCacheRelease(row->hl_entry);
+    if (row->hl_entry != e) bracketIndexRowChanged(row->idx);
+    row->hl_entry = e;
+    row->hl = e->hl;
+    row->brackets = &e->brackets;
+    row->hl_in_comment = in_comment;
+    row->hl_open_comment = e->out_comment;
+    return e->out_comment;
+}
+
+/* Make sure rows [from, to) are highlighted from their true incoming
+   state, lexing forward from the nearest valid checkpoint. At most
+   `budget` rows are lexed; if that is not enough 0 is returned and the
+   checkpoints are left as far as it got, so the next call resumes. */
+int editorSyntaxEnsure(int from, int to, int budget) {
+    if (to > E.numrows) to = E.numrows;
+    if (from >= to) return 1;
+    
+    if (syntax_cp.valid == 0) syntaxCheckpointSet(0, 0);
+    int k = from / EDE_SYNTAX_CHECKPOINT;
+    if (k >= syntax_cp.valid) k = syntax_cp.valid - 1;
+    
+    int state = syntax_cp.state[k];
+    for (int r = k * EDE_SYNTAX_CHECKPOINT; r < to; r++) {
+        if (r % EDE_SYNTAX_CHECKPOINT == 0) syntaxCheckpointSet(r / EDE_SYNTAX_CHECKPOINT, state);
         
-        if (search_ctx.match_count > 0) {
-            gotoNextMatch();
-            editorSetStatusMessage("Found %d match%s (n=next, N=prev)", 
-                search_ctx.match_count, search_ctx.match_count == 1 ? "" : "es");
-        } else {
-            editorSetStatusMessage("No matches found");
-            E.cx = saved_cx;
-            E.cy = saved_cy;
-            E.coloff = saved_coloff;
-            E.rowoff = saved_rowoff;
+        EditorRow *row = &E.row[r];
+        if (row->hl_in_comment != state) {
+            if (budget-- <= 0) return 0;
+            editorHighlightRow(row, state);
         }
-        free(query);
-    } else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+        state = row->hl_open_comment;
     }
+    return 1;
 }
 
-void editorReplace(void) {
-    char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
-    if (!query) return;
-    
-    strncpy(search_ctx.query, query, sizeof(search_ctx.query) - 1);
-    search_ctx.query_len = strlen(query);
-    free(query);
-    
-    char *replace = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
-    if (!replace) return;
-    
-    strncpy(search_ctx.replace_text, replace, sizeof(search_ctx.replace_text) - 1);
-    search_ctx.replace_len = strlen(replace);
-    free(replace);
-    
-    search_ctx.case_sensitive = 1;
-    search_ctx.whole_word = 0;
-    findAllMatches();
-    
-    if (search_ctx.match_count == 0) {
-        editorSetStatusMessage("No matches found");
-        return;
+void editorUpdateSyntax(EditorRow *row) {
+    hlCacheRelease(row->hl_entry);
+    row->hl_entry = NULL;
+    row->hl = NULL;
+    row->brackets = NULL;
+    row->hl_in_comment = -1;
+    editorSyntaxInvalidate(row->idx);
+    bracketIndexRowChanged(row->idx);
+}
+
+/* Row ranges of the panes last drawn. When drawing could not highlight
+   them within EDE_SYNTAX_SYNC_ROWS (say after a jump to the end of a huge
+   file), rows that have no highlighting yet are drawn plain and the idle
+   worker below finishes the job, then redraws. */
+typedef struct SyntaxView {
+    int from[2];
+    int to[2];
+    int count;
+    int ready;
+} SyntaxView;
+
+SyntaxView syntax_view = {{0, 0}, {0, 0}, 0, 1};
+
+void editorSyntaxPrepareView(int pane, int from, int to) {
+    if (pane == 0) syntax_view.ready = 1;
+    syntax_view.count = pane + 1;
+    syntax_view.from[pane] = from;
+    syntax_view.to[pane] = to;
+    if (!editorSyntaxEnsure(from, to, EDE_SYNTAX_SYNC_ROWS)) syntax_view.ready = 0;
+}
+
+/* One slice of idle highlighting: first the visible panes plus a screen
+   above and below each, then the checkpoints down to the end of the file.
+   Returns 1 while there is work left. */
+int editorSyntaxIdle(int budget) {
+    if (!syntax_view.ready) {
+        int ready = 1;
+        for (int i = 0; i < syntax_view.count; i++) {
+            int margin = syntax_view.to[i] - syntax_view.from[i];
+            int from = syntax_view.from[i] - margin;
+            if (from < 0) from = 0;
+            if (!editorSyntaxEnsure(from, syntax_view.to[i] + margin, budget)) ready = 0;
+        }
+        syntax_view.ready = ready;
+        return 1;
     }
-    
-    char *confirm = editorPrompt("Replace all %d matches? (y/n): %s", NULL);
-    if (confirm && (confirm[0] == 'y' || confirm[0] == 'Y')) {
-        replaceAllMatches();
+    return !editorSyntaxEnsure(E.numrows - 1, E.numrows, budget);
+}
+
+/* Highlight while the user is idle, one slice at a time so a keypress
+   never waits for more than a slice */
+void editorRunIdle(void) {
+    int more = 1;
+    int changed = searchIdle();
+    changed |= finderIdle();
+    changed |= grepIdle();
+    if (changed) editorRefreshScreen();
+    while (more && !editorInputPending()) {
+        int was_ready = syntax_view.ready;
+        more = editorSyntaxIdle(EDE_SYNTAX_IDLE_ROWS);
+        if (!was_ready && syntax_view.ready) editorRefreshScreen();
     }
-    if (confirm) free(confirm);
 }
 
-/*** Clipboard System ***/
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case COLOR_KEYWORD: return 33; /* Yellow */
+        case COLOR_STRING: return 32; /* Green */
+        case COLOR_COMMENT: return 36; /* Cyan */
+        case COLOR_NUMBER: return 35; /* Magenta */
+        case COLOR_TYPE: return 34; /* Blue */
+        case COLOR_FUNCTION: return 31; /* Red */
+        case COLOR_PREPROCESSOR: return 35; /* Magenta */
+        case COLOR_OPERATOR: return 37; /* White */
+        case COLOR_LINENR: return 90; /* Bright black */
+        case COLOR_BRACKET1: return 93; /* Bright yellow */
+        case COLOR_BRACKET2: return 95; /* Bright magenta */
+        case COLOR_BRACKET3: return 96; /* Bright cyan */
+        case COLOR_MATCH: return 30; /* Black, on yellow */
+        default: return 37; /* White */
+    }
+}
 
-#define MAX_CLIPBOARD_SIZE 1048576  /* 1MB */
+/*** Themes ***/
 
-typedef struct Clipboard {
-    char *text;
-    int length;
-    int is_line_mode;
-} Clipboard;
+/* A theme is compiled once, at load time, into one ready-made SGR sequence
+   per highlight class. The renderer only compares class ids and copies
+   these bytes, so a truecolor theme costs the same as the 8 basic colors. */
 
-Clipboard clipboard = {NULL, 0, 0};
+#define THEME_COLOR_DEFAULT -1
+#define THEME_COLOR_RGB 0x1000000
+#define THEME_ATTR_BOLD (1<<0)
+#define THEME_ATTR_ITALIC (1<<1)
+#define THEME_ATTR_UNDERLINE (1<<2)
+#define THEME_SEQ_MAX 64
 
-void clipboardSet(const char *text, int length, int is_line_mode) {
-    free(clipboard.text);
-    clipboard.text = malloc(length + 1);
-    memcpy(clipboard.text, text, length);
-    clipboard.text[length] = '\0';
-    clipboard.length = length;
-    clipboard.is_line_mode = is_line_mode;
-}
+typedef struct ThemeStyle {
+    int fg;
+    int bg;
+    int attrs;
+} ThemeStyle;
 
-void editorCopy(void) {
-    if (E.cy >= E.numrows) return;
-    
-    EditorRow *row = &E.row[E.cy];
-    clipboardSet(row->chars, row->size, 1);
-    editorSetStatusMessage("Line copied to clipboard");
-}
+typedef struct Theme {
+    ThemeStyle styles[COLOR_COUNT];
+    char seq[COLOR_COUNT][THEME_SEQ_MAX];
+    int seq_len[COLOR_COUNT];
+    unsigned char canon[COLOR_COUNT]; /* first class with identical bytes */
+    int full;               /* every sequence resets attributes and background */
+} Theme;
 
-void editorCut(void) {
-    if (E.cy >= E.numrows) return;
-    
-    EditorRow *row = &E.row[E.cy];
-    clipboardSet(row->chars, row->size, 1);
-    editorDelRow(E.cy);
-    if (E.cy >= E.numrows) E.cy = E.numrows - 1;
-    if (E.cy < 0) E.cy = 0;
-    editorSetStatusMessage("Line cut to clipboard");
-}
+Theme theme;
 
-void editorPaste(void) {
-    if (!clipboard.text) {
-        editorSetStatusMessage("Clipboard is empty");
-        return;
-    }
-    
-    if (clipboard.is_line_mode) {
-        editorInsertRow(E.cy + 1, clipboard.text, clipboard.length);
-        E.cy++;
-        E.cx = 0;
-    } else {
-        for (int i = 0; i < clipboard.length; i++) {
-            editorInsertChar(clipboard.text[i]);
+const char *theme_class_names[COLOR_COUNT] = {
+    "normal", "keyword", "string", "comment", "number",
+    "function", "preprocessor", "operator", "type", "linenr",
+    "bracket1", "bracket2", "bracket3", "match"
+};
+
+const char *theme_basic_colors[] = {
+    "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white", NULL
+};
+
+int themeAppendColor(char *seq, int len, int color, int is_bg) {
+    int base = is_bg ? 40 : 30;
+    int room = THEME_SEQ_MAX - len;
+    
+    if (color == THEME_COLOR_DEFAULT)
+        return len + snprintf(&seq[len], room, ";%d", base + 9);
+    if (color & THEME_COLOR_RGB)
+        return len + snprintf(&seq[len], room, ";%d;2;%d;%d;%d", base + 8,
+            (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+    if (color < 8)
+        return len + snprintf(&seq[len], room, ";%d", base + color);
+    if (color < 16)
+        return len + snprintf(&seq[len], room, ";%d", base + 60 + color - 8);
+    return len + snprintf(&seq[len], room, ";%d;5;%d", base + 8, color);
+}
+
+void themeCompile(Theme *t) {
+    /* Only reset attributes between classes when the theme uses them;
+       otherwise the sequences are as short as plain foreground changes. */
+    int full = 0;
+    for (int h = 0; h < COLOR_COUNT; h++) {
+        if (h == COLOR_MATCH) continue;
+        if (t->styles[h].attrs || t->styles[h].bg != THEME_COLOR_DEFAULT) full = 1;
+    }
+    t->full = full;
+    
+    /* Matches always carry a background, so they get a full sequence of
+       their own and the renderer resets after them when the rest are
+       short */
+    for (int h = 0; h < COLOR_COUNT; h++) {
+        int full = t->full || h == COLOR_MATCH;
+        /* Unset colors inherit from the normal class */
+        ThemeStyle st = t->styles[h];
+        if (st.fg == THEME_COLOR_DEFAULT) st.fg = t->styles[COLOR_NORMAL].fg;
+        if (st.bg == THEME_COLOR_DEFAULT) st.bg = t->styles[COLOR_NORMAL].bg;
+        char *seq = t->seq[h];
+        int len = snprintf(seq, THEME_SEQ_MAX, "\x1b[%s", full ? "0" : "");
+        
+        if (st.attrs & THEME_ATTR_BOLD) len += snprintf(&seq[len], THEME_SEQ_MAX - len, ";1");
+        if (st.attrs & THEME_ATTR_ITALIC) len += snprintf(&seq[len], THEME_SEQ_MAX - len, ";3");
+        if (st.attrs & THEME_ATTR_UNDERLINE) len += snprintf(&seq[len], THEME_SEQ_MAX - len, ";4");
+        len = themeAppendColor(seq, len, st.fg, 0);
+        if (full) len = themeAppendColor(seq, len, st.bg, 1);
+        
+        /* "\x1b[;33m" -> "\x1b[33m" when nothing precedes the first param */
+        if (!full) {
+            memmove(&seq[2], &seq[3], len - 3);
+            len--;
+        }
+        seq[len++] = 'm';
+        seq[len] = '\0';
+        t->seq_len[h] = len;
+        
+        t->canon[h] = h;
+        for (int k = 0; k < h; k++) {
+            if (t->seq_len[k] == len && memcmp(t->seq[k], seq, len) == 0) {
+                t->canon[h] = k;
+                break;
+            }
         }
     }
-    editorSetStatusMessage("Pasted from clipboard");
 }
 
-void clipboardFree(void) {
-    free(clipboard.text);
-    clipboard.text = NULL;
-    clipboard.length = 0;
+void themeLoadDefaults(Theme *t) {
+    for (int h = 0; h < COLOR_COUNT; h++) {
+        int sgr = editorSyntaxToColor(h);
+        t->styles[h].fg = (h == COLOR_NORMAL) ? THEME_COLOR_DEFAULT :
+                          (sgr >= 90) ? sgr - 90 + 8 : sgr - 30;
+        t->styles[h].bg = THEME_COLOR_DEFAULT;
+        t->styles[h].attrs = 0;
+    }
+    t->styles[COLOR_MATCH].bg = 3;
+    themeCompile(t);
 }
 
-/*** Autocomplete System ***/
-
-#define MAX_COMPLETIONS 256
-#define MAX_COMPLETION_LEN 128
-
-typedef struct Autocomplete {
-    char completions[MAX_COMPLETIONS][MAX_COMPLETION_LEN];
-    int count;
-    int selected;
-    int active;
-    char prefix[MAX_COMPLETION_LEN];
-    int prefix_len;
-} Autocomplete;
-
-Autocomplete autocomplete = {0};
+int themeParseColor(const char *spec, int *color) {
+    if (strcmp(spec, "default") == 0) {
+        *color = THEME_COLOR_DEFAULT;
+        return 0;
+    }
+    for (int i = 0; theme_basic_colors[i]; i++) {
+        if (strcmp(spec, theme_basic_colors[i]) == 0) {
+            *color = i;
+            return 0;
+        }
+    }
+    if (spec[0] == '#') {
+        /* Exactly six hex digits; strtol alone would take a sign or "0x" */
+        for (int i = 1; i <= 6; i++) {
+            if (!isxdigit((unsigned char)spec[i])) return -1;
+        }
+        if (spec[7] != '\0') return -1;
+        *color = THEME_COLOR_RGB | (int)strtol(spec + 1, NULL, 16);
+        return 0;
+    }
+    if (isdigit((unsigned char)spec[0])) {
+        char *end;
+        long n = strtol(spec, &end, 10);
+        if (*end != '\0' || n > 255) return -1;
+        *color = (int)n;
+        return 0;
+    }
+    return -1;
+}
 
-void autocompleteReset(void) {
-    autocomplete.count = 0;
-    autocomplete.selected = 0;
-    autocomplete.active = 0;
-    autocomplete.prefix_len = 0;
-}
-
-void autocompleteAddWord(const char *word) {
-    if (autocomplete.count >= MAX_COMPLETIONS) return;
-    
-    /* Check for duplicates */
-    for (int i = 0; i < autocomplete.count; i++) {
-        if (strcmp(autocomplete.completions[i], word) == 0) {
-            return;
-        }
-    }
-    
-    strncpy(autocomplete.completions[autocomplete.count], word, MAX_COMPLETION_LEN - 1);
-    autocomplete.completions[autocomplete.count][MAX_COMPLETION_LEN - 1] = '\0';
-    autocomplete.count++;
-}
-
-void autocompleteBuildList(void) {
-    autocompleteReset();
-    
-    if (E.cy >= E.numrows) return;
+/* Theme file format, one highlight class per line:
+     # comment
+     keyword = fg:yellow bold
+     comment = fg:#6a9955 italic
+     normal  = fg:252 bg:235
+   Colors are basic names, 0-255 palette indexes or #rrggbb. Classes that
+   are not mentioned keep their default style. */
+int themeLoad(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
     
-    EditorRow *row = &E.row[E.cy];
-    if (E.cx == 0) return;
+    Theme t;
+    themeLoadDefaults(&t);
     
-    /* Find word prefix */
-    int start = E.cx - 1;
-    while (start > 0 && (isalnum(row->chars[start - 1]) || row->chars[start - 1] == '_')) {
-        start--;
+    char line[512];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0' || *p == '#') continue;
+        
+        char *eq = strchr(p, '=');
+        if (!eq) goto bad;
+        *eq = '\0';
+        
+        char name[64];
+        if (sscanf(p, "%63s", name) != 1) goto bad;
+        int h;
+        for (h = 0; h < COLOR_COUNT; h++) {
+            if (strcmp(name, theme_class_names[h]) == 0) break;
+        }
+        if (h == COLOR_COUNT) goto bad;
+        
+        ThemeStyle st = { THEME_COLOR_DEFAULT, THEME_COLOR_DEFAULT, 0 };
+        char *tok = strtok(eq + 1, " \t\r\n");
+        while (tok) {
+            if (strncmp(tok, "fg:", 3) == 0) {
+                if (themeParseColor(tok + 3, &st.fg) != 0) goto bad;
+            } else if (strncmp(tok, "bg:", 3) == 0) {
+                if (themeParseColor(tok + 3, &st.bg) != 0) goto bad;
+            } else if (strcmp(tok, "bold") == 0) {
+                st.attrs |= THEME_ATTR_BOLD;
+            } else if (strcmp(tok, "italic") == 0) {
+                st.attrs |= THEME_ATTR_ITALIC;
+            } else if (strcmp(tok, "underline") == 0) {
+                st.attrs |= THEME_ATTR_UNDERLINE;
+            } else {
+                goto bad;
+            }
+            tok = strtok(NULL, " \t\r\n");
+        }
+        t.styles[h] = st;
     }
+    fclose(fp);
     
-    int prefix_len = E.cx - start;
-    if (prefix_len < 2) return;
-    
-    strncpy(autocomplete.prefix, &row->chars[start], prefix_len);
-    autocomplete.prefix[prefix_len] = '\0';
-    autocomplete.prefix_len = prefix_len;
+    themeCompile(&t);
+    theme = t;
+    return 0;
     
-    /* Search all rows for matching words */
-    for (int r = 0; r < E.numrows; r++) {
-        EditorRow *erow = &E.row[r];
-        char *line = erow->chars;
-        int len = erow->size;
+bad:
+    fclose(fp);
+    editorSetStatusMessage("Theme error: %s line %d", path, lineno);
+    return -2;
+}
+
+/*** Syntax files ***/
+
+/* Languages beyond the built-in HLDB are defined in files, by default
+   every *.esyn file in ~/.ede_syntax. The format follows the theme file:
+
+       name = go
+       match = .go
+       keywords = break case chan const continue defer else for func ...
+       types = bool byte error int string ...
+       comment = //
+       block_comment = <start> <end>
+       strings = " ' `
+       numbers = yes            (no, or a regex)
+       identifier = <regex>     (default [A-Za-z_][A-Za-z0-9_]*)
+       rule preprocessor = #[a-z]+
+
+   Rules are tried before comments, strings, numbers and identifiers and
+   may use any theme class. Everything is compiled into one DFA, and the
+   result is cached as <name>-<path hash>.elex in $XDG_CACHE_HOME/ede
+   (~/.cache/ede, or %LOCALAPPDATA%\ede on Windows), so that syntax
+   files in read-only or shared directories get a cache too. The cache
+   is used without reading the source while the source's modification
+   time and size are the ones it was compiled from, and otherwise for as
+   long as the hash of the source matches. */
+
+#define SYNTAX_CACHE_MAGIC "EDELEX2"
+#define SYNTAX_MAX_RULES 254
+#define SYNTAX_FIXED_RULES 4     /* comment, block comment, numbers, identifier */
+
+Syntax **syntax_files = NULL;
+int syntax_file_count = 0;
+
+typedef struct SyntaxSpec {
+    char **words;   /* match patterns, then keywords, as growable lists */
+    int count;
+} SyntaxSpec;
+
+void syntaxListAdd(SyntaxSpec *list, const char *word, int len, int type) {
+    list->words = realloc(list->words, sizeof(char *) * (list->count + 2));
+    char *w = malloc(len + 2);
+    memcpy(w, word, len);
+    if (type) w[len++] = '|';
+    w[len] = '\0';
+    list->words[list->count++] = w;
+    list->words[list->count] = NULL;
+}
+
+void syntaxListAddWords(SyntaxSpec *list, const char *value, int type) {
+    while (*value) {
+        while (isspace((unsigned char)*value)) value++;
+        int len = 0;
+        while (value[len] && !isspace((unsigned char)value[len])) len++;
+        if (len) syntaxListAdd(list, value, len, type);
+        value += len;
+    }
+}
+
+void syntaxFreeList(char **list) {
+    if (!list) return;
+    for (int i = 0; list[i]; i++) free(list[i]);
+    free(list);
+}
+
+/* Free a definition loaded from a syntax file or its cache */
+void syntaxFree(Syntax *syn) {
+    free(syn->filetype);
+    syntaxFreeList(syn->filematch);
+    syntaxFreeList(syn->keywords);
+    free(syn->singleline_comment_start);
+    free(syn->multiline_comment_start);
+    free(syn->multiline_comment_end);
+    if (syn->keyword_table) {
+        free(syn->keyword_table->words);
+        free(syn->keyword_table->lens);
+        free(syn->keyword_table->colors);
+        free(syn->keyword_table);
+    }
+    if (syn->lexer) {
+        free(syn->lexer->dfa.next);
+        free(syn->lexer->dfa.accept);
+        free(syn->lexer->rules);
+        free(syn->lexer);
+    }
+    free(syn);
+}
+
+/* Parse and compile a definition. Returns NULL with *error set on failure. */
+Syntax *syntaxCompile(char *src, int *lineno, const char **error) {
+    Syntax *syn = calloc(1, sizeof(Syntax));
+    Lexer *lx = calloc(1, sizeof(Lexer));
+    SyntaxSpec match = {NULL, 0}, keywords = {NULL, 0}, delims = {NULL, 0};
+    SyntaxSpec patterns = {NULL, 0};
+    unsigned char colors[SYNTAX_MAX_RULES];
+    int lines[SYNTAX_MAX_RULES];
+    const char *numbers = "[0-9][0-9A-Za-z_.]*";
+    const char *identifier = "[A-Za-z_][A-Za-z0-9_]*";
+    Nfa nfa = {0};
+    
+    syn->lexer = lx;
+    *lineno = 0;
+    *error = NULL;
+    
+    char *line = src;
+    while (line && *line && !*error) {
+        char *nl = strchr(line, '\n');
+        if (nl) *nl = '\0';
+        (*lineno)++;
         
-        for (int i = 0; i < len; i++) {
-            if (isalnum(line[i]) || line[i] == '_') {
-                int word_start = i;
-                while (i < len && (isalnum(line[i]) || line[i] == '_')) {
-                    i++;
-                }
-                int word_len = i - word_start;
-                
-                if (word_len > prefix_len && word_len < MAX_COMPLETION_LEN) {
-                    if (strncmp(&line[word_start], autocomplete.prefix, prefix_len) == 0) {
-                        char word[MAX_COMPLETION_LEN];
-                        strncpy(word, &line[word_start], word_len);
-                        word[word_len] = '\0';
-                        autocompleteAddWord(word);
-                    }
-                }
+        char *p = line;
+        line = nl ? nl + 1 : NULL;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0' || *p == '#') continue;
+        
+        char *eq = strchr(p, '=');
+        if (!eq) {
+            *error = "expected key = value";
+            break;
+        }
+        char *value = eq + 1;
+        while (isspace((unsigned char)*value)) value++;
+        char *vend = value + strlen(value);
+        while (vend > value && isspace((unsigned char)vend[-1])) *--vend = '\0';
+        
+        char key[32], arg[32] = "";
+        *eq = '\0';
+        if (sscanf(p, "%31s %31s", key, arg) < 1) {
+            *error = "expected key = value";
+            break;
+        }
+        
+        if (!strcmp(key, "name")) {
+            free(syn->filetype);
+            syn->filetype = strdup(value);
+        } else if (!strcmp(key, "match")) {
+            syntaxListAddWords(&match, value, 0);
+        } else if (!strcmp(key, "keywords")) {
+            syntaxListAddWords(&keywords, value, 0);
+        } else if (!strcmp(key, "types")) {
+            syntaxListAddWords(&keywords, value, 1);
+        } else if (!strcmp(key, "comment")) {
+            free(syn->singleline_comment_start);
+            syn->singleline_comment_start = strdup(value);
+        } else if (!strcmp(key, "block_comment")) {
+            char start[64], end[64];
+            if (sscanf(value, "%63s %63s", start, end) != 2) {
+                *error = "block_comment needs a start and an end";
+                break;
+            }
+            syn->multiline_comment_start = strdup(start);
+            syn->multiline_comment_end = strdup(end);
+        } else if (!strcmp(key, "strings")) {
+            syntaxListAddWords(&delims, value, 0);
+            syn->flags |= HL_HIGHLIGHT_STRINGS;
+            if (patterns.count + delims.count + SYNTAX_FIXED_RULES > SYNTAX_MAX_RULES) {
+                *error = "too many rules";
+                break;
+            }
+        } else if (!strcmp(key, "numbers")) {
+            numbers = !strcmp(value, "no") ? NULL : !strcmp(value, "yes") ? numbers : value;
+        } else if (!strcmp(key, "identifier")) {
+            identifier = value;
+        } else if (!strcmp(key, "rule")) {
+            int h;
+            for (h = 0; h < COLOR_COUNT; h++)
+                if (!strcmp(arg, theme_class_names[h])) break;
+            if (h == COLOR_COUNT) {
+                *error = "unknown class";
+                break;
             }
+            /* Every rule, string delimiter and fixed rule takes a DFA
+               accept number */
+            if (patterns.count + delims.count + SYNTAX_FIXED_RULES >= SYNTAX_MAX_RULES) {
+                *error = "too many rules";
+                break;
+            }
+            colors[patterns.count] = h;
+            lines[patterns.count] = *lineno;
+            syntaxListAdd(&patterns, value, strlen(value), 0);
+        } else {
+            *error = "unknown key";
         }
     }
     
-    if (autocomplete.count > 0) {
-        autocomplete.active = 1;
+    if (!*error && (!syn->filetype || match.count == 0)) *error = "name and match are required";
+    
+    /* Rule order is priority order on tokens of equal length */
+    lx->rules = malloc(sizeof(LexRule) * (patterns.count + delims.count + SYNTAX_FIXED_RULES));
+    for (int r = 0; r < patterns.count && !*error; r++) {
+        if ((*error = nfaAddRegex(&nfa, patterns.words[r], lx->nrules)) != NULL) {
+            *lineno = lines[r];
+            break;
+        }
+        lx->rules[lx->nrules].action = LEX_COLOR;
+        lx->rules[lx->nrules++].color = colors[r];
+    }
+    if (!*error && syn->singleline_comment_start) {
+        nfaAddLiteral(&nfa, syn->singleline_comment_start, lx->nrules);
+        lx->rules[lx->nrules++].action = LEX_LINE_COMMENT;
+    }
+    if (!*error && syn->multiline_comment_start) {
+        nfaAddLiteral(&nfa, syn->multiline_comment_start, lx->nrules);
+        lx->rules[lx->nrules++].action = LEX_BLOCK_COMMENT;
+    }
+    for (int d = 0; d < delims.count && !*error; d++) {
+        char delim[2] = { delims.words[d][0], '\0' };
+        nfaAddLiteral(&nfa, delim, lx->nrules);
+        lx->rules[lx->nrules++].action = LEX_STRING;
+    }
+    if (!*error && numbers) {
+        syn->flags |= HL_HIGHLIGHT_NUMBERS;
+        if ((*error = nfaAddRegex(&nfa, numbers, lx->nrules)) == NULL) {
+            lx->rules[lx->nrules].action = LEX_COLOR;
+            lx->rules[lx->nrules++].color = COLOR_NUMBER;
+        }
     }
-}
-
-void autocompleteInsertSelected(void) {
-    if (!autocomplete.active || autocomplete.count == 0) return;
+    if (!*error) {
+        if ((*error = nfaAddRegex(&nfa, identifier, lx->nrules)) == NULL)
+            lx->rules[lx->nrules++].action = LEX_IDENT;
+    }
+    if (!*error && dfaBuild(&lx->dfa, &nfa) != 0) *error = "rules too complex";
     
-    char *completion = autocomplete.completions[autocomplete.selected];
-    int remaining = strlen(completion) - autocomplete.prefix_len;
+    nfaFree(&nfa);
+    for (int i = 0; i < patterns.count; i++) free(patterns.words[i]);
+    for (int i = 0; i < delims.count; i++) free(delims.words[i]);
+    free(patterns.words);
+    free(delims.words);
     
-    for (int i = 0; i < remaining; i++) {
-        editorInsertChar(completion[autocomplete.prefix_len + i]);
+    if (*error) {
+        syn->filematch = match.words;
+        syn->keywords = keywords.words;
+        syntaxFree(syn);
+        return NULL;
     }
     
-    autocompleteReset();
+    syn->filematch = match.words;
+    syn->keywords = keywords.words ? keywords.words : calloc(1, sizeof(char *));
+    syn->keyword_table = keywordTableBuild(syn->keywords);
+    return syn;
 }
 
-void autocompleteNext(void) {
-    if (!autocomplete.active) return;
-    autocomplete.selected = (autocomplete.selected + 1) % autocomplete.count;
+void cacheWriteInt(FILE *fp, int v) {
+    fwrite(&v, sizeof(int), 1, fp);
 }
 
-void autocompletePrev(void) {
-    if (!autocomplete.active) return;
-    autocomplete.selected = (autocomplete.selected - 1 + autocomplete.count) % autocomplete.count;
+void cacheWriteStr(FILE *fp, const char *s) {
+    int len = s ? (int)strlen(s) : -1;
+    cacheWriteInt(fp, len);
+    if (len > 0) fwrite(s, 1, len, fp);
 }
 
-/*** Macro Recording System ***/
-
-#define MAX_MACRO_SIZE 10000
+void cacheWriteList(FILE *fp, char **list) {
+    int n = 0;
+    while (list[n]) n++;
+    cacheWriteInt(fp, n);
+    for (int i = 0; i < n; i++) cacheWriteStr(fp, list[i]);
+}
 
-typedef struct Macro {
-    int keys[MAX_MACRO_SIZE];
-    int count;
-    int recording;
-    int playing;
-} Macro;
+int cacheReadInt(FILE *fp) {
+    int v = -1;
+    if (fread(&v, sizeof(int), 1, fp) != 1) return -1;
+    return v;
+}
 
-Macro macro = {0};
+char *cacheReadStr(FILE *fp) {
+    int len = cacheReadInt(fp);
+    if (len < 0 || len > 65536) return NULL;
+    char *s = malloc(len + 1);
+    if (fread(s, 1, len, fp) != (size_t)len) len = 0;
+    s[len] = '\0';
+    return s;
+}
 
-void macroStartRecording(void) {
-    macro.count = 0;
-    macro.recording = 1;
-    editorSetStatusMessage("Recording macro... (Ctrl-M to stop)");
+char **cacheReadList(FILE *fp) {
+    int n = cacheReadInt(fp);
+    if (n < 0 || n > 65536) n = 0;
+    char **list = malloc(sizeof(char *) * (n + 1));
+    for (int i = 0; i < n; i++) {
+        list[i] = cacheReadStr(fp);
+        if (!list[i]) list[i] = strdup("");
+    }
+    list[n] = NULL;
+    return list;
 }
 
-void macroStopRecording(void) {
-    macro.recording = 0;
-    editorSetStatusMessage("Macro recorded (%d keys)", macro.count);
+/* Modification time and size of a syntax file, both 0 where they can't
+   be had */
+typedef struct SyntaxStamp {
+    long long mtime;
+    long long size;
+} SyntaxStamp;
+
+SyntaxStamp syntaxFileStamp(const char *path) {
+    SyntaxStamp stamp = {0, 0};
+#ifdef EDE_UNIX
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        stamp.mtime = st.st_mtime;
+        stamp.size = st.st_size;
+    }
+#else
+    (void)path;
+#endif
+    return stamp;
 }
 
-void macroRecordKey(int key) {
-    if (!macro.recording || macro.count >= MAX_MACRO_SIZE) return;
-    macro.keys[macro.count++] = key;
+/* Cache file for the syntax file at path, creating the cache directory.
+   Returns -1 if there is nowhere to put it. */
+int syntaxCachePath(const char *path, char *out, int size) {
+    char dir[MAX_PATH_LENGTH], full[2 * MAX_PATH_LENGTH + 2];
+#ifdef EDE_WINDOWS
+    if (!getenv("LOCALAPPDATA")) return -1;
+    snprintf(dir, sizeof(dir), "%s\\ede", getenv("LOCALAPPDATA"));
+    _mkdir(dir);
+    int absolute = path[0] == '\\' || path[0] == '/' || (path[0] && path[1] == ':');
+#else
+    if (getenv("XDG_CACHE_HOME") && getenv("XDG_CACHE_HOME")[0]) {
+        snprintf(dir, sizeof(dir), "%s/ede", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME")) {
+        snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME"));
+        mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/.cache/ede", getenv("HOME"));
+    } else {
+        return -1;
+    }
+    mkdir(dir, 0755);
+    int absolute = path[0] == '/';
+#endif
+    
+    /* Key on the absolute path, so the same relative name in two
+       directories gets two caches */
+    char cwd[MAX_PATH_LENGTH];
+    if (absolute || !getcwd(cwd, sizeof(cwd))) snprintf(full, sizeof(full), "%s", path);
+    else snprintf(full, sizeof(full), "%s/%s", cwd, path);
+    
+    const char *base = path;
+    for (const char *p = path; *p; p++)
+        if (*p == '/' || *p == '\\') base = p + 1;
+    const char *ext = strrchr(base, '.');
+    int stem = (ext && !strcmp(ext, ".esyn")) ? (int)(ext - base) : (int)strlen(base);
+    snprintf(out, size, "%s/%.*s-%08x.elex", dir, stem, base,
+        hashBytes(full, strlen(full), 0));
+    return 0;
 }
 
-void macroPlayback(void) {
-    if (macro.count == 0) {
-        editorSetStatusMessage("No macro recorded");
-        return;
+void syntaxWriteCache(const char *path, unsigned int hash, SyntaxStamp stamp, Syntax *syn) {
+    /* Written aside and renamed into place, so that another editor never
+       reads half a cache */
+    char tmp[MAX_PATH_LENGTH + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return;
+    
+    Lexer *lx = syn->lexer;
+    fwrite(SYNTAX_CACHE_MAGIC, 1, 8, fp);
+    cacheWriteInt(fp, (int)hash);
+    fwrite(&stamp, sizeof(stamp), 1, fp);
+    cacheWriteStr(fp, syn->filetype);
+    cacheWriteList(fp, syn->filematch);
+    cacheWriteList(fp, syn->keywords);
+    cacheWriteStr(fp, syn->singleline_comment_start);
+    cacheWriteStr(fp, syn->multiline_comment_start);
+    cacheWriteStr(fp, syn->multiline_comment_end);
+    cacheWriteInt(fp, syn->flags);
+    
+    fwrite(lx->dfa.classes, 1, 256, fp);
+    cacheWriteInt(fp, lx->dfa.nclasses);
+    cacheWriteInt(fp, lx->dfa.nstates);
+    fwrite(lx->dfa.next, sizeof(unsigned short), lx->dfa.nstates * lx->dfa.nclasses, fp);
+    fwrite(lx->dfa.accept, 1, lx->dfa.nstates, fp);
+    cacheWriteInt(fp, lx->nrules);
+    fwrite(lx->rules, sizeof(LexRule), lx->nrules, fp);
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) remove(tmp);
+}
+
+/* Returns the cached definition if it was compiled from a source with
+   this hash, or with no hash given, from one with this stamp; else NULL */
+Syntax *syntaxReadCache(const char *path, const unsigned int *hash, SyntaxStamp stamp) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    
+    char magic[8];
+    SyntaxStamp cached;
+    int ok = fread(magic, 1, 8, fp) == 8 && !memcmp(magic, SYNTAX_CACHE_MAGIC, 8);
+    unsigned int cached_hash = (unsigned int)cacheReadInt(fp);
+    ok = ok && fread(&cached, sizeof(cached), 1, fp) == 1;
+    if (hash) ok = ok && cached_hash == *hash;
+    else ok = ok && stamp.mtime != 0 && cached.mtime == stamp.mtime && cached.size == stamp.size;
+    if (!ok) {
+        fclose(fp);
+        return NULL;
+    }
+    
+    Syntax *syn = calloc(1, sizeof(Syntax));
+    Lexer *lx = calloc(1, sizeof(Lexer));
+    syn->lexer = lx;
+    syn->filetype = cacheReadStr(fp);
+    syn->filematch = cacheReadList(fp);
+    syn->keywords = cacheReadList(fp);
+    syn->singleline_comment_start = cacheReadStr(fp);
+    syn->multiline_comment_start = cacheReadStr(fp);
+    syn->multiline_comment_end = cacheReadStr(fp);
+    syn->flags = cacheReadInt(fp);
+    
+    ok = fread(lx->dfa.classes, 1, 256, fp) == 256;
+    lx->dfa.nclasses = cacheReadInt(fp);
+    lx->dfa.nstates = cacheReadInt(fp);
+    ok = ok && syn->filetype && lx->dfa.nclasses > 0 && lx->dfa.nclasses <= 256 &&
+         lx->dfa.nstates > 1 && lx->dfa.nstates <= REGEX_MAX_DFA_STATES;
+    if (ok) {
+        int cells = lx->dfa.nstates * lx->dfa.nclasses;
+        lx->dfa.next = malloc(sizeof(unsigned short) * cells);
+        lx->dfa.accept = malloc(lx->dfa.nstates);
+        ok = fread(lx->dfa.next, sizeof(unsigned short), cells, fp) == (size_t)cells &&
+             fread(lx->dfa.accept, 1, lx->dfa.nstates, fp) == (size_t)lx->dfa.nstates;
+        lx->nrules = cacheReadInt(fp);
+        ok = ok && lx->nrules > 0 && lx->nrules <= SYNTAX_MAX_RULES;
+    }
+    if (ok) {
+        lx->rules = malloc(sizeof(LexRule) * lx->nrules);
+        ok = fread(lx->rules, sizeof(LexRule), lx->nrules, fp) == (size_t)lx->nrules;
     }
+    fclose(fp);
     
-    macro.playing = 1;
-    editorSetStatusMessage("Playing macro...");
+    /* The lexer indexes the tables with what they hold, so check all of
+       it. A truncated or corrupt cache is simply recompiled. */
+    for (int c = 0; ok && c < 256; c++) ok = lx->dfa.classes[c] < lx->dfa.nclasses;
+    for (int i = 0; ok && i < lx->dfa.nstates * lx->dfa.nclasses; i++)
+        ok = lx->dfa.next[i] < lx->dfa.nstates;
+    for (int i = 0; ok && i < lx->dfa.nstates; i++) ok = lx->dfa.accept[i] <= lx->nrules;
+    for (int r = 0; ok && r < lx->nrules; r++) {
+        LexRule *rule = &lx->rules[r];
+        ok = rule->action <= LEX_STRING && rule->color < COLOR_COUNT &&
+             (rule->action != LEX_BLOCK_COMMENT ||
+              (syn->multiline_comment_end && syn->multiline_comment_end[0]));
+    }
+    if (!ok) {
+        syntaxFree(syn);
+        return NULL;
+    }
+    syn->keyword_table = keywordTableBuild(syn->keywords);
+    return syn;
+}
+
+/* Load a definition, from its cache when that is current. Returns 0 on
+   success, -1 if the file can't be read, -2 on a syntax error. */
+int syntaxLoadFile(const char *path) {
+    char cache[MAX_PATH_LENGTH];
+    int cached = syntaxCachePath(path, cache, sizeof(cache)) == 0;
+    SyntaxStamp stamp = syntaxFileStamp(path);
+    Syntax *syn = cached ? syntaxReadCache(cache, NULL, stamp) : NULL;
+    
+    if (!syn) {
+        FILE *fp = fopen(path, "rb");
+        if (!fp) return -1;
+        fseek(fp, 0, SEEK_END);
+        long len = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        char *src = malloc(len + 1);
+        len = fread(src, 1, len, fp);
+        src[len] = '\0';
+        fclose(fp);
+        
+        /* A touched but unchanged source still matches by hash */
+        unsigned int hash = hashBytes(src, len, 0);
+        if (cached) syn = syntaxReadCache(cache, &hash, stamp);
+        if (!syn) {
+            int lineno;
+            const char *error;
+            syn = syntaxCompile(src, &lineno, &error);
+            if (!syn) {
+                editorSetStatusMessage("Syntax error: %s line %d: %s", path, lineno, error);
+                free(src);
+                return -2;
+            }
+        }
+        if (cached) syntaxWriteCache(cache, hash, stamp, syn);
+        free(src);
+    }
     
-    /* Playback will be handled in main loop */
+    /* A newer definition of the same language replaces the old one */
+    int i;
+    for (i = 0; i < syntax_file_count; i++)
+        if (!strcmp(syntax_files[i]->filetype, syn->filetype)) break;
+    if (i == syntax_file_count) {
+        syntax_files = realloc(syntax_files, sizeof(Syntax *) * (syntax_file_count + 1));
+        syntax_file_count++;
+    }
+    syntax_files[i] = syn;
+    return 0;
 }
 
-/*** Multi-cursor System ***/
-
-#define MAX_CURSORS 256
-
-typedef struct Cursor {
-    int cx;
-    int cy;
-    int active;
-} Cursor;
+void syntaxLoadDirectory(const char *path) {
+    char full[MAX_PATH_LENGTH];
+    
+#ifdef EDE_WINDOWS
+    WIN32_FIND_DATA find_data;
+    char search_path[MAX_PATH_LENGTH];
+    snprintf(search_path, sizeof(search_path), "%s\\*.esyn", path);
+    
+    HANDLE hFind = FindFirstFile(search_path, &find_data);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    
+    do {
+        snprintf(full, sizeof(full), "%s\\%s", path, find_data.cFileName);
+        syntaxLoadFile(full);
+    } while (FindNextFile(hFind, &find_data));
+    
+    FindClose(hFind);
+#else
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *ext = strrchr(entry->d_name, '.');
+        if (!ext || strcmp(ext, ".esyn") != 0) continue;
+        snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+        syntaxLoadFile(full);
+    }
+    
+    closedir(dir);
+#endif
+}
 
-typedef struct MultiCursor {
-    Cursor cursors[MAX_CURSORS];
-    int count;
-    int enabled;
-} MultiCursor;
+void syntaxLoadUserFiles(void) {
+    if (getenv("HOME")) {
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/.ede_syntax", getenv("HOME"));
+        syntaxLoadDirectory(path);
+    }
+}
 
-MultiCursor multi_cursor = {0};
+int syntaxMatchesFile(Syntax *s, const char *filename) {
+    char *ext = strrchr(filename, '.');
+    for (int i = 0; s->filematch[i]; i++) {
+        int is_ext = (s->filematch[i][0] == '.');
+        if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+            (!is_ext && strstr(filename, s->filematch[i])))
+            return 1;
+    }
+    return 0;
+}
 
-void multiCursorAdd(int cx, int cy) {
-    if (multi_cursor.count >= MAX_CURSORS) return;
+void editorSelectSyntaxHighlight(void) {
+    E.syntax = NULL;
+    editorSyntaxInvalidateAll();
+    if (E.filename == NULL) return;
     
-    /* Check for duplicates */
-    for (int i = 0; i < multi_cursor.count; i++) {
-        if (multi_cursor.cursors[i].cx == cx && multi_cursor.cursors[i].cy == cy) {
+    /* Syntax files take precedence over the built-in definitions */
+    for (int j = 0; j < syntax_file_count; j++) {
+        if (syntaxMatchesFile(syntax_files[j], E.filename)) {
+            E.syntax = syntax_files[j];
             return;
         }
     }
     
-    multi_cursor.cursors[multi_cursor.count].cx = cx;
-    multi_cursor.cursors[multi_cursor.count].cy = cy;
-    multi_cursor.cursors[multi_cursor.count].active = 1;
-    multi_cursor.count++;
-    multi_cursor.enabled = 1;
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        Syntax *s = &HLDB[j];
+        if (syntaxMatchesFile(s, E.filename)) {
+            E.syntax = s;
+            if (s->keyword_table == NULL) s->keyword_table = keywordTableBuild(s->keywords);
+            return;
+        }
+    }
 }
 
-void multiCursorClear(void) {
-    multi_cursor.count = 0;
-    multi_cursor.enabled = 0;
-}
+/*** Row operations ***/
 
-void multiCursorInsertChar(int c) {
-    if (!multi_cursor.enabled) {
-        editorInsertChar(c);
-        return;
-    }
-    
-    for (int i = 0; i < multi_cursor.count; i++) {
-        if (!multi_cursor.cursors[i].active) continue;
-        
-        int saved_cx = E.cx;
-        int saved_cy = E.cy;
-        
-        E.cx = multi_cursor.cursors[i].cx;
-        E.cy = multi_cursor.cursors[i].cy;
-        
-        editorInsertChar(c);
-        
-        multi_cursor.cursors[i].cx = E.cx;
-        multi_cursor.cursors[i].cy = E.cy;
-        
-        E.cx = saved_cx;
-        E.cy = saved_cy;
+int editorRowCxToRx(EditorRow *row, int cx) {
+    int rx = 0;
+    int j;
+    for (j = 0; j < cx; j++) {
+        if (row->chars[j] == '\t')
+            rx += (EDE_TAB_SIZE - 1) - (rx % EDE_TAB_SIZE);
+        rx++;
     }
+    return rx;
 }
 
-/*** Split View System ***/
-
-typedef struct Split {
-    int active;
-    int vertical;
+int editorRowRxToCx(EditorRow *row, int rx) {
+    int cur_rx = 0;
+    int cx;
+    for (cx = 0; cx < row->size; cx++) {
+        if (row->chars[cx] == '\t')
+            cur_rx += (EDE_TAB_SIZE - 1) - (cur_rx % EDE_TAB_SIZE);
+        cur_rx++;
+        
+        if (cur_rx > rx) return cx;
+    }
+    return cx;
+}
+
+unsigned int row_version_clock = 0;
+
+void editorUpdateRow(EditorRow *row) {
+    int tabs = 0;
+    int j;
+    
+    searchFinish();
+    for (j = 0; j < row->size; j++)
+        if (row->chars[j] == '\t') tabs++;
+    
+    free(row->render);
+    row->render = malloc(row->size + tabs * (EDE_TAB_SIZE - 1) + 1);
+    
+    int idx = 0;
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';
+            while (idx % EDE_TAB_SIZE != 0) row->render[idx++] = ' ';
+        } else {
+            row->render[idx++] = row->chars[j];
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    row->version = ++row_version_clock;
+    
+    editorUpdateSyntax(row);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
+    searchFinish();
+    
+    E.row = realloc(E.row, sizeof(EditorRow) * (E.numrows + 1));
+    memmove(&E.row[at + 1], &E.row[at], sizeof(EditorRow) * (E.numrows - at));
+    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+    bracketIndexInsertRow(at);
+    
+    E.row[at].idx = at;
+    
+    E.row[at].size = len;
+    E.row[at].chars = malloc(len + 1);
+    memcpy(E.row[at].chars, s, len);
+    E.row[at].chars[len] = '\0';
+    
+    E.row[at].rsize = 0;
+    E.row[at].render = NULL;
+    E.row[at].hl = NULL;
+    E.row[at].hl_entry = NULL;
+    E.row[at].brackets = NULL;
+    E.row[at].hl_open_comment = 0;
+    editorUpdateRow(&E.row[at]);
+    
+    E.numrows++;
+    E.dirty++;
+}
+
+void editorFreeRow(EditorRow *row) {
+    free(row->render);
+    free(row->chars);
+    hlCacheRelease(row->hl_entry);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) return;
+    searchFinish();
+    editorFreeRow(&E.row[at]);
+    memmove(&E.row[at], &E.row[at + 1], sizeof(EditorRow) * (E.numrows - at - 1));
+    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
+    E.numrows--;
+    E.dirty++;
+    
+    editorSyntaxInvalidate(at);
+    bracketIndexDeleteRow(at);
+}
+
+void editorRowInsertChar(EditorRow *row, int at, int c) {
+    if (at < 0 || at > row->size) at = row->size;
+    row->chars = realloc(row->chars, row->size + 2);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowAppendString(EditorRow *row, char *s, size_t len) {
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowDelChar(EditorRow *row, int at) {
+    if (at < 0 || at >= row->size) return;
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+/*** Editor operations ***/
+
+void editorInsertChar(int c) {
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    
+    char ch = c;
+    addUndoAction(ACTION_INSERT_CHAR, E.cy, E.cx, &ch, 1);
+    
+    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline(void) {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        EditorRow *row = &E.row[E.cy];
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        row = &E.row[E.cy];
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar(void) {
+    if (E.cy == E.numrows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+    
+    EditorRow *row = &E.row[E.cy];
+    if (E.cx > 0) {
+        char ch = row->chars[E.cx - 1];
+        addUndoAction(ACTION_DELETE_CHAR, E.cy, E.cx - 1, &ch, 1);
+        
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    } else {
+        E.cx = E.row[E.cy - 1].size;
+        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+/*** File I/O ***/
+
+char *editorRowsToString(int *buflen) {
+    int totlen = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++)
+        totlen += E.row[j].size + 1;
+    *buflen = totlen;
+    
+    char *buf = malloc(totlen);
+    char *p = buf;
+    for (j = 0; j < E.numrows; j++) {
+        memcpy(p, E.row[j].chars, E.row[j].size);
+        p += E.row[j].size;
+        *p = '\n';
+        p++;
+    }
+    
+    return buf;
+}
+
+/* Bare metal getline implementation */
+ssize_t bare_getline(char **lineptr, size_t *n, FILE *stream) {
+    if (lineptr == NULL || n == NULL || stream == NULL) {
+        return -1;
+    }
+    
+    if (*lineptr == NULL || *n == 0) {
+        *n = 128;
+        *lineptr = malloc(*n);
+        if (*lineptr == NULL) return -1;
+    }
+    
+    size_t pos = 0;
+    int c;
+    
+    while ((c = fgetc(stream)) != EOF) {
+        if (pos + 1 >= *n) {
+            size_t new_size = *n * 2;
+            char *new_ptr = realloc(*lineptr, new_size);
+            if (new_ptr == NULL) return -1;
+            *lineptr = new_ptr;
+            *n = new_size;
+        }
+        
+        (*lineptr)[pos++] = (char)c;
+        
+        if (c == '\n') break;
+    }
+    
+    if (pos == 0 && c == EOF) {
+        return -1;
+    }
+    
+    (*lineptr)[pos] = '\0';
+    return (ssize_t)pos;
+}
+
+void editorOpen(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    
+    editorSelectSyntaxHighlight();
+    
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        /* New file */
+        return;
+    }
+    
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    
+    while ((linelen = bare_getline(&line, &linecap, fp)) != -1) {
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                               line[linelen - 1] == '\r'))
+            linelen--;
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+}
+
+int editorSave(void) {
+    if (E.filename == NULL) {
+        return -1;
+    }
+    
+    int len;
+    char *buf = editorRowsToString(&len);
+    
+    FILE *fp = fopen(E.filename, "w");
+    if (fp == NULL) {
+        free(buf);
+        return -1;
+    }
+    
+    if (fwrite(buf, 1, len, fp) != (size_t)len) {
+        fclose(fp);
+        free(buf);
+        return -1;
+    }
+    
+    fclose(fp);
+    free(buf);
+    E.dirty = 0;
+    return 0;
+}
+
+/*** Search and Replace System ***/
+
+void freeSearchMatches(void) {
+    free(search_ctx.matches);
+    search_ctx.matches = NULL;
+    search_ctx.match_count = 0;
+    search_ctx.match_cap = 0;
+    search_ctx.current_match = -1;
+}
+
+/* Searches run over blocks of rows on a pool of worker threads. The
+   block holding the cursor is handed out first, so the next match is
+   usually known long before the total. Workers read row renders while
+   the main thread keeps going; anything that rewrites a render calls
+   searchFinish first, which keeps the rows a snapshot for the search. */
+
+#define EDE_SEARCH_BLOCK_ROWS 16384
+
+typedef struct SearchBlock {
+    int from;
+    int to;
+    SearchMatch *matches;
+    int count;
+    int cap;
+    int done;              /* set by the worker once matches are final */
+} SearchBlock;
+
+typedef struct SearchJob {
+    char pattern[256];
+    int ignore_case;
+    int use_regex;
+    int whole_word;
+    SearchBlock *blocks;
+    int nblocks;
+    int first;             /* block holding the cursor, handed out first */
+    int next;              /* blocks handed out so far */
+    int pending;           /* blocks not yet done */
+    EdeThread threads[EDE_MAX_THREADS];
+    int nthreads;
+    int running;           /* until searchFinish merges the blocks */
+} SearchJob;
+
+SearchJob search_job = {0};
+
+/* What a search looks for: a literal, or a regex with use_regex. A regex
+   fills in its DFA as it runs, so each thread compiles its own. */
+typedef struct SearchPattern {
+    Searcher searcher;
+    Regex regex;
+    int use_regex;
+} SearchPattern;
+
+/* Returns NULL, or why the pattern does not compile */
+const char *searchPatternInit(SearchPattern *sp, const char *pattern, int ignore_case, int use_regex) {
+    sp->use_regex = use_regex;
+    if (use_regex) return regexCompile(&sp->regex, pattern, ignore_case);
+    searcherInit(&sp->searcher, pattern, strlen(pattern), ignore_case);
+    return NULL;
+}
+
+void searchPatternFree(SearchPattern *sp) {
+    if (sp->use_regex) regexFree(&sp->regex);
+    else searcherFree(&sp->searcher);
+}
+
+/* Start of the first match in text[from..n) and its length in *len, or -1 */
+int searchPatternFind(SearchPattern *sp, const char *text, int from, int n, int *len) {
+    if (sp->use_regex) return regexFind(&sp->regex, text, from, n, len);
+    *len = sp->searcher.len;
+    return searcherFind(&sp->searcher, text, from, n);
+}
+
+void searchBlockAppend(SearchBlock *b, int row, int col, int length) {
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 64;
+        SearchMatch *grown = realloc(b->matches, sizeof(SearchMatch) * cap);
+        if (!grown) return;
+        b->matches = grown;
+        b->cap = cap;
+    }
+    SearchMatch *match = &b->matches[b->count++];
+    match->row = row;
+    match->col = col;
+    match->length = length;
+}
+
+/* Whether line[col..col+m) is not part of a longer identifier */
+int searchWholeWord(const char *line, int len, int col, int m) {
+    int before_ok = (col == 0) || !charIs(line[col - 1], CHAR_IDENT);
+    int after_ok = (col + m >= len) || !charIs(line[col + m], CHAR_IDENT);
+    return before_ok && after_ok;
+}
+
+/* Rows are scanned top to bottom and columns left to right, so each
+   block's matches come out sorted without a separate pass */
+void searchScanBlock(SearchJob *job, SearchPattern *sp, SearchBlock *b) {
+    int m;
+    for (int row = b->from; row < b->to; row++) {
+        EditorRow *erow = &E.row[row];
+        char *line = erow->render;
+        int len = erow->rsize;
+        int col = 0;
+        
+        while ((col = searchPatternFind(sp, line, col, len, &m)) >= 0) {
+            /* Check whole word if needed */
+            if (job->whole_word && !searchWholeWord(line, len, col, m)) {
+                col++;
+                continue;
+            }
+            
+            searchBlockAppend(b, row, col, m);
+            col += m;
+        }
+    }
+}
+
+void *searchWorker(void *arg) {
+    SearchJob *job = arg;
+    SearchPattern sp;
+    int ok = searchPatternInit(&sp, job->pattern, job->ignore_case, job->use_regex) == NULL;
+    int k;
+    while ((k = atomicAdd(&job->next, 1) - 1) < job->nblocks) {
+        SearchBlock *b = &job->blocks[(job->first + k) % job->nblocks];
+        if (ok) searchScanBlock(job, &sp, b);
+        atomicStore(&b->done, 1);
+        atomicAdd(&job->pending, -1);
+    }
+    if (ok) searchPatternFree(&sp);
+    return NULL;
+}
+
+/* Index of the first match at or after (row, col), or count */
+int searchMatchLowerBound(SearchMatch *matches, int count, int row, int col) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        SearchMatch *m = &matches[mid];
+        if (m->row < row || (m->row == row && m->col < col)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* The cursor column in render coordinates, for comparing against matches */
+int searchCursorRx(void) {
+    if (E.cy < 0 || E.cy >= E.numrows) return 0;
+    return editorRowCxToRx(&E.row[E.cy], E.cx);
+}
+
+/* Wait for the workers and merge their blocks into search_ctx */
+void searchFinish(void) {
+    SearchJob *job = &search_job;
+    if (!job->running) return;
+    
+    for (int i = 0; i < job->nthreads; i++) threadJoin(&job->threads[i]);
+    
+    /* Blocks are in row order, so concatenating them keeps the order */
+    int total = 0;
+    for (int b = 0; b < job->nblocks; b++) total += job->blocks[b].count;
+    search_ctx.matches = total ? malloc(sizeof(SearchMatch) * total) : NULL;
+    search_ctx.match_count = 0;
+    for (int b = 0; b < job->nblocks; b++) {
+        SearchBlock *block = &job->blocks[b];
+        if (search_ctx.matches) {
+            memcpy(&search_ctx.matches[search_ctx.match_count], block->matches,
+                   sizeof(SearchMatch) * block->count);
+            search_ctx.match_count += block->count;
+        }
+        free(block->matches);
+    }
+    search_ctx.match_cap = search_ctx.match_count;
+    
+    int current = searchMatchLowerBound(search_ctx.matches, search_ctx.match_count,
+                                        E.cy, searchCursorRx());
+    if (current == search_ctx.match_count) current = 0;
+    search_ctx.current_match = search_ctx.match_count ? current : -1;
+    
+    free(job->blocks);
+    job->blocks = NULL;
+    job->running = 0;
+}
+
+/* Start searching for search_ctx.query in the background. Returns NULL,
+   or why the pattern does not compile. */
+const char *searchBegin(void) {
+    SearchJob *job = &search_job;
+    searchFinish();
+    freeSearchMatches();
+    
+    if (search_ctx.query_len == 0) return NULL;
+    
+    SearchPattern sp;
+    const char *error = searchPatternInit(&sp, search_ctx.query, !search_ctx.case_sensitive,
+                                          search_ctx.use_regex);
+    if (error) return error;
+    searchPatternFree(&sp);
+    
+    memcpy(job->pattern, search_ctx.query, sizeof(job->pattern));
+    job->pattern[sizeof(job->pattern) - 1] = '\0';
+    job->ignore_case = !search_ctx.case_sensitive;
+    job->use_regex = search_ctx.use_regex;
+    job->whole_word = search_ctx.whole_word;
+    job->nblocks = (E.numrows + EDE_SEARCH_BLOCK_ROWS - 1) / EDE_SEARCH_BLOCK_ROWS;
+    if (job->nblocks == 0) job->nblocks = 1;
+    job->blocks = calloc(job->nblocks, sizeof(SearchBlock));
+    for (int b = 0; b < job->nblocks; b++) {
+        job->blocks[b].from = b * EDE_SEARCH_BLOCK_ROWS;
+        job->blocks[b].to = b + 1 < job->nblocks ? (b + 1) * EDE_SEARCH_BLOCK_ROWS : E.numrows;
+    }
+    job->first = E.cy / EDE_SEARCH_BLOCK_ROWS;
+    if (job->first >= job->nblocks) job->first = job->nblocks - 1;
+    job->next = 0;
+    job->pending = job->nblocks;
+    job->running = 1;
+    
+    int want = threadCount();
+    if (want > job->nblocks) want = job->nblocks;
+    job->nthreads = 0;
+    if (want > 1) {
+        for (int i = 0; i < want; i++) {
+            if (threadStart(&job->threads[job->nthreads], searchWorker, job) == 0) job->nthreads++;
+        }
+    }
+    /* One block, one CPU or no threads: search right here */
+    if (job->nthreads == 0) searchWorker(job);
+    return NULL;
+}
+
+void findAllMatches(void) {
+    searchBegin();
+    searchFinish();
+}
+
+/* Merge a background search once every block is done. Called while idle;
+   returns 1 if the status line changed. */
+int searchIdle(void) {
+    if (!search_job.running || atomicLoad(&search_job.pending) > 0) return 0;
+    searchFinish();
+    editorSetStatusMessage("Found %d match%s for '%s'", search_ctx.match_count,
+        search_ctx.match_count == 1 ? "" : "es", search_ctx.query);
+    return 1;
+}
+
+void searchMoveTo(SearchMatch *match) {
+    E.cy = match->row;
+    E.cx = editorRowRxToCx(&E.row[match->row], match->col);
+    E.rowoff = match->row;
+}
+
+/* While the search is still running, walk its blocks outward from the
+   cursor's in the direction of travel, waiting on each only until it is
+   done */
+int searchGotoRunning(int row, int col, int direction) {
+    SearchJob *job = &search_job;
+    int n = job->nblocks;
+    int c = row / EDE_SEARCH_BLOCK_ROWS;
+    if (c >= n) c = n - 1;
+    
+    /* k == n comes back to the cursor's block to wrap around */
+    for (int k = 0; k <= n; k++) {
+        SearchBlock *b = &job->blocks[((c + direction * k) % n + n) % n];
+        while (!atomicLoad(&b->done)) threadYield();
+        
+        int i;
+        if (k == 0) {
+            i = searchMatchLowerBound(b->matches, b->count, row, col);
+            if (direction < 0) i--;
+        } else {
+            i = direction > 0 ? 0 : b->count - 1;
+        }
+        if (i >= 0 && i < b->count) {
+            searchMoveTo(&b->matches[i]);
+            editorSetStatusMessage("Match on line %d, still counting", b->matches[i].row + 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Go to the first match at or after (row, col), or the last one before
+   it when direction is negative, wrapping at either end. Returns 0 if
+   there are no matches. */
+int searchGoto(int row, int col, int direction) {
+    if (search_job.running) return searchGotoRunning(row, col, direction);
+    if (search_ctx.match_count == 0) return 0;
+    
+    int index = searchMatchLowerBound(search_ctx.matches, search_ctx.match_count, row, col);
+    if (direction < 0) index--;
+    if (index < 0) index = search_ctx.match_count - 1;
+    if (index >= search_ctx.match_count) index = 0;
+    
+    search_ctx.current_match = index;
+    searchMoveTo(&search_ctx.matches[index]);
+    editorSetStatusMessage("Match %d of %d", index + 1, search_ctx.match_count);
+    return 1;
+}
+
+int gotoNextMatch(void) {
+    return searchGoto(E.cy, searchCursorRx() + 1, 1);
+}
+
+int gotoPrevMatch(void) {
+    return searchGoto(E.cy, searchCursorRx(), -1);
+}
+
+/* Returns the render column where the replaced text started */
+int replaceMatch(SearchMatch *match) {
+    EditorRow *row = &E.row[match->row];
+    
+    /* Delete matched text. Matches are in render columns: a tab the match
+       reaches into is deleted whole. */
+    int cx_pos = editorRowRxToCx(row, match->col);
+    int cx_end = match->length > 0 ?
+        editorRowRxToCx(row, match->col + match->length - 1) + 1 : cx_pos;
+    if (cx_end > row->size) cx_end = row->size;
+    int rx = editorRowCxToRx(row, cx_pos);
+    for (int i = cx_pos; i < cx_end; i++) editorRowDelChar(row, cx_pos);
+    
+    /* Insert replacement text */
+    for (int i = 0; i < search_ctx.replace_len; i++) {
+        editorRowInsertChar(row, cx_pos + i, search_ctx.replace_text[i]);
+    }
+    return rx;
+}
+
+void replaceCurrentMatch(void) {
+    searchFinish();
+    if (search_ctx.current_match < 0) return;
+    
+    replaceMatch(&search_ctx.matches[search_ctx.current_match]);
+    
+    /* Re-find matches after replacement */
+    findAllMatches();
+}
+
+/* Walk the matches back to front: an edit only shifts text after it, so
+   the positions still to be replaced stay valid and the search runs once */
+void replaceAllMatches(void) {
+    searchFinish();
+    int replaced = 0;
+    int row = -1, rx = 0;
+    
+    for (int i = search_ctx.match_count - 1; i >= 0; i--) {
+        SearchMatch *m = &search_ctx.matches[i];
+        /* Several matches can fall in one tab: the first replaced takes it */
+        if (m->row == row && m->col + m->length > rx) continue;
+        row = m->row;
+        rx = replaceMatch(m);
+        replaced++;
+    }
+    findAllMatches();
+    
+    editorSetStatusMessage("Replaced %d occurrence%s", replaced, replaced == 1 ? "" : "s");
+}
+
+/* Search as you type. Every prefix of the query keeps its candidates:
+   all occurrences, overlapping, in row order. Adding a character only
+   has to check one more byte at each candidate of the prefix before it,
+   and deleting one goes back to the shorter prefix's candidates. Rows
+   are scanned in chunks that give up as soon as another key is waiting;
+   the next keystroke picks the scan up where it stopped. Regex queries
+   do not narrow this way and are rescanned on every change. */
+
+#define EDE_INC_MAX_CANDIDATES (1 << 20)
+#define EDE_INC_CHUNK_ROWS 1024
+
+typedef struct IncLevel {
+    SearchMatch *matches;
+    int count;
+    int cap;
+    int scanned;           /* rows [0, scanned) are covered */
+    int overflow;          /* more than EDE_INC_MAX_CANDIDATES, not all kept */
+} IncLevel;
+
+typedef struct IncSearch {
+    IncLevel *levels;      /* levels[k] holds candidates for query[0..k] */
+    int depth;
+    int cap;
+    char *query;
+    int use_regex;
+    int origin_row;        /* cursor when the prompt opened */
+    int origin_col;
+    int current;           /* candidate the cursor is on, -1 if none */
+    int active;
+    int ignore_case;       /* what the levels were found with */
+    int case_toggled;      /* Ctrl-T in the prompt overrides the options */
+    int toggled_ignore;
+    int whole_word;        /* Ctrl-W, filters candidates without rescanning */
+} IncSearch;
+
+IncSearch inc_search = {0};
+
+/* Shown after the prompt text, set by the prompt's callback */
+char prompt_info[64];
+
+void incSearchTruncate(int depth) {
+    while (inc_search.depth > depth) free(inc_search.levels[--inc_search.depth].matches);
+}
+
+void incSearchReset(void) {
+    incSearchTruncate(0);
+    free(inc_search.levels);
+    free(inc_search.query);
+    memset(&inc_search, 0, sizeof(inc_search));
+}
+
+void incLevelAdd(IncLevel *level, int row, int col, int length) {
+    if (level->overflow) return;
+    if (level->count == EDE_INC_MAX_CANDIDATES) {
+        level->overflow = 1;
+        return;
+    }
+    if (level->count == level->cap) {
+        level->cap = level->cap ? level->cap * 2 : 64;
+        level->matches = realloc(level->matches, sizeof(SearchMatch) * level->cap);
+    }
+    SearchMatch *m = &level->matches[level->count++];
+    m->row = row;
+    m->col = col;
+    m->length = length;
+}
+
+/* A new level one character longer than the top one: its candidates are
+   the top's that the new character continues, over the rows the top has
+   covered so far */
+void incSearchPush(const char *query) {
+    IncSearch *inc = &inc_search;
+    if (inc->depth == inc->cap) {
+        inc->cap = inc->cap ? inc->cap * 2 : 16;
+        inc->levels = realloc(inc->levels, sizeof(IncLevel) * inc->cap);
+    }
+    IncLevel *level = &inc->levels[inc->depth];
+    memset(level, 0, sizeof(IncLevel));
+    
+    if (inc->depth > 0 && !inc->use_regex && !inc->levels[inc->depth - 1].overflow) {
+        IncLevel *prev = &inc->levels[inc->depth - 1];
+        int k = inc->depth;
+        unsigned char want = inc->ignore_case ? char_fold[(unsigned char)query[k]] : query[k];
+        for (int i = 0; i < prev->count; i++) {
+            SearchMatch *m = &prev->matches[i];
+            EditorRow *row = &E.row[m->row];
+            if (m->col + k >= row->rsize) continue;
+            unsigned char c = row->render[m->col + k];
+            if ((inc->ignore_case ? char_fold[c] : c) == want)
+                incLevelAdd(level, m->row, m->col, k + 1);
+        }
+        level->scanned = prev->scanned;
+    }
+    inc->depth++;
+}
+
+/* Scan the top level's remaining rows. Returns 0 if a key arrived first. */
+int incSearchScan(const char *query) {
+    IncSearch *inc = &inc_search;
+    IncLevel *level = &inc->levels[inc->depth - 1];
+    if (level->scanned >= E.numrows) return 1;
+    
+    SearchPattern sp;
+    if (searchPatternInit(&sp, query, inc->ignore_case, inc->use_regex)) {
+        /* A regex is often incomplete while it is being typed */
+        level->scanned = E.numrows;
+        return 1;
+    }
+    
+    /* At least one chunk goes through per key, so typing ahead still
+       shows the nearest matches */
+    int completed = 1;
+    while (level->scanned < E.numrows) {
+        int to = level->scanned + EDE_INC_CHUNK_ROWS;
+        if (to > E.numrows) to = E.numrows;
+        for (int r = level->scanned; r < to; r++) {
+            EditorRow *row = &E.row[r];
+            int col = 0, len;
+            /* Literals keep overlapping occurrences, which a longer query
+               may still extend */
+            while ((col = searchPatternFind(&sp, row->render, col, row->rsize, &len)) >= 0) {
+                incLevelAdd(level, r, col, len);
+                col += inc->use_regex ? len : 1;
+            }
+        }
+        level->scanned = to;
+        if (level->scanned < E.numrows && editorInputPending()) {
+            completed = 0;
+            break;
+        }
+    }
+    searchPatternFree(&sp);
+    return completed;
+}
+
+/* Whole words are checked when candidates are used, so toggling it
+   keeps the levels */
+int incCandidateOk(SearchMatch *m) {
+    if (!inc_search.whole_word) return 1;
+    EditorRow *row = &E.row[m->row];
+    return searchWholeWord(row->render, row->rsize, m->col, m->length);
+}
+
+/* Candidates that do not overlap the one before, which is what a full
+   search reports */
+int incSearchCount(IncLevel *level) {
+    int count = 0, row = -1, end = 0;
+    for (int i = 0; i < level->count; i++) {
+        SearchMatch *m = &level->matches[i];
+        if (!incCandidateOk(m)) continue;
+        if (m->row != row || m->col >= end) {
+            count++;
+            row = m->row;
+            end = m->col + m->length;
+        }
+    }
+    return count;
+}
+
+void incSearchShowCount(void) {
+    IncLevel *level = &inc_search.levels[inc_search.depth - 1];
+    int count = incSearchCount(level);
+    int len;
+    if (level->overflow) {
+        len = snprintf(prompt_info, sizeof(prompt_info), "over %d matches", count);
+    } else if (level->scanned < E.numrows) {
+        len = snprintf(prompt_info, sizeof(prompt_info), "%d+ matches", count);
+    } else {
+        len = snprintf(prompt_info, sizeof(prompt_info), "%d match%s", count, count == 1 ? "" : "es");
+    }
+    if (inc_search.ignore_case)
+        len += snprintf(prompt_info + len, sizeof(prompt_info) - len, ", ignore case");
+    if (inc_search.whole_word)
+        snprintf(prompt_info + len, sizeof(prompt_info) - len, ", whole word");
+}
+
+/* Move to the first usable candidate from index on, going by step */
+void incSearchMoveTo(int index, int step) {
+    IncLevel *level = &inc_search.levels[inc_search.depth - 1];
+    int tries;
+    for (tries = 0; tries < level->count; tries++, index += step) {
+        if (index < 0) index = level->count - 1;
+        if (index >= level->count) index = 0;
+        if (incCandidateOk(&level->matches[index])) break;
+    }
+    if (tries == level->count) {
+        inc_search.current = -1;
+        E.cy = inc_search.origin_row;
+        E.cx = editorRowRxToCx(&E.row[E.cy], inc_search.origin_col);
+        return;
+    }
+    inc_search.current = index;
+    SearchMatch *m = &level->matches[index];
+    E.cy = m->row;
+    E.cx = editorRowRxToCx(&E.row[m->row], m->col);
+    E.rowoff = E.numrows;
+}
+
+/* Whether the query typed so far is searched ignoring case */
+int incSearchIgnoreCase(const char *query) {
+    if (inc_search.case_toggled) return inc_search.toggled_ignore;
+    return !searchCaseSensitive(query);
+}
+
+void editorFindCallback(char *query, int key) {
+    IncSearch *inc = &inc_search;
+    
+    /* editorFind takes the results over on Enter and resets */
+    if (key == '\r' || key == '\x1b') return;
+    
+    if (!inc->active) {
+        inc->active = 1;
+        inc->use_regex = search_ctx.use_regex;
+        inc->origin_row = E.cy < E.numrows ? E.cy : 0;
+        inc->origin_col = searchCursorRx();
+        inc->current = -1;
+    }
+    
+    if (key == CTRL_KEY('t')) {
+        inc->toggled_ignore = !incSearchIgnoreCase(query);
+        inc->case_toggled = 1;
+    } else if (key == CTRL_KEY('w')) {
+        inc->whole_word = !inc->whole_word;
+    }
+    if (E.numrows == 0) return;
+    
+    int len = strlen(query);
+    if (len == 0) {
+        incSearchTruncate(0);
+        prompt_info[0] = '\0';
+        return;
+    }
+    
+    if (key == KEY_ARROW_RIGHT || key == KEY_ARROW_DOWN ||
+        key == KEY_ARROW_LEFT || key == KEY_ARROW_UP) {
+        if (inc->depth == 0) return;
+        incSearchScan(query);
+        int step = (key == KEY_ARROW_RIGHT || key == KEY_ARROW_DOWN) ? 1 : -1;
+        if (inc->current >= 0) incSearchMoveTo(inc->current + step, step);
+        incSearchShowCount();
+        return;
+    }
+    
+    /* Candidates found matching case are no use ignoring it, and the
+       other way round */
+    int ignore_case = incSearchIgnoreCase(query);
+    if (ignore_case != inc->ignore_case) {
+        incSearchTruncate(0);
+        inc->ignore_case = ignore_case;
+    }
+    
+    /* Keep the levels the old and new query share */
+    int keep = 0;
+    if (inc->query) {
+        if (inc->use_regex) {
+            keep = strcmp(inc->query, query) == 0 ? inc->depth : 0;
+        } else {
+            while (keep < inc->depth && inc->query[keep] == query[keep]) keep++;
+        }
+    }
+    incSearchTruncate(keep);
+    free(inc->query);
+    inc->query = strdup(query);
+    
+    if (inc->use_regex) {
+        if (inc->depth == 0) incSearchPush(query);
+    } else {
+        while (inc->depth < len) incSearchPush(query);
+    }
+    
+    /* Only the top level is scanned further; shorter prefixes resume if
+       the query goes back to them */
+    incSearchScan(query);
+    
+    IncLevel *level = &inc->levels[inc->depth - 1];
+    incSearchMoveTo(searchMatchLowerBound(level->matches, level->count,
+                                          inc->origin_row, inc->origin_col), 1);
+    incSearchShowCount();
+}
+
+/* Hand the prompt's candidates to search_ctx as the non-overlapping
+   matches a full search would find. Returns 0 if they do not cover the
+   whole buffer for this query. */
+int incSearchAdopt(const char *query) {
+    IncSearch *inc = &inc_search;
+    if (!inc->query || strcmp(inc->query, query) != 0 || inc->depth == 0) return 0;
+    if (!inc->use_regex && inc->depth != (int)strlen(query)) return 0;
+    /* A regex candidate that fails the whole word test is not retried
+       one column on, as a full search does */
+    if (inc->use_regex && inc->whole_word) return 0;
+    IncLevel *level = &inc->levels[inc->depth - 1];
+    if (level->overflow || level->scanned < E.numrows) return 0;
+    
+    searchFinish();
+    freeSearchMatches();
+    int row = -1, end = 0;
+    for (int i = 0; i < level->count; i++) {
+        SearchMatch *m = &level->matches[i];
+        if (!incCandidateOk(m)) continue;
+        if (m->row != row || m->col >= end) {
+            if (search_ctx.match_count == search_ctx.match_cap) {
+                search_ctx.match_cap = search_ctx.match_cap ? search_ctx.match_cap * 2 : 64;
+                search_ctx.matches = realloc(search_ctx.matches, sizeof(SearchMatch) * search_ctx.match_cap);
+            }
+            search_ctx.matches[search_ctx.match_count++] = *m;
+            row = m->row;
+            end = m->col + m->length;
+        }
+    }
+    return 1;
+}
+
+/* Matches of the current search are drawn over the syntax colors. Only
+   rows on screen are looked at: each is searched on its own when it is
+   drawn, and its spans are kept until the row's text or the pattern
+   changes, so the overlay costs the same in any size of buffer. */
+
+#define EDE_OVERLAY_SLOTS 256
+
+typedef struct OverlayRow {
+    unsigned int version;  /* EditorRow version the spans belong to */
+    int generation;        /* pattern they were found with */
+    int *spans;            /* start, end pairs in render columns */
+    int count;
+    int cap;
+} OverlayRow;
+
+typedef struct MatchOverlay {
+    char pattern[256];
+    int ignore_case;
+    int use_regex;
+    int whole_word;
+    int active;            /* a pattern is set */
+    int valid;             /* and it compiled */
+    int generation;
+    SearchPattern sp;
+    OverlayRow rows[EDE_OVERLAY_SLOTS];  /* by file row modulo the size */
+} MatchOverlay;
+
+MatchOverlay overlay = {0};
+
+/* Pick the pattern to show for this frame: the query being typed, else
+   the last search while it has matches */
+void overlayPrepare(void) {
+    const char *pattern = NULL;
+    int ignore_case = 0, use_regex = 0, whole_word = 0;
+    
+    if (inc_search.active && inc_search.query && inc_search.query[0]) {
+        pattern = inc_search.query;
+        ignore_case = inc_search.ignore_case;
+        use_regex = inc_search.use_regex;
+        whole_word = inc_search.whole_word;
+    } else if (search_ctx.query_len > 0 && (search_ctx.match_count > 0 || search_job.running)) {
+        pattern = search_ctx.query;
+        ignore_case = !search_ctx.case_sensitive;
+        use_regex = search_ctx.use_regex;
+        whole_word = search_ctx.whole_word;
+    }
+    
+    if (pattern && overlay.active && strcmp(pattern, overlay.pattern) == 0 &&
+        ignore_case == overlay.ignore_case && use_regex == overlay.use_regex &&
+        whole_word == overlay.whole_word) return;
+    
+    if (overlay.valid) searchPatternFree(&overlay.sp);
+    overlay.active = overlay.valid = 0;
+    overlay.generation++;
+    if (!pattern) return;
+    
+    snprintf(overlay.pattern, sizeof(overlay.pattern), "%s", pattern);
+    overlay.ignore_case = ignore_case;
+    overlay.use_regex = use_regex;
+    overlay.whole_word = whole_word;
+    overlay.active = 1;
+    overlay.valid = searchPatternInit(&overlay.sp, overlay.pattern, ignore_case, use_regex) == NULL;
+}
+
+/* Match spans of a file row, or NULL if it has none */
+OverlayRow *overlayRow(int filerow) {
+    if (!overlay.valid) return NULL;
+    EditorRow *row = &E.row[filerow];
+    OverlayRow *o = &overlay.rows[filerow % EDE_OVERLAY_SLOTS];
+    
+    if (o->version != row->version || o->generation != overlay.generation) {
+        o->version = row->version;
+        o->generation = overlay.generation;
+        o->count = 0;
+        
+        int col = 0, m;
+        while ((col = searchPatternFind(&overlay.sp, row->render, col, row->rsize, &m)) >= 0) {
+            if (overlay.whole_word && !searchWholeWord(row->render, row->rsize, col, m)) {
+                col++;
+                continue;
+            }
+            if (o->count == o->cap) {
+                o->cap = o->cap ? o->cap * 2 : 8;
+                o->spans = realloc(o->spans, sizeof(int) * 2 * o->cap);
+            }
+            o->spans[2 * o->count] = col;
+            o->spans[2 * o->count + 1] = col + m;
+            o->count++;
+            col += m;
+        }
+    }
+    return o->count ? o : NULL;
+}
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+    size_t buflen = 0;
+    buf[0] = '\0';
+    prompt_info[0] = '\0';
+    
+    while (1) {
+        editorSetStatusMessage(prompt, buf);
+        if (prompt_info[0]) {
+            int len = strlen(E.statusmsg);
+            snprintf(E.statusmsg + len, sizeof(E.statusmsg) - len, " [%s]", prompt_info);
+        }
+        editorRefreshScreen();
+        
+        int c = editorReadKey();
+        if (c == KEY_DELETE || c == CTRL_KEY('h') || c == KEY_BACKSPACE) {
+            if (buflen != 0) buf[--buflen] = '\0';
+        } else if (c == '\x1b') {
+            editorSetStatusMessage("");
+            prompt_info[0] = '\0';
+            if (callback) callback(buf, c);
+            free(buf);
+            return NULL;
+        } else if (c == '\r') {
+            if (buflen != 0) {
+                editorSetStatusMessage("");
+                prompt_info[0] = '\0';
+                if (callback) callback(buf, c);
+                return buf;
+            }
+        } else if (!iscntrl(c) && c < 128) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+        
+        if (callback) callback(buf, c);
+    }
+}
+
+void editorFind(void) {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+    
+    char *query = editorPrompt("Search: %s (ESC to cancel, ^T case, ^W word)", editorFindCallback);
+    
+    if (query) {
+        strncpy(search_ctx.query, query, sizeof(search_ctx.query) - 1);
+        search_ctx.query_len = strlen(query);
+        search_ctx.case_sensitive = !incSearchIgnoreCase(query);
+        search_ctx.whole_word = inc_search.whole_word;
+        const char *error = incSearchAdopt(query) ? NULL : searchBegin();
+        incSearchReset();
+        
+        /* Stay on the match the prompt already moved to */
+        if (!error && searchGoto(E.cy, searchCursorRx(), 1)) {
+            if (!search_job.running) {
+                editorSetStatusMessage("Found %d match%s (n=next, N=prev)", 
+                    search_ctx.match_count, search_ctx.match_count == 1 ? "" : "es");
+            }
+        } else {
+            if (error) editorSetStatusMessage("Bad pattern: %s", error);
+            else editorSetStatusMessage("No matches found");
+            E.cx = saved_cx;
+            E.cy = saved_cy;
+            E.coloff = saved_coloff;
+            E.rowoff = saved_rowoff;
+        }
+        free(query);
+    } else {
+        incSearchReset();
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
+    }
+}
+
+void editorReplace(void) {
+    char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+    if (!query) return;
+    
+    strncpy(search_ctx.query, query, sizeof(search_ctx.query) - 1);
+    search_ctx.query_len = strlen(query);
+    free(query);
+    
+    char *replace = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (!replace) return;
+    
+    strncpy(search_ctx.replace_text, replace, sizeof(search_ctx.replace_text) - 1);
+    search_ctx.replace_len = strlen(replace);
+    free(replace);
+    
+    search_ctx.case_sensitive = searchCaseSensitive(search_ctx.query);
+    search_ctx.whole_word = 0;
+    findAllMatches();
+    
+    if (search_ctx.match_count == 0) {
+        editorSetStatusMessage("No matches found");
+        return;
+    }
+    
+    char *confirm = editorPrompt("Replace all %d matches? (y/n): %s", NULL);
+    if (confirm && (confirm[0] == 'y' || confirm[0] == 'Y')) {
+        replaceAllMatches();
+    }
+    if (confirm) free(confirm);
+}
+
+/*** Fuzzy line finder ***/
+
+/* Ctrl-O finds a line by a few of its characters. The query matches a
+   line if its characters appear there in order, and the match scores
+   more where they are consecutive, start a word or a camelCase hump, and
+   less across gaps, so "opnfl" ranks "open_file(" above "option fail".
+   Each query byte is located with a 16-byte compare of the text ORed
+   with the byte's case mask, as the substring search does; a pass back
+   from the end of that first fit gives the shortest window, which is
+   what gets scored. A query with no upper case letter ignores case.
+
+   As in search as you type, every query prefix keeps the lines it
+   matched. A longer query only rescores the lines of the prefix before
+   it, deleting a character goes back to the shorter prefix's lines, and
+   rows are scanned in chunks that stop when another key is waiting.
+   The best EDE_FINDER_ROWS lines are kept in a min-heap while scoring,
+   worst at the root, and drawn as a list above the prompt. */
+
+#define EDE_FINDER_ROWS 10
+#define EDE_FINDER_MAX_QUERY 64      /* longer queries use their start */
+#define EDE_FINDER_CHUNK_ROWS 4096
+
+#define FINDER_SCORE_MATCH 16
+#define FINDER_GAP_START -3
+#define FINDER_GAP_EXTENSION -1
+#define FINDER_BONUS_BOUNDARY 8      /* first character of a word */
+#define FINDER_BONUS_CAMEL 7         /* lower to upper case, or to a digit */
+#define FINDER_BONUS_CONSECUTIVE 4
+
+typedef struct FinderLevel {
+    int *rows;
+    int count;
+    int cap;
+    int scanned;           /* rows [0, scanned) are covered */
+} FinderLevel;
+
+typedef struct FinderHit {
+    int row;
+    int score;
+} FinderHit;
+
+typedef struct Finder {
+    FinderLevel *levels;   /* levels[k] holds the rows matching query[0..k] */
+    int depth;
+    int cap;
+    char query[EDE_FINDER_MAX_QUERY + 1];
+    unsigned char pat[EDE_FINDER_MAX_QUERY];   /* folded when ignoring case */
+    unsigned char mask[EDE_FINDER_MAX_QUERY];  /* 0x20 for letters when ignoring case */
+    int len;               /* query bytes finderScore matches */
+    int ignore_case;
+    FinderHit best[EDE_FINDER_ROWS];  /* heap while scoring, then best first */
+    int nbest;
+    int selected;          /* index into best */
+    int active;
+} Finder;
+
+Finder finder = {0};
+
+void finderTruncate(int depth) {
+    while (finder.depth > depth) free(finder.levels[--finder.depth].rows);
+}
+
+void finderReset(void) {
+    finderTruncate(0);
+    free(finder.levels);
+    memset(&finder, 0, sizeof(finder));
+}
+
+/* Match the first len bytes of the query */
+void finderSetLength(int len) {
+    finder.len = len;
+    for (int k = 0; k < len; k++) {
+        unsigned char c = finder.query[k];
+        finder.pat[k] = finder.ignore_case ? char_fold[c] : c;
+        finder.mask[k] = (finder.ignore_case && char_fold[c] != toupper(c)) ? 0x20 : 0;
+    }
+}
+
+/* First i in [from, n) with (t[i] | mask) == c, or -1 */
+int finderFindByte(const unsigned char *t, int from, int n, unsigned char c, unsigned char mask) {
+    int i = from;
+#if defined(EDE_SIMD_SSE2)
+    __m128i want = _mm_set1_epi8(c);
+    __m128i fold = _mm_set1_epi8(mask);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_or_si128(_mm_loadu_si128((const __m128i *)&t[i]), fold);
+        unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(x, want));
+        if (m) return i + charLowestBit(m);
+    }
+#elif defined(EDE_SIMD_NEON)
+    uint8x16_t want = vdupq_n_u8(c);
+    uint8x16_t fold = vdupq_n_u8(mask);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t x = vorrq_u8(vld1q_u8(&t[i]), fold);
+        unsigned int m = simdMovemask(vceqq_u8(x, want));
+        if (m) return i + charLowestBit(m);
+    }
+#endif
+    for (; i < n; i++)
+        if ((t[i] | mask) == c) return i;
+    return -1;
+}
+
+int finderBonus(const unsigned char *t, int i) {
+    if (!charIs(t[i], CHAR_IDENT)) return 0;
+    if (i == 0 || !charIs(t[i - 1], CHAR_IDENT)) return FINDER_BONUS_BOUNDARY;
+    if (islower(t[i - 1]) && isupper(t[i])) return FINDER_BONUS_CAMEL;
+    if (!charIs(t[i - 1], CHAR_DIGIT) && charIs(t[i], CHAR_DIGIT)) return FINDER_BONUS_CAMEL;
+    return 0;
+}
+
+/* Score a row against the query, or -1 if the query is not a
+   subsequence of it. pos, if given, gets the column of each query byte. */
+int finderScore(EditorRow *row, int *pos) {
+    Finder *f = &finder;
+    const unsigned char *t = (const unsigned char *)row->render;
+    int n = row->rsize;
+    int at = 0, k;
+    
+    /* The earliest fit of the whole query */
+    for (k = 0; k < f->len; k++) {
+        at = finderFindByte(t, at, n, f->pat[k], f->mask[k]);
+        if (at < 0) return -1;
+        at++;
+    }
+    
+    /* Back from its end to the latest start, which gives the shortest
+       window ending there */
+    int i = at - 1;
+    for (k = f->len - 1; k > 0; k--) {
+        i--;
+        while ((t[i] | f->mask[k - 1]) != f->pat[k - 1]) i--;
+    }
+    
+    int score = 0, prev = -1, chunk = 0;
+    for (k = 0; k < f->len; k++, i++) {
+        while ((t[i] | f->mask[k]) != f->pat[k]) i++;
+        int bonus = finderBonus(t, i);
+        if (k > 0 && i == prev + 1) {
+            /* A run keeps the bonus of where it started */
+            if (chunk > bonus) bonus = chunk;
+            if (bonus < FINDER_BONUS_CONSECUTIVE) bonus = FINDER_BONUS_CONSECUTIVE;
+        } else {
+            if (k > 0) score += FINDER_GAP_START + FINDER_GAP_EXTENSION * (i - prev - 2);
+            chunk = bonus;
+        }
+        score += FINDER_SCORE_MATCH + (k == 0 ? 2 * bonus : bonus);
+        if (pos) pos[k] = i;
+        prev = i;
+    }
+    return score;
+}
+
+/* Higher scores first, then shorter lines, then earlier ones */
+int finderBetter(const FinderHit *a, const FinderHit *b) {
+    if (a->score != b->score) return a->score > b->score;
+    int la = E.row[a->row].rsize, lb = E.row[b->row].rsize;
+    if (la != lb) return la < lb;
+    return a->row < b->row;
+}
+
+void finderHeapAdd(int row, int score) {
+    Finder *f = &finder;
+    FinderHit hit = {row, score};
+    int i;
+    
+    if (f->nbest < EDE_FINDER_ROWS) {
+        /* Sift up past better parents */
+        i = f->nbest++;
+        while (i > 0 && finderBetter(&f->best[(i - 1) / 2], &hit)) {
+            f->best[i] = f->best[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        f->best[i] = hit;
+        return;
+    }
+    if (!finderBetter(&hit, &f->best[0])) return;
+    
+    /* Replace the worst and sift down past worse children */
+    i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= f->nbest) break;
+        if (child + 1 < f->nbest && finderBetter(&f->best[child], &f->best[child + 1])) child++;
+        if (!finderBetter(&hit, &f->best[child])) break;
+        f->best[i] = f->best[child];
+        i = child;
+    }
+    f->best[i] = hit;
+}
+
+void finderLevelAdd(FinderLevel *level, int row) {
+    if (level->count == level->cap) {
+        level->cap = level->cap ? level->cap * 2 : 256;
+        level->rows = realloc(level->rows, sizeof(int) * level->cap);
+    }
+    level->rows[level->count++] = row;
+}
+
+/* A new level one byte longer than the top one, from the rows of the top
+   that still match. Only the level the query ends at feeds the heap. */
+void finderPush(int top) {
+    Finder *f = &finder;
+    if (f->depth == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 16;
+        f->levels = realloc(f->levels, sizeof(FinderLevel) * f->cap);
+    }
+    FinderLevel *level = &f->levels[f->depth];
+    memset(level, 0, sizeof(FinderLevel));
+    
+    finderSetLength(f->depth + 1);
+    if (f->depth > 0) {
+        FinderLevel *prev = &f->levels[f->depth - 1];
+        for (int i = 0; i < prev->count; i++) {
+            int score = finderScore(&E.row[prev->rows[i]], NULL);
+            if (score < 0) continue;
+            finderLevelAdd(level, prev->rows[i]);
+            if (top) finderHeapAdd(prev->rows[i], score);
+        }
+        level->scanned = prev->scanned;
+    }
+    f->depth++;
+}
+
+/* Score the top level's remaining rows. Unless wait is set, gives up
+   after a chunk if a key is waiting and returns 0. */
+int finderScan(int wait) {
+    FinderLevel *level = &finder.levels[finder.depth - 1];
+    while (level->scanned < E.numrows) {
+        int to = level->scanned + EDE_FINDER_CHUNK_ROWS;
+        if (to > E.numrows) to = E.numrows;
+        for (int r = level->scanned; r < to; r++) {
+            int score = finderScore(&E.row[r], NULL);
+            if (score < 0) continue;
+            finderLevelAdd(level, r);
+            finderHeapAdd(r, score);
+        }
+        level->scanned = to;
+        if (!wait && level->scanned < E.numrows && editorInputPending()) return 0;
+    }
+    return 1;
+}
+
+/* Heap order to best first, for drawing */
+void finderSortBest(void) {
+    Finder *f = &finder;
+    for (int i = 1; i < f->nbest; i++) {
+        FinderHit hit = f->best[i];
+        int j = i;
+        for (; j > 0 && finderBetter(&hit, &f->best[j - 1]); j--) f->best[j] = f->best[j - 1];
+        f->best[j] = hit;
+    }
+}
+
+/* Rescore for a changed query, keeping the levels the old one shares */
+void finderUpdate(const char *query) {
+    Finder *f = &finder;
+    int len = strlen(query);
+    if (len > EDE_FINDER_MAX_QUERY) len = EDE_FINDER_MAX_QUERY;
+    
+    int ignore_case = 1;
+    for (int k = 0; k < len; k++) if (isupper((unsigned char)query[k])) ignore_case = 0;
+    if (ignore_case != f->ignore_case) finderTruncate(0);
+    f->ignore_case = ignore_case;
+    
+    int keep = 0;
+    while (keep < f->depth && keep < len && f->query[keep] == query[keep]) keep++;
+    finderTruncate(keep);
+    memcpy(f->query, query, len);
+    f->query[len] = '\0';
+    f->nbest = 0;
+    f->selected = 0;
+    if (len == 0) return;
+    
+    if (f->depth == len) {
+        FinderLevel *level = &f->levels[f->depth - 1];
+        finderSetLength(len);
+        for (int i = 0; i < level->count; i++)
+            finderHeapAdd(level->rows[i], finderScore(&E.row[level->rows[i]], NULL));
+    }
+    while (f->depth < len) finderPush(f->depth + 1 == len);
+    finderScan(0);
+    finderSortBest();
+}
+
+void finderShowCount(void) {
+    FinderLevel *level = &finder.levels[finder.depth - 1];
+    snprintf(prompt_info, sizeof(prompt_info), "%d%s of %d lines", level->count,
+        level->scanned < E.numrows ? "+" : "", E.numrows);
+}
+
+/* Go on with a scan that a key interrupted, keeping the selected line
+   selected if it stays in the list */
+void finderResume(int wait) {
+    Finder *f = &finder;
+    int row = f->nbest ? f->best[f->selected].row : -1;
+    
+    /* Best first reversed is a heap again, worst at the root */
+    for (int i = 0, j = f->nbest - 1; i < j; i++, j--) {
+        FinderHit hit = f->best[i];
+        f->best[i] = f->best[j];
+        f->best[j] = hit;
+    }
+    finderScan(wait);
+    finderSortBest();
+    f->selected = 0;
+    for (int i = 0; i < f->nbest; i++) if (f->best[i].row == row) f->selected = i;
+}
+
+/* Called while idle: finish a scan that a key interrupted. Returns 1 if
+   the list changed. */
+int finderIdle(void) {
+    Finder *f = &finder;
+    if (!f->active || f->depth == 0 || f->levels[f->depth - 1].scanned >= E.numrows) return 0;
+    finderResume(0);
+    
+    /* The prompt is not redrawn until the next key, so swap the count at
+       the end of its status line here */
+    char *info = strrchr(E.statusmsg, '[');
+    finderShowCount();
+    if (info) snprintf(info, sizeof(E.statusmsg) - (info - E.statusmsg), "[%s]", prompt_info);
+    return 1;
+}
+
+void finderCallback(char *query, int key) {
+    Finder *f = &finder;
+    if (key == '\r' || key == '\x1b') return;
+    f->active = 1;
+    
+    /* The best line is drawn nearest the prompt, so up goes to worse ones */
+    if (key == KEY_ARROW_UP || key == KEY_ARROW_DOWN) {
+        int step = key == KEY_ARROW_UP ? 1 : -1;
+        if (f->selected + step >= 0 && f->selected + step < f->nbest) f->selected += step;
+        return;
+    }
+    if (key == KEY_ARROW_LEFT || key == KEY_ARROW_RIGHT) return;
+    
+    finderUpdate(query);
+    if (f->depth == 0) prompt_info[0] = '\0';
+    else finderShowCount();
+}
+
+/* Rows of the list drawn above the prompt */
+int finderListRows(void) {
+    if (!finder.active) return 0;
+    return finder.nbest < E.screenrows - 1 ? finder.nbest : E.screenrows - 1;
+}
+
+void finderOpen(void) {
+    if (E.numrows == 0) return;
+    finderReset();
+    char *query = editorPrompt("Line: %s (ESC to cancel, arrows to choose)", finderCallback);
+    
+    if (query && finder.depth > 0) {
+        /* Enter before the scan caught up picks the best of every row */
+        if (finder.selected == 0 && finder.levels[finder.depth - 1].scanned < E.numrows)
+            finderResume(1);
+        if (finder.nbest > 0) {
+            FinderHit *hit = &finder.best[finder.selected];
+            int pos[EDE_FINDER_MAX_QUERY];
+            finderScore(&E.row[hit->row], pos);
+            E.cy = hit->row;
+            E.cx = editorRowRxToCx(&E.row[hit->row], pos[0]);
+            E.rowoff = E.numrows;
+        } else {
+            editorSetStatusMessage("No line matches '%s'", query);
+        }
+    }
+    free(query);
+    finderReset();
+}
+
+/*** Clipboard System ***/
+
+#define MAX_CLIPBOARD_SIZE 1048576  /* 1MB */
+
+typedef struct Clipboard {
+    char *text;
+    int length;
+    int is_line_mode;
+} Clipboard;
+
+Clipboard clipboard = {NULL, 0, 0};
+
+void clipboardSet(const char *text, int length, int is_line_mode) {
+    free(clipboard.text);
+    clipboard.text = malloc(length + 1);
+    memcpy(clipboard.text, text, length);
+    clipboard.text[length] = '\0';
+    clipboard.length = length;
+    clipboard.is_line_mode = is_line_mode;
+}
+
+void editorCopy(void) {
+    if (E.cy >= E.numrows) return;
+    
+    EditorRow *row = &E.row[E.cy];
+    clipboardSet(row->chars, row->size, 1);
+    editorSetStatusMessage("Line copied to clipboard");
+}
+
+void editorCut(void) {
+    if (E.cy >= E.numrows) return;
+    
+    EditorRow *row = &E.row[E.cy];
+    clipboardSet(row->chars, row->size, 1);
+    editorDelRow(E.cy);
+    if (E.cy >= E.numrows) E.cy = E.numrows - 1;
+    if (E.cy < 0) E.cy = 0;
+    editorSetStatusMessage("Line cut to clipboard");
+}
+
+void editorPaste(void) {
+    if (!clipboard.text) {
+        editorSetStatusMessage("Clipboard is empty");
+        return;
+    }
+    
+    if (clipboard.is_line_mode) {
+        editorInsertRow(E.cy + 1, clipboard.text, clipboard.length);
+        E.cy++;
+        E.cx = 0;
+    } else {
+        for (int i = 0; i < clipboard.length; i++) {
+            editorInsertChar(clipboard.text[i]);
+        }
+    }
+    editorSetStatusMessage("Pasted from clipboard");
+}
+
+void clipboardFree(void) {
+    free(clipboard.text);
+    clipboard.text = NULL;
+    clipboard.length = 0;
+}
+
+/*** Autocomplete System ***/
+
+#define MAX_COMPLETIONS 256
+#define MAX_COMPLETION_LEN 128
+
+typedef struct Autocomplete {
+    char completions[MAX_COMPLETIONS][MAX_COMPLETION_LEN];
+    int count;
+    int selected;
+    int active;
+    char prefix[MAX_COMPLETION_LEN];
+    int prefix_len;
+} Autocomplete;
+
+Autocomplete autocomplete = {0};
+
+void autocompleteReset(void) {
+    autocomplete.count = 0;
+    autocomplete.selected = 0;
+    autocomplete.active = 0;
+    autocomplete.prefix_len = 0;
+}
+
+void autocompleteAddWord(const char *word) {
+    if (autocomplete.count >= MAX_COMPLETIONS) return;
+    
+    /* Check for duplicates */
+    for (int i = 0; i < autocomplete.count; i++) {
+        if (strcmp(autocomplete.completions[i], word) == 0) {
+            return;
+        }
+    }
+    
+    strncpy(autocomplete.completions[autocomplete.count], word, MAX_COMPLETION_LEN - 1);
+    autocomplete.completions[autocomplete.count][MAX_COMPLETION_LEN - 1] = '\0';
+    autocomplete.count++;
+}
+
+void autocompleteBuildList(void) {
+    autocompleteReset();
+    
+    if (E.cy >= E.numrows) return;
+    
+    EditorRow *row = &E.row[E.cy];
+    if (E.cx == 0) return;
+    
+    /* Find word prefix */
+    int start = E.cx - 1;
+    while (start > 0 && charIs(row->chars[start - 1], CHAR_IDENT)) {
+        start--;
+    }
+    
+    int prefix_len = E.cx - start;
+    if (prefix_len < 2) return;
+    
+    strncpy(autocomplete.prefix, &row->chars[start], prefix_len);
+    autocomplete.prefix[prefix_len] = '\0';
+    autocomplete.prefix_len = prefix_len;
+    
+    /* Search all rows for matching words */
+    for (int r = 0; r < E.numrows; r++) {
+        EditorRow *erow = &E.row[r];
+        char *line = erow->chars;
+        int len = erow->size;
+        
+        /* Jump from word to word */
+        int i = charFindClass(line, 0, len, CHAR_IDENT);
+        while (i < len) {
+            int word_start = i;
+            i = charSkipClass(line, i, len, CHAR_IDENT);
+            int word_len = i - word_start;
+            
+            if (word_len > prefix_len && word_len < MAX_COMPLETION_LEN) {
+                if (strncmp(&line[word_start], autocomplete.prefix, prefix_len) == 0) {
+                    char word[MAX_COMPLETION_LEN];
+                    strncpy(word, &line[word_start], word_len);
+                    word[word_len] = '\0';
+                    autocompleteAddWord(word);
+                }
+            }
+            i = charFindClass(line, i, len, CHAR_IDENT);
+        }
+    }
+    
+    if (autocomplete.count > 0) {
+        autocomplete.active = 1;
+    }
+}
+
+void autocompleteInsertSelected(void) {
+    if (!autocomplete.active || autocomplete.count == 0) return;
+    
+    char *completion = autocomplete.completions[autocomplete.selected];
+    int remaining = strlen(completion) - autocomplete.prefix_len;
+    
+    for (int i = 0; i < remaining; i++) {
+        editorInsertChar(completion[autocomplete.prefix_len + i]);
+    }
+    
+    autocompleteReset();
+}
+
+void autocompleteNext(void) {
+    if (!autocomplete.active) return;
+    autocomplete.selected = (autocomplete.selected + 1) % autocomplete.count;
+}
+
+void autocompletePrev(void) {
+    if (!autocomplete.active) return;
+    autocomplete.selected = (autocomplete.selected - 1 + autocomplete.count) % autocomplete.count;
+}
+
+/*** Macro Recording System ***/
+
+#define MAX_MACRO_SIZE 10000
+
+typedef struct Macro {
+    int keys[MAX_MACRO_SIZE];
+    int count;
+    int recording;
+    int playing;
+} Macro;
+
+Macro macro = {0};
+
+void macroStartRecording(void) {
+    macro.count = 0;
+    macro.recording = 1;
+    editorSetStatusMessage("Recording macro... (Ctrl-M to stop)");
+}
+
+void macroStopRecording(void) {
+    macro.recording = 0;
+    editorSetStatusMessage("Macro recorded (%d keys)", macro.count);
+}
+
+void macroRecordKey(int key) {
+    if (!macro.recording || macro.count >= MAX_MACRO_SIZE) return;
+    macro.keys[macro.count++] = key;
+}
+
+void macroPlayback(void) {
+    if (macro.count == 0) {
+        editorSetStatusMessage("No macro recorded");
+        return;
+    }
+    
+    macro.playing = 1;
+    editorSetStatusMessage("Playing macro...");
+    
+    /* Playback will be handled in main loop */
+}
+
+/*** Multi-cursor System ***/
+
+#define MAX_CURSORS 256
+
+typedef struct Cursor {
+    int cx;
+    int cy;
+    int active;
+} Cursor;
+
+typedef struct MultiCursor {
+    Cursor cursors[MAX_CURSORS];
+    int count;
+    int enabled;
+} MultiCursor;
+
+MultiCursor multi_cursor = {0};
+
+void multiCursorAdd(int cx, int cy) {
+    if (multi_cursor.count >= MAX_CURSORS) return;
+    
+    /* Check for duplicates */
+    for (int i = 0; i < multi_cursor.count; i++) {
+        if (multi_cursor.cursors[i].cx == cx && multi_cursor.cursors[i].cy == cy) {
+            return;
+        }
+    }
+    
+    multi_cursor.cursors[multi_cursor.count].cx = cx;
+    multi_cursor.cursors[multi_cursor.count].cy = cy;
+    multi_cursor.cursors[multi_cursor.count].active = 1;
+    multi_cursor.count++;
+    multi_cursor.enabled = 1;
+}
+
+void multiCursorClear(void) {
+    multi_cursor.count = 0;
+    multi_cursor.enabled = 0;
+}
+
+void multiCursorInsertChar(int c) {
+    if (!multi_cursor.enabled) {
+        editorInsertChar(c);
+        return;
+    }
+    
+    for (int i = 0; i < multi_cursor.count; i++) {
+        if (!multi_cursor.cursors[i].active) continue;
+        
+        int saved_cx = E.cx;
+        int saved_cy = E.cy;
+        
+        E.cx = multi_cursor.cursors[i].cx;
+        E.cy = multi_cursor.cursors[i].cy;
+        
+        editorInsertChar(c);
+        
+        multi_cursor.cursors[i].cx = E.cx;
+        multi_cursor.cursors[i].cy = E.cy;
+        
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+    }
+}
+
+/*** Split View System ***/
+
+typedef struct Split {
+    int active;
+    int vertical;
     int split_pos;
     int focus; /* 0 = left/top, 1 = right/bottom */
     
@@ -2669,6 +6991,53 @@ void splitToggleFocus(void) {
     }
 }
 
+/* Screen area and view state of one pane. The focused pane always shows
+   the E cursor; the other one shows the saved split view. */
+typedef struct Pane {
+    int top, left;
+    int rows, cols;
+    int cy, rowoff, coloff;
+    int depth_row, depth;  /* bracket depth at the start of row depth_row */
+} Pane;
+
+int editorLayoutPanes(Pane *panes) {
+    int dim = split.vertical ? E.screencols : E.screenrows;
+    
+    if (!split.active || dim < 3) {
+        Pane single = {.rows = E.screenrows, .cols = E.screencols,
+                       .cy = E.cy, .rowoff = E.rowoff, .coloff = E.coloff};
+        panes[0] = single;
+        return 1;
+    }
+    
+    /* One row or column between the panes is the separator */
+    int pos = split.split_pos;
+    if (pos < 1) pos = 1;
+    if (pos > dim - 2) pos = dim - 2;
+    
+    if (split.vertical) {
+        Pane left = {.rows = E.screenrows, .cols = pos};
+        Pane right = {.left = pos + 1, .rows = E.screenrows, .cols = E.screencols - pos - 1};
+        panes[0] = left;
+        panes[1] = right;
+    } else {
+        Pane top = {.rows = pos, .cols = E.screencols};
+        Pane bottom = {.top = pos + 1, .rows = E.screenrows - pos - 1, .cols = E.screencols};
+        panes[0] = top;
+        panes[1] = bottom;
+    }
+    
+    Pane *focused = &panes[split.focus];
+    Pane *other = &panes[!split.focus];
+    focused->cy = E.cy;
+    focused->rowoff = E.rowoff;
+    focused->coloff = E.coloff;
+    other->cy = split.cy2;
+    other->rowoff = split.rowoff2;
+    other->coloff = split.coloff2;
+    return 2;
+}
+
 /*** Code Folding ***/
 
 #define MAX_FOLDS 1000
@@ -2689,478 +7058,1917 @@ FoldManager fold_manager = {0};
 int findMatchingBrace(int start_row) {
     if (start_row >= E.numrows) return -1;
     
+    bracketIndexPrepare(start_row);
     EditorRow *row = &E.row[start_row];
-    int brace_count = 0;
-    int found_open = 0;
     
-    /* Look for opening brace on this line */
+    /* Fold from the first opening brace on this line that is code */
+    for (int i = 0; i < row->rsize; i++) {
+        if (row->render[i] == '{' && bracketInCode(row->hl, i)) {
+            int match_row, match_rx;
+            if (!bracketMatch(start_row, i, &match_row, &match_rx)) return -1;
+            return match_row;
+        }
+    }
+    
+    return -1;
+}
+
+void toggleFold(int row) {
+    /* Check if fold already exists at this row */
+    for (int i = 0; i < fold_manager.count; i++) {
+        if (fold_manager.folds[i].start_row == row) {
+            fold_manager.folds[i].folded = !fold_manager.folds[i].folded;
+            return;
+        }
+    }
+    
+    /* Create new fold */
+    if (fold_manager.count >= MAX_FOLDS) return;
+    
+    int end = findMatchingBrace(row);
+    if (end == -1) {
+        editorSetStatusMessage("No matching brace found");
+        return;
+    }
+    
+    fold_manager.folds[fold_manager.count].start_row = row;
+    fold_manager.folds[fold_manager.count].end_row = end;
+    fold_manager.folds[fold_manager.count].folded = 1;
+    fold_manager.count++;
+    
+    editorSetStatusMessage("Folded lines %d-%d", row + 1, end + 1);
+}
+
+int isRowFolded(int row) {
+    for (int i = 0; i < fold_manager.count; i++) {
+        if (fold_manager.folds[i].folded &&
+            row > fold_manager.folds[i].start_row &&
+            row <= fold_manager.folds[i].end_row) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*** Bookmark System ***/
+
+#define MAX_BOOKMARKS 100
+
+typedef struct Bookmark {
+    int row;
+    char label[64];
+} Bookmark;
+
+typedef struct BookmarkManager {
+    Bookmark bookmarks[MAX_BOOKMARKS];
+    int count;
+} BookmarkManager;
+
+BookmarkManager bookmark_manager = {0};
+
+void addBookmark(int row, const char *label) {
+    if (bookmark_manager.count >= MAX_BOOKMARKS) return;
+    
+    bookmark_manager.bookmarks[bookmark_manager.count].row = row;
+    strncpy(bookmark_manager.bookmarks[bookmark_manager.count].label, label, 63);
+    bookmark_manager.bookmarks[bookmark_manager.count].label[63] = '\0';
+    bookmark_manager.count++;
+    
+    editorSetStatusMessage("Bookmark added at line %d", row + 1);
+}
+
+void gotoNextBookmark(void) {
+    if (bookmark_manager.count == 0) {
+        editorSetStatusMessage("No bookmarks");
+        return;
+    }
+    
+    for (int i = 0; i < bookmark_manager.count; i++) {
+        if (bookmark_manager.bookmarks[i].row > E.cy) {
+            E.cy = bookmark_manager.bookmarks[i].row;
+            E.cx = 0;
+            return;
+        }
+    }
+    
+    /* Wrap to first */
+    E.cy = bookmark_manager.bookmarks[0].row;
+    E.cx = 0;
+}
+
+void gotoPrevBookmark(void) {
+    if (bookmark_manager.count == 0) {
+        editorSetStatusMessage("No bookmarks");
+        return;
+    }
+    
+    for (int i = bookmark_manager.count - 1; i >= 0; i--) {
+        if (bookmark_manager.bookmarks[i].row < E.cy) {
+            E.cy = bookmark_manager.bookmarks[i].row;
+            E.cx = 0;
+            return;
+        }
+    }
+    
+    /* Wrap to last */
+    E.cy = bookmark_manager.bookmarks[bookmark_manager.count - 1].row;
+    E.cx = 0;
+}
+
+/*** Buffer switching ***/
+
+/* Empty the buffer before another file is loaded into it, dropping
+   everything that refers to its rows: highlighting, search matches,
+   folds, bookmarks, extra cursors, undo history and the positions of the
+   second split pane. The split itself stays open. */
+void editorCloseBuffer(void) {
+    searchFinish();
+    freeSearchMatches();
+    hlCacheClear();
+    for (int r = 0; r < E.numrows; r++) editorFreeRow(&E.row[r]);
+    free(E.row);
+    E.row = NULL;
+    E.numrows = 0;
+    E.dirty = 0;
+    E.cx = E.cy = E.rx = E.rowoff = E.coloff = 0;
+
+    UndoAction **stacks[2] = {&E.undo_stack, &E.redo_stack};
+    for (int i = 0; i < 2; i++) {
+        while (*stacks[i]) {
+            UndoAction *tmp = *stacks[i];
+            *stacks[i] = tmp->next;
+            free(tmp->text);
+            free(tmp);
+        }
+    }
+    E.undo_count = 0;
+
+    fold_manager.count = 0;
+    bookmark_manager.count = 0;
+    multiCursorClear();
+    split.cx2 = split.cy2 = split.rx2 = split.rowoff2 = split.coloff2 = 0;
+}
+
+/*** Smart Indentation System ***/
+
+typedef struct IndentConfig {
+    int use_tabs;
+    int tab_width;
+    int auto_indent;
+    int smart_indent;
+} IndentConfig;
+
+IndentConfig indent_config = {
+    .use_tabs = 0,
+    .tab_width = 4,
+    .auto_indent = 1,
+    .smart_indent = 1
+};
+
+int getLineIndentation(EditorRow *row) {
+    int indent = 0;
     for (int i = 0; i < row->size; i++) {
-        if (row->chars[i] == '{') {
-            found_open = 1;
-            brace_count = 1;
+        if (row->chars[i] == ' ') {
+            indent++;
+        } else if (row->chars[i] == '\t') {
+            indent += indent_config.tab_width;
+        } else {
             break;
         }
     }
+    return indent;
+}
+
+void insertIndentation(int amount) {
+    if (indent_config.use_tabs) {
+        int tabs = amount / indent_config.tab_width;
+        int spaces = amount % indent_config.tab_width;
+        for (int i = 0; i < tabs; i++) {
+            editorInsertChar('\t');
+        }
+        for (int i = 0; i < spaces; i++) {
+            editorInsertChar(' ');
+        }
+    } else {
+        for (int i = 0; i < amount; i++) {
+            editorInsertChar(' ');
+        }
+    }
+}
+
+void autoIndentNewline(void) {
+    if (!indent_config.auto_indent || E.cy >= E.numrows) {
+        editorInsertNewline();
+        return;
+    }
+    
+    EditorRow *row = &E.row[E.cy];
+    int base_indent = getLineIndentation(row);
+    
+    /* Check for smart indent triggers: an opening bracket that is not
+       inside a string or comment */
+    if (indent_config.smart_indent && E.cx > 0) {
+        int rx = editorRowCxToRx(row, E.cx - 1);
+        int open = 0;
+        editorSyntaxEnsure(E.cy, E.cy + 1, E.numrows);
+        if (bracketTypeOf(row->render[rx], &open) >= 0 && open &&
+            bracketInCode(row->hl, rx)) {
+            base_indent += indent_config.tab_width;
+        }
+    }
+    
+    editorInsertNewline();
+    insertIndentation(base_indent);
+}
+
+void indentLine(int row_index) {
+    if (row_index < 0 || row_index >= E.numrows) return;
+    
+    EditorRow *row = &E.row[row_index];
+    int current_indent = getLineIndentation(row);
+    int new_indent = current_indent + indent_config.tab_width;
+    
+    /* Insert spaces at beginning */
+    for (int i = 0; i < indent_config.tab_width; i++) {
+        editorRowInsertChar(row, current_indent + i, ' ');
+    }
+}
+
+void unindentLine(int row_index) {
+    if (row_index < 0 || row_index >= E.numrows) return;
+    
+    EditorRow *row = &E.row[row_index];
+    int current_indent = getLineIndentation(row);
+    int to_remove = (current_indent < indent_config.tab_width) ? 
+                    current_indent : indent_config.tab_width;
+    
+    for (int i = 0; i < to_remove; i++) {
+        if (row->size > 0 && (row->chars[0] == ' ' || row->chars[0] == '\t')) {
+            editorRowDelChar(row, 0);
+        }
+    }
+}
+
+void indentSelection(void) {
+    /* For now, just indent current line */
+    indentLine(E.cy);
+    editorSetStatusMessage("Line indented");
+}
+
+void unindentSelection(void) {
+    unindentLine(E.cy);
+    editorSetStatusMessage("Line unindented");
+}
+
+/*** Bracket Matching ***/
+
+typedef struct BracketPair {
+    char open;
+    char close;
+} BracketPair;
+
+BracketPair bracket_pairs[] = {
+    {'(', ')'},
+    {'[', ']'},
+    {'{', '}'},
+    {'<', '>'},
+};
+
+#define NUM_BRACKET_PAIRS (sizeof(bracket_pairs) / sizeof(BracketPair))
+
+int isBracket(char c, int *is_open, int *pair_index) {
+    for (int i = 0; i < NUM_BRACKET_PAIRS; i++) {
+        if (c == bracket_pairs[i].open) {
+            *is_open = 1;
+            *pair_index = i;
+            return 1;
+        }
+        if (c == bracket_pairs[i].close) {
+            *is_open = 0;
+            *pair_index = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* '<' and '>' are mostly comparisons and shifts, so they are not in the
+   bracket index; they are matched by a plain scan */
+int findMatchingAngle(char c, int is_open, int pair_index, int *match_row, int *match_col) {
+    char target = is_open ? bracket_pairs[pair_index].close : bracket_pairs[pair_index].open;
+    int direction = is_open ? 1 : -1;
+    int depth = 0;
     
-    if (!found_open) return -1;
+    int r = E.cy;
+    int col = E.cx;
     
-    /* Find matching closing brace */
-    for (int r = start_row; r < E.numrows; r++) {
+    while (r >= 0 && r < E.numrows) {
         EditorRow *erow = &E.row[r];
-        int start = (r == start_row) ? 0 : 0;
         
-        for (int i = start; i < erow->size; i++) {
-            if (erow->chars[i] == '{') brace_count++;
-            else if (erow->chars[i] == '}') {
-                brace_count--;
-                if (brace_count == 0) {
-                    return r;
+        if (direction > 0) {
+            for (int i = col; i < erow->size; i++) {
+                if (erow->chars[i] == c) depth++;
+                else if (erow->chars[i] == target) {
+                    depth--;
+                    if (depth == 0) {
+                        *match_row = r;
+                        *match_col = i;
+                        return 1;
+                    }
+                }
+            }
+            r++;
+            col = 0;
+        } else {
+            for (int i = col; i >= 0; i--) {
+                if (erow->chars[i] == c) depth++;
+                else if (erow->chars[i] == target) {
+                    depth--;
+                    if (depth == 0) {
+                        *match_row = r;
+                        *match_col = i;
+                        return 1;
+                    }
                 }
             }
+            r--;
+            if (r >= 0) col = E.row[r].size - 1;
         }
     }
     
-    return -1;
+    return 0;
 }
 
-void toggleFold(int row) {
-    /* Check if fold already exists at this row */
-    for (int i = 0; i < fold_manager.count; i++) {
-        if (fold_manager.folds[i].start_row == row) {
-            fold_manager.folds[i].folded = !fold_manager.folds[i].folded;
-            return;
-        }
-    }
-    
-    /* Create new fold */
-    if (fold_manager.count >= MAX_FOLDS) return;
+int findMatchingBracket(int *match_row, int *match_col) {
+    if (E.cy >= E.numrows || E.cx >= E.row[E.cy].size) return 0;
     
-    int end = findMatchingBrace(row);
-    if (end == -1) {
-        editorSetStatusMessage("No matching brace found");
-        return;
-    }
+    EditorRow *row = &E.row[E.cy];
+    char c = row->chars[E.cx];
     
-    fold_manager.folds[fold_manager.count].start_row = row;
-    fold_manager.folds[fold_manager.count].end_row = end;
-    fold_manager.folds[fold_manager.count].folded = 1;
-    fold_manager.count++;
+    int is_open, pair_index;
+    if (!isBracket(c, &is_open, &pair_index)) return 0;
+    if (c == '<' || c == '>') return findMatchingAngle(c, is_open, pair_index, match_row, match_col);
     
-    editorSetStatusMessage("Folded lines %d-%d", row + 1, end + 1);
+    int rx;
+    if (!bracketMatch(E.cy, editorRowCxToRx(row, E.cx), match_row, &rx)) return 0;
+    *match_col = editorRowRxToCx(&E.row[*match_row], rx);
+    return 1;
 }
 
-int isRowFolded(int row) {
-    for (int i = 0; i < fold_manager.count; i++) {
-        if (fold_manager.folds[i].folded &&
-            row > fold_manager.folds[i].start_row &&
-            row <= fold_manager.folds[i].end_row) {
-            return 1;
-        }
+void gotoMatchingBracket(void) {
+    int match_row, match_col;
+    if (findMatchingBracket(&match_row, &match_col)) {
+        E.cy = match_row;
+        E.cx = match_col;
+        editorSetStatusMessage("Jumped to matching bracket");
+    } else {
+        editorSetStatusMessage("No matching bracket found");
     }
-    return 0;
 }
 
-/*** Bookmark System ***/
+/*** File Browser ***/
 
-#define MAX_BOOKMARKS 100
+#define MAX_FILE_ENTRIES 1000
 
-typedef struct Bookmark {
-    int row;
-    char label[64];
-} Bookmark;
+typedef struct FileEntry {
+    char name[MAX_PATH_LENGTH];
+    char full_path[MAX_PATH_LENGTH];
+    int is_directory;
+    long size;
+} FileEntry;
 
-typedef struct BookmarkManager {
-    Bookmark bookmarks[MAX_BOOKMARKS];
+typedef struct FileBrowser {
+    FileEntry entries[MAX_FILE_ENTRIES];
     int count;
-} BookmarkManager;
+    int selected;
+    int active;
+    char current_dir[MAX_PATH_LENGTH];
+} FileBrowser;
 
-BookmarkManager bookmark_manager = {0};
+FileBrowser file_browser = {0};
 
-void addBookmark(int row, const char *label) {
-    if (bookmark_manager.count >= MAX_BOOKMARKS) return;
+#ifdef EDE_WINDOWS
+#include <direct.h>
+#define getcwd _getcwd
+#define chdir _chdir
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+void fileBrowserLoadDirectory(const char *path) {
+    file_browser.count = 0;
+    file_browser.selected = 0;
+    strncpy(file_browser.current_dir, path, MAX_PATH_LENGTH - 1);
     
-    bookmark_manager.bookmarks[bookmark_manager.count].row = row;
-    strncpy(bookmark_manager.bookmarks[bookmark_manager.count].label, label, 63);
-    bookmark_manager.bookmarks[bookmark_manager.count].label[63] = '\0';
-    bookmark_manager.count++;
+#ifdef EDE_WINDOWS
+    WIN32_FIND_DATA find_data;
+    char search_path[MAX_PATH_LENGTH];
+    snprintf(search_path, sizeof(search_path), "%s\\*", path);
     
-    editorSetStatusMessage("Bookmark added at line %d", row + 1);
-}
-
-void gotoNextBookmark(void) {
-    if (bookmark_manager.count == 0) {
-        editorSetStatusMessage("No bookmarks");
-        return;
-    }
+    HANDLE hFind = FindFirstFile(search_path, &find_data);
+    if (hFind == INVALID_HANDLE_VALUE) return;
     
-    for (int i = 0; i < bookmark_manager.count; i++) {
-        if (bookmark_manager.bookmarks[i].row > E.cy) {
-            E.cy = bookmark_manager.bookmarks[i].row;
-            E.cx = 0;
-            return;
-        }
-    }
+    do {
+        if (file_browser.count >= MAX_FILE_ENTRIES) break;
+        
+        FileEntry *entry = &file_browser.entries[file_browser.count];
+        strncpy(entry->name, find_data.cFileName, MAX_PATH_LENGTH - 1);
+        snprintf(entry->full_path, MAX_PATH_LENGTH, "%s\\%s", path, find_data.cFileName);
+        entry->is_directory = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        entry->size = find_data.nFileSizeLow;
+        
+        file_browser.count++;
+    } while (FindNextFile(hFind, &find_data));
     
-    /* Wrap to first */
-    E.cy = bookmark_manager.bookmarks[0].row;
-    E.cx = 0;
-}
-
-void gotoPrevBookmark(void) {
-    if (bookmark_manager.count == 0) {
-        editorSetStatusMessage("No bookmarks");
-        return;
-    }
+    FindClose(hFind);
+#else
+    DIR *dir = opendir(path);
+    if (!dir) return;
     
-    for (int i = bookmark_manager.count - 1; i >= 0; i--) {
-        if (bookmark_manager.bookmarks[i].row < E.cy) {
-            E.cy = bookmark_manager.bookmarks[i].row;
-            E.cx = 0;
-            return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (file_browser.count >= MAX_FILE_ENTRIES) break;
+        
+        FileEntry *fe = &file_browser.entries[file_browser.count];
+        strncpy(fe->name, entry->d_name, MAX_PATH_LENGTH - 1);
+        snprintf(fe->full_path, MAX_PATH_LENGTH, "%s/%s", path, entry->d_name);
+        
+        struct stat st;
+        if (stat(fe->full_path, &st) == 0) {
+            fe->is_directory = S_ISDIR(st.st_mode);
+            fe->size = st.st_size;
         }
+        
+        file_browser.count++;
     }
     
-    /* Wrap to last */
-    E.cy = bookmark_manager.bookmarks[bookmark_manager.count - 1].row;
-    E.cx = 0;
+    closedir(dir);
+#endif
 }
 
-/*** Smart Indentation System ***/
+void fileBrowserOpen(void) {
+    char cwd[MAX_PATH_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        fileBrowserLoadDirectory(cwd);
+        file_browser.active = 1;
+        editorSetStatusMessage("File browser (Enter=open, Esc=close, arrows=navigate)");
+    }
+}
 
-typedef struct IndentConfig {
-    int use_tabs;
-    int tab_width;
-    int auto_indent;
-    int smart_indent;
-} IndentConfig;
+void fileBrowserClose(void) {
+    file_browser.active = 0;
+}
 
-IndentConfig indent_config = {
-    .use_tabs = 0,
-    .tab_width = 4,
-    .auto_indent = 1,
-    .smart_indent = 1
-};
+void fileBrowserNavigate(int direction) {
+    if (!file_browser.active) return;
+    
+    file_browser.selected += direction;
+    if (file_browser.selected < 0) file_browser.selected = 0;
+    if (file_browser.selected >= file_browser.count) {
+        file_browser.selected = file_browser.count - 1;
+    }
+}
 
-int getLineIndentation(EditorRow *row) {
-    int indent = 0;
-    for (int i = 0; i < row->size; i++) {
-        if (row->chars[i] == ' ') {
-            indent++;
-        } else if (row->chars[i] == '\t') {
-            indent += indent_config.tab_width;
+void fileBrowserSelect(void) {
+    if (!file_browser.active || file_browser.selected >= file_browser.count) return;
+    
+    FileEntry *entry = &file_browser.entries[file_browser.selected];
+    
+    if (entry->is_directory) {
+        if (strcmp(entry->name, ".") == 0) {
+            return;
+        } else if (strcmp(entry->name, "..") == 0) {
+            /* Go to parent directory */
+            char parent[MAX_PATH_LENGTH];
+            strncpy(parent, file_browser.current_dir, MAX_PATH_LENGTH - 1);
+            
+            char *last_slash = strrchr(parent, '/');
+            if (!last_slash) last_slash = strrchr(parent, '\\');
+            if (last_slash) *last_slash = '\0';
+            
+            fileBrowserLoadDirectory(parent);
         } else {
-            break;
+            chdir(entry->full_path);
+            fileBrowserLoadDirectory(entry->full_path);
+        }
+    } else {
+        /* Open file */
+        if (E.dirty) {
+            editorSetStatusMessage("Unsaved changes! Use :w before opening %s", entry->name);
+            return;
         }
+        editorCloseBuffer();
+        editorOpen(entry->full_path);
+        fileBrowserClose();
+        editorSetStatusMessage("Opened %s", entry->name);
     }
-    return indent;
 }
 
-void insertIndentation(int amount) {
-    if (indent_config.use_tabs) {
-        int tabs = amount / indent_config.tab_width;
-        int spaces = amount % indent_config.tab_width;
-        for (int i = 0; i < tabs; i++) {
-            editorInsertChar('\t');
-        }
-        for (int i = 0; i < spaces; i++) {
-            editorInsertChar(' ');
+/*** Project search ***/
+
+/* :grep walks a directory tree on the thread pool. Directories and files
+   go on one shared stack: a worker pops an entry and either lists it,
+   pushing what it finds, or searches it, so even one wide directory is
+   spread over every thread. Hidden entries are skipped, and so is
+   anything a .gitignore on the way down excludes. Large files are
+   mapped; small ones are read into a buffer the worker reuses, which
+   is cheaper than setting up and tearing down a mapping for a few
+   pages. Binary files (a NUL in the first 8 KB) are dropped, and each
+   worker runs its own copy of the SearchPattern the buffer search uses.
+   Results are appended a file at a time and :cn and :cp step through
+   them while the walk goes on. The same walk, with collect set, lists
+   the files and directories for the project index. */
+
+#define EDE_GREP_BINARY_PROBE 8192
+#define EDE_GREP_TEXT_MAX 200
+#define EDE_GREP_MAP_MIN (1 << 20)   /* smaller files are read */
+
+typedef struct GrepRule {
+    char *glob;
+    int negate;            /* !pattern takes a path back in */
+    int dir_only;          /* pattern/ only matches directories */
+    int has_slash;         /* matched against the path, not the name */
+} GrepRule;
+
+/* The rules of one .gitignore, chained to those of the directories above */
+typedef struct GrepIgnore {
+    struct GrepIgnore *parent;
+    struct GrepIgnore *next;   /* all sets of the job, for freeing */
+    char *base;                /* directory holding the .gitignore */
+    GrepRule *rules;
+    int count;
+} GrepIgnore;
+
+typedef struct GrepEntry {
+    char *path;
+    int is_dir;
+    GrepIgnore *ignore;        /* rules in force where the entry is */
+    long long size;            /* from the directory listing, or -1 */
+    long long mtime;
+    int check;                 /* from the index: size and mtime are what it
+                                  recorded, and the entry is only searched
+                                  or listed if they changed */
+} GrepEntry;
+
+typedef struct GrepResult {
+    int file;                  /* index into files */
+    int line;                  /* 1-based */
+    int col;                   /* byte offset of the first match */
+    char *text;                /* the line, cut at EDE_GREP_TEXT_MAX */
+} GrepResult;
+
+typedef struct GrepJob {
+    char pattern[256];
+    int ignore_case;
+    int use_regex;
+    int collect;               /* list files into listed instead of searching them */
+    int root_len;              /* prefix cut from listed paths */
+    int indexed;               /* files came from the project index */
+    struct IndexView *index;   /* while indexed: files it lists are not
+                                  queued again when a directory is listed */
+    int lock;                  /* guards the lists and totals below */
+    GrepEntry *stack;
+    int stack_count;
+    int stack_cap;
+    GrepIgnore *ignores;
+    GrepEntry *listed;         /* with collect: every file, relative to the root */
+    int listed_count;
+    int listed_cap;
+    char **files;              /* files with results */
+    int file_count;
+    int file_cap;
+    GrepResult *results;
+    int result_count;
+    int result_cap;
+    long long bytes;           /* searched so far */
+    int searched;              /* files searched so far */
+    int pending;               /* entries pushed and not yet done */
+    int cancel;
+    int finished;              /* workers that have returned */
+    EdeThread threads[EDE_MAX_THREADS];
+    int nthreads;
+    int running;               /* until grepJoin */
+    int current;               /* result :cn and :cp go on from, -1 before the first */
+    int shown;                 /* result count last on the status line */
+} GrepJob;
+
+GrepJob grep_job = {.current = -1};
+
+/* Glob match for .gitignore patterns: * and ? stop at '/', ** does not */
+int grepGlob(const char *p, const char *s) {
+    for (; *p; p++, s++) {
+        if (*p == '*') {
+            int any = p[1] == '*';
+            while (*p == '*') p++;
+            /* "**" followed by '/' also matches no directory at all */
+            if (any && *p == '/' && grepGlob(p + 1, s)) return 1;
+            for (;; s++) {
+                if (grepGlob(p, s)) return 1;
+                if (*s == '\0' || (!any && *s == '/')) return 0;
+            }
         }
-    } else {
-        for (int i = 0; i < amount; i++) {
-            editorInsertChar(' ');
+        if (*s == '\0') return 0;
+        if (*p == '?') {
+            if (*s == '/') return 0;
+        } else if (*p == '[' && strchr(p + 1, ']')) {
+            int negate = (p[1] == '!' || p[1] == '^');
+            int found = 0;
+            p += negate ? 2 : 1;
+            for (int first = 1; *p && (*p != ']' || first); p++, first = 0) {
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    if ((unsigned char)*s >= (unsigned char)p[0] &&
+                        (unsigned char)*s <= (unsigned char)p[2]) found = 1;
+                    p += 2;
+                } else if (*p == *s) {
+                    found = 1;
+                }
+            }
+            if (*p == '\0' || found == negate) return 0;
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            if (*p != *s) return 0;
         }
     }
+    return *s == '\0';
 }
 
-void autoIndentNewline(void) {
-    if (!indent_config.auto_indent || E.cy >= E.numrows) {
-        editorInsertNewline();
-        return;
-    }
-    
-    EditorRow *row = &E.row[E.cy];
-    int base_indent = getLineIndentation(row);
+/* The rules of dir/.gitignore on top of parent, or parent if there are none */
+GrepIgnore *grepIgnoreLoad(GrepJob *job, const char *dir, GrepIgnore *parent) {
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/.gitignore", dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return parent;
     
-    /* Check for smart indent triggers */
-    if (indent_config.smart_indent && E.cx > 0) {
-        char prev_char = row->chars[E.cx - 1];
-        if (prev_char == '{' || prev_char == '(' || prev_char == '[') {
-            base_indent += indent_config.tab_width;
+    GrepIgnore *ig = calloc(1, sizeof(GrepIgnore));
+    ig->parent = parent;
+    ig->base = strdup(dir);
+    int cap = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        int len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+            line[--len] = '\0';
+        char *p = line;
+        if (*p == '\0' || *p == '#') continue;
+        
+        GrepRule rule = {0};
+        if (*p == '!') {
+            rule.negate = 1;
+            p++;
+        }
+        len = strlen(p);
+        if (len > 0 && p[len - 1] == '/') {
+            rule.dir_only = 1;
+            p[--len] = '\0';
+        }
+        if (*p == '/') {
+            rule.has_slash = 1;
+            p++;
+        }
+        if (strchr(p, '/')) rule.has_slash = 1;
+        if (*p == '\0') continue;
+        
+        if (ig->count == cap) {
+            cap = cap ? cap * 2 : 16;
+            ig->rules = realloc(ig->rules, sizeof(GrepRule) * cap);
         }
+        rule.glob = strdup(p);
+        ig->rules[ig->count++] = rule;
     }
+    fclose(fp);
     
-    editorInsertNewline();
-    insertIndentation(base_indent);
+    spinLock(&job->lock);
+    ig->next = job->ignores;
+    job->ignores = ig;
+    spinUnlock(&job->lock);
+    return ig;
+}
+
+/* The innermost .gitignore with a matching rule decides, and within it
+   the last matching rule, as git does */
+int grepIgnored(GrepIgnore *ig, const char *path, const char *name, int is_dir) {
+    for (; ig; ig = ig->parent) {
+        const char *rel = strcmp(ig->base, ".") == 0 ? path : path + strlen(ig->base) + 1;
+        for (int i = ig->count - 1; i >= 0; i--) {
+            GrepRule *rule = &ig->rules[i];
+            if (rule->dir_only && !is_dir) continue;
+            if (grepGlob(rule->glob, rule->has_slash ? rel : name)) return !rule->negate;
+        }
+    }
+    return 0;
 }
 
-void indentLine(int row_index) {
-    if (row_index < 0 || row_index >= E.numrows) return;
+void grepPush(GrepJob *job, char *path, int is_dir, GrepIgnore *ignore,
+              long long size, long long mtime, int check) {
+    atomicAdd(&job->pending, 1);
+    spinLock(&job->lock);
+    if (job->stack_count == job->stack_cap) {
+        job->stack_cap = job->stack_cap ? job->stack_cap * 2 : 256;
+        job->stack = realloc(job->stack, sizeof(GrepEntry) * job->stack_cap);
+    }
+    GrepEntry *e = &job->stack[job->stack_count++];
+    e->path = path;
+    e->is_dir = is_dir;
+    e->ignore = ignore;
+    e->size = size;
+    e->mtime = mtime;
+    e->check = check;
+    spinUnlock(&job->lock);
+}
+
+/* Size and modification time of path. Returns 0 on success. */
+int grepStat(const char *path, long long *size, long long *mtime) {
+#ifdef EDE_WINDOWS
+    WIN32_FIND_DATA find_data;
+    HANDLE hFind = FindFirstFile(path, &find_data);
+    if (hFind == INVALID_HANDLE_VALUE) return -1;
+    FindClose(hFind);
+    *size = ((long long)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+    *mtime = ((long long)find_data.ftLastWriteTime[1] << 32) | find_data.ftLastWriteTime[0];
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+#endif
+    return 0;
+}
+
+/* Project index, below */
+int indexFindPath(struct IndexView *ix, const char *rel);
+void indexClose(struct IndexView *ix);
+int indexCandidates(GrepJob *job, const char *root);
+
+/* is_dir is -1, and size and mtime are -1, when the directory listing
+   does not say */
+void grepConsider(GrepJob *job, const char *dir, const char *name, int is_dir,
+                  GrepIgnore *ignore, long long size, long long mtime) {
+    if (name[0] == '.') return;
     
-    EditorRow *row = &E.row[row_index];
-    int current_indent = getLineIndentation(row);
-    int new_indent = current_indent + indent_config.tab_width;
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (strcmp(dir, ".") == 0) strcpy(path, name);
+    else sprintf(path, "%s/%s", dir, name);
     
-    /* Insert spaces at beginning */
-    for (int i = 0; i < indent_config.tab_width; i++) {
-        editorRowInsertChar(row, current_indent + i, ' ');
+#ifdef EDE_UNIX
+    /* Windows listings always say */
+    if (is_dir < 0) {
+        struct stat st;
+        is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+#endif
+    if (grepIgnored(ignore, path, name, is_dir) ||
+        (job->index && indexFindPath(job->index, path + job->root_len) >= 0)) {
+        free(path);
+        return;
     }
+    grepPush(job, path, is_dir, ignore, size, mtime, 0);
 }
 
-void unindentLine(int row_index) {
-    if (row_index < 0 || row_index >= E.numrows) return;
+void grepListDir(GrepJob *job, GrepEntry *e) {
+    GrepIgnore *ignore = grepIgnoreLoad(job, e->path, e->ignore);
     
-    EditorRow *row = &E.row[row_index];
-    int current_indent = getLineIndentation(row);
-    int to_remove = (current_indent < indent_config.tab_width) ? 
-                    current_indent : indent_config.tab_width;
+#ifdef EDE_WINDOWS
+    WIN32_FIND_DATA find_data;
+    char search_path[MAX_PATH_LENGTH];
+    snprintf(search_path, sizeof(search_path), "%s/*", e->path);
     
-    for (int i = 0; i < to_remove; i++) {
-        if (row->size > 0 && (row->chars[0] == ' ' || row->chars[0] == '\t')) {
-            editorRowDelChar(row, 0);
-        }
+    HANDLE hFind = FindFirstFile(search_path, &find_data);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    
+    do {
+        int is_dir = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        long long size = ((long long)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+        long long mtime = ((long long)find_data.ftLastWriteTime[1] << 32) | find_data.ftLastWriteTime[0];
+        grepConsider(job, e->path, find_data.cFileName, is_dir, ignore, size, mtime);
+    } while (FindNextFile(hFind, &find_data));
+    
+    FindClose(hFind);
+#else
+    DIR *dir = opendir(e->path);
+    if (!dir) return;
+    
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        /* Links and special files are not followed */
+        if (entry->d_type == DT_DIR) grepConsider(job, e->path, entry->d_name, 1, ignore, -1, -1);
+        else if (entry->d_type == DT_REG) grepConsider(job, e->path, entry->d_name, 0, ignore, -1, -1);
+        else if (entry->d_type == DT_UNKNOWN) grepConsider(job, e->path, entry->d_name, -1, ignore, -1, -1);
     }
+    
+    closedir(dir);
+#endif
 }
 
-void indentSelection(void) {
-    /* For now, just indent current line */
-    indentLine(E.cy);
-    editorSetStatusMessage("Line indented");
+/* A worker's view of one file: a mapping, or its read buffer */
+typedef struct GrepFile {
+    char *data;
+    int size;
+    int mapped;
+} GrepFile;
+
+/* Load a whole file. Returns 0 if it is empty, unreadable or too big for
+   int offsets. */
+int grepLoad(const char *path, GrepFile *f, char **buf, int *buf_cap) {
+    f->data = NULL;
+    f->size = 0;
+    f->mapped = 0;
+#ifdef EDE_WINDOWS
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    DWORD high = 0;
+    DWORD n = GetFileSize(file, &high);
+    if (high == 0 && n > 0 && n < 0x7fffffff) {
+        if (n >= EDE_GREP_MAP_MIN) {
+            HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping) {
+                f->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                f->mapped = 1;
+                CloseHandle(mapping);
+            }
+        } else {
+            if ((int)n > *buf_cap) {
+                *buf_cap = n * 2;
+                *buf = realloc(*buf, *buf_cap);
+            }
+            DWORD got = 0;
+            if (ReadFile(file, *buf, n, &got, NULL) && got == n) f->data = *buf;
+        }
+        f->size = n;
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    off_t n = lseek(fd, 0, SEEK_END);
+    if (n > 0 && n < 0x7fffffff) {
+        if (n >= EDE_GREP_MAP_MIN) {
+            f->data = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (f->data == MAP_FAILED) f->data = NULL;
+            f->mapped = 1;
+        } else {
+            if (n > *buf_cap) {
+                *buf_cap = n * 2;
+                *buf = realloc(*buf, *buf_cap);
+            }
+            lseek(fd, 0, SEEK_SET);
+            ssize_t got = 0, r;
+            while (got < n && (r = read(fd, *buf + got, n - got)) > 0) got += r;
+            if (got == n) f->data = *buf;
+        }
+        f->size = n;
+    }
+    close(fd);
+#endif
+    return f->data != NULL;
 }
 
-void unindentSelection(void) {
-    unindentLine(E.cy);
-    editorSetStatusMessage("Line unindented");
+void grepUnload(GrepFile *f) {
+    if (!f->mapped) return;
+#ifdef EDE_WINDOWS
+    UnmapViewOfFile(f->data);
+#else
+    munmap(f->data, f->size);
+#endif
 }
 
-/*** Bracket Matching ***/
-
-typedef struct BracketPair {
-    char open;
-    char close;
-} BracketPair;
-
-BracketPair bracket_pairs[] = {
-    {'(', ')'},
-    {'[', ']'},
-    {'{', '}'},
-    {'<', '>'},
-};
-
-#define NUM_BRACKET_PAIRS (sizeof(bracket_pairs) / sizeof(BracketPair))
-
-int isBracket(char c, int *is_open, int *pair_index) {
-    for (int i = 0; i < NUM_BRACKET_PAIRS; i++) {
-        if (c == bracket_pairs[i].open) {
-            *is_open = 1;
-            *pair_index = i;
-            return 1;
+/* One result per matching line. Literals are searched through the whole
+   mapping and lines are only counted up to each match; a regex could
+   match across a newline, so it goes a line at a time. */
+void grepSearchFile(GrepJob *job, SearchPattern *sp, const char *path, char **buf, int *buf_cap) {
+    GrepFile file;
+    if (!grepLoad(path, &file, buf, buf_cap)) return;
+    char *data = file.data;
+    int size = file.size;
+    if (sp->use_regex) regexForget(&sp->regex);
+    
+    GrepResult *found = NULL;
+    int count = 0, cap = 0;
+    int probe = size < EDE_GREP_BINARY_PROBE ? size : EDE_GREP_BINARY_PROBE;
+    
+    if (!memchr(data, '\0', probe)) {
+        int line = 1, line_start = 0, pos = 0, len;
+        while (pos < size) {
+            int limit = size;
+            if (sp->use_regex) {
+                char *nl = memchr(data + pos, '\n', size - pos);
+                if (nl) limit = nl - data;
+            }
+            int at = searchPatternFind(sp, data, pos, limit, &len);
+            if (at < 0) {
+                if (!sp->use_regex) break;
+                pos = limit + 1;
+                line++;
+                line_start = pos;
+                continue;
+            }
+            for (char *p = data + pos; (p = memchr(p, '\n', data + at - p)) != NULL; p++) {
+                line++;
+                line_start = p - data + 1;
+            }
+            
+            char *nl = memchr(data + at, '\n', size - at);
+            int end = nl ? nl - data : size;
+            int text_len = end - line_start;
+            if (text_len > 0 && data[line_start + text_len - 1] == '\r') text_len--;
+            if (text_len > EDE_GREP_TEXT_MAX) text_len = EDE_GREP_TEXT_MAX;
+            
+            if (count == cap) {
+                cap = cap ? cap * 2 : 16;
+                found = realloc(found, sizeof(GrepResult) * cap);
+            }
+            GrepResult *r = &found[count++];
+            r->line = line;
+            r->col = at - line_start;
+            r->text = malloc(text_len + 1);
+            memcpy(r->text, data + line_start, text_len);
+            r->text[text_len] = '\0';
+            
+            pos = end + 1;
+            line++;
+            line_start = pos;
         }
-        if (c == bracket_pairs[i].close) {
-            *is_open = 0;
-            *pair_index = i;
-            return 1;
+    }
+    grepUnload(&file);
+    
+    spinLock(&job->lock);
+    if (count > 0) {
+        if (job->file_count == job->file_cap) {
+            job->file_cap = job->file_cap ? job->file_cap * 2 : 64;
+            job->files = realloc(job->files, sizeof(char *) * job->file_cap);
+        }
+        int file = job->file_count++;
+        job->files[file] = strdup(path);
+        
+        if (job->result_count + count > job->result_cap) {
+            while (job->result_count + count > job->result_cap)
+                job->result_cap = job->result_cap ? job->result_cap * 2 : 256;
+            job->results = realloc(job->results, sizeof(GrepResult) * job->result_cap);
+        }
+        for (int i = 0; i < count; i++) {
+            found[i].file = file;
+            job->results[job->result_count + i] = found[i];
         }
+        atomicStore(&job->result_count, job->result_count + count);
     }
-    return 0;
+    job->bytes += size;
+    job->searched++;
+    spinUnlock(&job->lock);
+    free(found);
 }
 
-int findMatchingBracket(int *match_row, int *match_col) {
-    if (E.cy >= E.numrows || E.cx >= E.row[E.cy].size) return 0;
-    
-    EditorRow *row = &E.row[E.cy];
-    char c = row->chars[E.cx];
-    
-    int is_open, pair_index;
-    if (!isBracket(c, &is_open, &pair_index)) return 0;
-    
-    char target = is_open ? bracket_pairs[pair_index].close : bracket_pairs[pair_index].open;
-    int direction = is_open ? 1 : -1;
-    int depth = 0;
+/* Path relative to the root the job was started at, "" for the root */
+const char *grepRelPath(GrepJob *job, const char *path) {
+    if ((int)strlen(path) < job->root_len || strcmp(path, ".") == 0) return "";
+    return path + job->root_len;
+}
+
+/* Record a file or directory for the index instead of searching it */
+void grepCollect(GrepJob *job, GrepEntry *e) {
+    if (e->mtime < 0 && grepStat(e->path, &e->size, &e->mtime) != 0) return;
     
-    int r = E.cy;
-    int col = E.cx;
+    spinLock(&job->lock);
+    if (job->listed_count == job->listed_cap) {
+        job->listed_cap = job->listed_cap ? job->listed_cap * 2 : 256;
+        job->listed = realloc(job->listed, sizeof(GrepEntry) * job->listed_cap);
+    }
+    GrepEntry *l = &job->listed[job->listed_count++];
+    *l = *e;
+    l->path = strdup(grepRelPath(job, e->path));
+    l->ignore = NULL;
+    spinUnlock(&job->lock);
+}
+
+/* Whether an entry from the index changed since it was recorded. A file
+   or directory that is gone has nothing left to search. */
+int grepChanged(GrepEntry *e) {
+    long long size, mtime;
+    if (grepStat(e->path, &size, &mtime) != 0) return 0;
+    return size != e->size || mtime != e->mtime;
+}
+
+/* The .gitignore rules in force in path, a directory under the root,
+   from the directories above it */
+GrepIgnore *grepIgnoreAbove(GrepJob *job, const char *path) {
+    char dir[MAX_PATH_LENGTH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    int len = strlen(dir);
+    if (!*grepRelPath(job, dir)) return NULL;
     
-    while (r >= 0 && r < E.numrows) {
-        EditorRow *erow = &E.row[r];
+    GrepIgnore *ig;
+    if (job->root_len == 0) {
+        ig = grepIgnoreLoad(job, ".", NULL);
+    } else {
+        dir[job->root_len - 1] = '\0';
+        ig = grepIgnoreLoad(job, dir, NULL);
+        dir[job->root_len - 1] = '/';
+    }
+    for (int i = job->root_len; i < len; i++) {
+        if (dir[i] != '/') continue;
+        dir[i] = '\0';
+        ig = grepIgnoreLoad(job, dir, ig);
+        dir[i] = '/';
+    }
+    return ig;
+}
+
+void *grepWorker(void *arg) {
+    GrepJob *job = arg;
+    SearchPattern sp;
+    int ok = !job->collect &&
+             searchPatternInit(&sp, job->pattern, job->ignore_case, job->use_regex) == NULL;
+    char *buf = NULL;
+    int buf_cap = 0;
+    
+    while (!atomicLoad(&job->cancel)) {
+        GrepEntry e;
+        int got = 0;
+        spinLock(&job->lock);
+        if (job->stack_count > 0) {
+            e = job->stack[--job->stack_count];
+            got = 1;
+        }
+        spinUnlock(&job->lock);
         
-        if (direction > 0) {
-            for (int i = col; i < erow->size; i++) {
-                if (erow->chars[i] == c) depth++;
-                else if (erow->chars[i] == target) {
-                    depth--;
-                    if (depth == 0) {
-                        *match_row = r;
-                        *match_col = i;
-                        return 1;
-                    }
-                }
-            }
-            r++;
-            col = 0;
-        } else {
-            for (int i = col; i >= 0; i--) {
-                if (erow->chars[i] == c) depth++;
-                else if (erow->chars[i] == target) {
-                    depth--;
-                    if (depth == 0) {
-                        *match_row = r;
-                        *match_col = i;
-                        return 1;
-                    }
-                }
-            }
-            r--;
-            if (r >= 0) col = E.row[r].size - 1;
+        if (!got) {
+            /* Empty for now, but an entry being listed may push more */
+            if (atomicLoad(&job->pending) == 0) break;
+            threadYield();
+            continue;
+        }
+        if (e.check && !grepChanged(&e)) {
+            /* as indexed */
+        } else if (e.is_dir) {
+            if (job->collect) grepCollect(job, &e);
+            if (e.check) e.ignore = grepIgnoreAbove(job, e.path);
+            grepListDir(job, &e);
+        } else if (job->collect) {
+            grepCollect(job, &e);
+        } else if (ok) {
+            grepSearchFile(job, &sp, e.path, &buf, &buf_cap);
         }
+        free(e.path);
+        atomicAdd(&job->pending, -1);
     }
     
-    return 0;
+    if (ok) searchPatternFree(&sp);
+    free(buf);
+    atomicAdd(&job->finished, 1);
+    return NULL;
+}
+
+/* Run the walk queued on job's stack on every thread, or on this one if
+   none will start */
+void grepStart(GrepJob *job) {
+    job->running = 1;
+    job->nthreads = 0;
+    for (int i = 0; i < threadCount(); i++) {
+        if (threadStart(&job->threads[job->nthreads], grepWorker, job) == 0) job->nthreads++;
+    }
+    if (job->nthreads == 0) grepWorker(job);
+}
+
+/* Wait for the workers and free the walk, keeping the results */
+void grepWait(GrepJob *job) {
+    if (!job->running) return;
+    for (int i = 0; i < job->nthreads; i++) threadJoin(&job->threads[i]);
+    job->nthreads = 0;
+    job->running = 0;
+    
+    for (int i = 0; i < job->stack_count; i++) free(job->stack[i].path);
+    free(job->stack);
+    job->stack = NULL;
+    job->stack_count = job->stack_cap = 0;
+    
+    while (job->ignores) {
+        GrepIgnore *ig = job->ignores;
+        job->ignores = ig->next;
+        for (int i = 0; i < ig->count; i++) free(ig->rules[i].glob);
+        free(ig->rules);
+        free(ig->base);
+        free(ig);
+    }
+    
+    if (job->index) {
+        indexClose(job->index);
+        free(job->index);
+        job->index = NULL;
+    }
+}
+
+void grepJoin(void) {
+    grepWait(&grep_job);
+}
+
+void grepClear(void) {
+    GrepJob *job = &grep_job;
+    atomicStore(&job->cancel, 1);
+    grepJoin();
+    for (int i = 0; i < job->result_count; i++) free(job->results[i].text);
+    for (int i = 0; i < job->file_count; i++) free(job->files[i]);
+    free(job->results);
+    free(job->files);
+    job->results = NULL;
+    job->files = NULL;
+    job->result_count = job->result_cap = 0;
+    job->file_count = job->file_cap = 0;
+    job->current = -1;
+}
+
+/* Start searching the tree under dir. Returns NULL, or why the pattern
+   does not compile. */
+const char *grepBegin(const char *pattern, const char *dir) {
+    GrepJob *job = &grep_job;
+    grepClear();
+    
+    int ignore_case = !searchCaseSensitive(pattern);
+    SearchPattern sp;
+    const char *error = searchPatternInit(&sp, pattern, ignore_case, search_ctx.use_regex);
+    if (error) return error;
+    searchPatternFree(&sp);
+    
+    snprintf(job->pattern, sizeof(job->pattern), "%s", pattern);
+    job->ignore_case = ignore_case;
+    job->use_regex = search_ctx.use_regex;
+    job->bytes = 0;
+    job->searched = 0;
+    job->pending = 0;
+    job->cancel = 0;
+    job->finished = 0;
+    job->shown = 0;
+    
+    char *root = strdup(dir);
+    int len = strlen(root);
+    while (len > 1 && root[len - 1] == '/') root[--len] = '\0';
+    /* With an index its candidates are queued, and the rest of what it
+       lists to be checked for changes; else the whole tree */
+    job->indexed = indexCandidates(job, root) >= 0;
+    if (job->indexed) free(root);
+    else grepPush(job, root, 1, NULL, -1, -1, 0);
+    
+    /* Always in the background, so results can be looked at early */
+    grepStart(job);
+    return NULL;
+}
+
+/* Called while idle: report progress, and the total once the workers are
+   done. Returns 1 if the status line changed. */
+int grepIdle(void) {
+    GrepJob *job = &grep_job;
+    if (!job->running) return 0;
+    
+    int count = atomicLoad(&job->result_count);
+    if (atomicLoad(&job->finished) < job->nthreads) {
+        if (count == job->shown) return 0;
+        job->shown = count;
+        editorSetStatusMessage("grep: %d matching line%s so far (:cn to go to them)",
+            count, count == 1 ? "" : "s");
+        return 1;
+    }
+    
+    grepJoin();
+    editorSetStatusMessage("grep: %d matching line%s in %d file%s, %d searched%s",
+        count, count == 1 ? "" : "s", job->file_count, job->file_count == 1 ? "" : "s",
+        job->searched, job->indexed ? " (from the index)" : "");
+    return 1;
 }
 
-void gotoMatchingBracket(void) {
-    int match_row, match_col;
-    if (findMatchingBracket(&match_row, &match_col)) {
-        E.cy = match_row;
-        E.cx = match_col;
-        editorSetStatusMessage("Jumped to matching bracket");
-    } else {
-        editorSetStatusMessage("No matching bracket found");
+/* Show path in the buffer unless it is there already. Unsaved changes
+   are never dropped. */
+int grepOpenFile(const char *path) {
+    if (E.filename && strcmp(E.filename, path) == 0) return 0;
+    if (E.dirty) {
+        editorSetStatusMessage("Unsaved changes! Use :w before moving to %s", path);
+        return -1;
     }
+    editorCloseBuffer();
+    editorOpen((char *)path);
+    return 0;
 }
 
-/*** File Browser ***/
+void grepGoto(int index) {
+    GrepJob *job = &grep_job;
+    GrepResult r;
+    char path[MAX_PATH_LENGTH];
+    char text[EDE_GREP_TEXT_MAX + 1];
+
+    /* Asked for a result the workers have not reached yet: wait for it */
+    while (job->running && index >= atomicLoad(&job->result_count) &&
+           atomicLoad(&job->finished) < job->nthreads) {
+        threadYield();
+    }
+
+    spinLock(&job->lock);
+    int count = job->result_count;
+    int ok = index >= 0 && index < count;
+    if (ok) {
+        r = job->results[index];
+        snprintf(path, sizeof(path), "%s", job->files[r.file]);
+        snprintf(text, sizeof(text), "%s", r.text);
+    }
+    spinUnlock(&job->lock);
+    
+    if (count == 0) {
+        editorSetStatusMessage(job->running ? "grep: no results yet" : "grep: no results");
+        return;
+    }
+    if (!ok) {
+        editorSetStatusMessage("grep: no %s results", index < 0 ? "previous" : "more");
+        return;
+    }
+    if (grepOpenFile(path) != 0) return;
+    
+    job->current = index;
+    E.cy = r.line - 1 < E.numrows ? r.line - 1 : E.numrows - 1;
+    if (E.cy < 0) E.cy = 0;
+    E.cx = (E.cy < E.numrows && r.col <= E.row[E.cy].size) ? r.col : 0;
+    E.rowoff = E.cy;
+    editorSetStatusMessage("(%d of %d%s) %s:%d: %s", index + 1, count,
+        job->running ? "+" : "", path, r.line, text);
+}
+
+/*** Project index ***/
+
+/* :index writes DIR/.ede_index, a trigram index of the files :grep would
+   search there: for every three-byte sequence, case folded, the list of
+   files that contain it. A :grep in that directory looks up the trigrams
+   its pattern cannot match without and searches only the files on all
+   of their lists, instead of walking and reading the whole tree.
+
+   The index is used in place (mapped when large). It holds a header, the
+   file table, the file ids in path order, the trigram table sorted by
+   trigram, and posting lists of delta-coded file ids. The file table
+   also lists the directories, with no postings. Running :index again
+   walks the tree but only reads files whose size or mtime changed,
+   carrying the postings of the rest over.
+
+   A :grep does not trust the index blindly: every file and directory it
+   lists is stat'ed on the thread pool. Files that changed since :index
+   are searched in full, and directories that changed are listed again
+   for the files and subdirectories the index has not seen, which are
+   searched or walked as without an index. */
+
+#define INDEX_MAGIC "EDEIDX2"
+#define INDEX_NAME ".ede_index"
+#define INDEX_BATCH 512            /* changed files trigrammed per round */
+#define INDEX_MAX_TRIGRAMS 256     /* looked up per query */
+#define INDEX_BINARY 1             /* IndexFileRec flags */
+#define INDEX_DIR 2
+
+typedef struct IndexHeader {
+    char magic[8];
+    uint32_t nfiles;
+    uint32_t ntrigrams;
+    uint64_t files_off;            /* IndexFileRec[nfiles] */
+    uint64_t order_off;            /* uint32_t[nfiles], file ids sorted by path */
+    uint64_t trigrams_off;         /* IndexTrigramRec[ntrigrams] */
+    uint64_t postings_off;
+    uint64_t paths_off;            /* NUL-terminated, relative to the root */
+    uint64_t end;
+} IndexHeader;
+
+typedef struct IndexFileRec {
+    uint64_t path;                 /* offset into the paths */
+    int64_t size;
+    int64_t mtime;
+    uint32_t flags;
+    uint32_t pad;
+} IndexFileRec;
+
+typedef struct IndexTrigramRec {
+    uint32_t trigram;
+    uint32_t count;                /* files on the list */
+    uint64_t offset;               /* into the postings */
+} IndexTrigramRec;
+
+typedef struct IndexView {
+    GrepFile file;
+    char *buf;
+    int buf_cap;
+    IndexHeader *header;
+    IndexFileRec *files;
+    uint32_t *order;
+    IndexTrigramRec *trigrams;
+    unsigned char *postings;
+    unsigned char *postings_end;
+    char *paths;
+} IndexView;
+
+void indexPath(char *out, int size, const char *root, const char *rel) {
+    if (!*rel) snprintf(out, size, "%s", root);
+    else if (strcmp(root, ".") == 0) snprintf(out, size, "%s", rel);
+    else snprintf(out, size, "%s/%s", root, rel);
+}
+
+void indexClose(IndexView *ix) {
+    grepUnload(&ix->file);
+    free(ix->buf);
+    memset(ix, 0, sizeof(IndexView));
+}
+
+/* Returns 0 if root has an index that looks sound. A truncated or
+   foreign file is treated as no index at all. */
+int indexOpen(const char *root, IndexView *ix) {
+    char path[MAX_PATH_LENGTH];
+    memset(ix, 0, sizeof(IndexView));
+    indexPath(path, sizeof(path), root, INDEX_NAME);
+    if (!grepLoad(path, &ix->file, &ix->buf, &ix->buf_cap)) {
+        free(ix->buf);
+        return -1;
+    }
+    
+    char *base = ix->file.data;
+    uint64_t size = ix->file.size;
+    IndexHeader *h = (IndexHeader *)base;
+    int ok = size >= sizeof(IndexHeader) && memcmp(h->magic, INDEX_MAGIC, 8) == 0 &&
+             h->end == size &&
+             h->files_off + (uint64_t)h->nfiles * sizeof(IndexFileRec) <= h->order_off &&
+             h->order_off + (uint64_t)h->nfiles * sizeof(uint32_t) <= h->trigrams_off &&
+             h->trigrams_off + (uint64_t)h->ntrigrams * sizeof(IndexTrigramRec) <= h->postings_off &&
+             h->postings_off <= h->paths_off && h->paths_off <= size &&
+             (size == h->paths_off || base[size - 1] == '\0');
+    if (!ok) {
+        indexClose(ix);
+        return -1;
+    }
+    ix->header = h;
+    ix->files = (IndexFileRec *)(base + h->files_off);
+    ix->order = (uint32_t *)(base + h->order_off);
+    ix->trigrams = (IndexTrigramRec *)(base + h->trigrams_off);
+    ix->postings = (unsigned char *)base + h->postings_off;
+    ix->postings_end = (unsigned char *)base + h->paths_off;
+    ix->paths = base + h->paths_off;
+    return 0;
+}
 
-#define MAX_FILE_ENTRIES 1000
-#define MAX_PATH_LENGTH 512
+const char *indexFilePath(IndexView *ix, int id) {
+    uint64_t off = ix->files[id].path;
+    return off < ix->header->end - ix->header->paths_off ? ix->paths + off : "";
+}
 
-typedef struct FileEntry {
-    char name[MAX_PATH_LENGTH];
-    char full_path[MAX_PATH_LENGTH];
-    int is_directory;
-    long size;
-} FileEntry;
+/* The id of the file at rel, or -1 */
+int indexFindPath(IndexView *ix, const char *rel) {
+    int lo = 0, hi = ix->header->nfiles - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        uint32_t id = ix->order[mid];
+        if (id >= ix->header->nfiles) return -1;
+        int cmp = strcmp(indexFilePath(ix, id), rel);
+        if (cmp == 0) return id;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
 
-typedef struct FileBrowser {
-    FileEntry entries[MAX_FILE_ENTRIES];
-    int count;
-    int selected;
-    int active;
-    char current_dir[MAX_PATH_LENGTH];
-} FileBrowser;
+IndexTrigramRec *indexFindTrigram(IndexView *ix, uint32_t trigram) {
+    int lo = 0, hi = ix->header->ntrigrams - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        uint32_t t = ix->trigrams[mid].trigram;
+        if (t == trigram) return &ix->trigrams[mid];
+        if (t < trigram) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+/* Posting lists are file ids in increasing order, each stored as the
+   difference from the one before in 7-bit groups, low group first */
+void indexPutVarint(unsigned char **data, int *len, int *cap, uint32_t v) {
+    if (*len + 5 > *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        *data = realloc(*data, *cap);
+    }
+    while (v >= 0x80) {
+        (*data)[(*len)++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    (*data)[(*len)++] = v;
+}
+
+/* Iterate a posting list: returns the next id, or -1 at its end */
+typedef struct IndexCursor {
+    const unsigned char *p;
+    const unsigned char *end;
+    int left;
+    uint32_t id;
+} IndexCursor;
+
+void indexCursorInit(IndexCursor *c, IndexView *ix, IndexTrigramRec *rec) {
+    uint64_t room = ix->postings_end - ix->postings;
+    c->p = ix->postings + (rec->offset < room ? rec->offset : room);
+    c->end = ix->postings_end;
+    c->left = rec->count;
+    c->id = 0;
+}
+
+int indexCursorNext(IndexCursor *c, IndexView *ix) {
+    if (c->left == 0) return -1;
+    uint32_t delta = 0;
+    int shift = 0;
+    while (c->p < c->end && shift < 35) {
+        unsigned char b = *c->p++;
+        delta |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80)) break;
+    }
+    c->left--;
+    c->id += delta;
+    if (c->id >= ix->header->nfiles) {
+        c->left = 0;
+        return -1;
+    }
+    return c->id;
+}
 
-FileBrowser file_browser = {0};
+uint32_t indexTrigram(const unsigned char *p) {
+    return (uint32_t)tolower(p[0]) << 16 | (uint32_t)tolower(p[1]) << 8 | tolower(p[2]);
+}
 
-#ifdef EDE_WINDOWS
-#include <direct.h>
-#define getcwd _getcwd
-#define chdir _chdir
-#else
-#include <dirent.h>
-#include <sys/stat.h>
-#endif
+/* Add the trigrams of a literal run to want, once each */
+void indexAddRun(const unsigned char *run, int len, uint32_t *want, int *nwant) {
+    for (int i = 0; i + 3 <= len && *nwant < INDEX_MAX_TRIGRAMS; i++) {
+        uint32_t t = indexTrigram(run + i);
+        int j;
+        for (j = 0; j < *nwant && want[j] != t; j++);
+        if (j == *nwant) want[(*nwant)++] = t;
+    }
+}
 
-void fileBrowserLoadDirectory(const char *path) {
-    file_browser.count = 0;
-    file_browser.selected = 0;
-    strncpy(file_browser.current_dir, path, MAX_PATH_LENGTH - 1);
-    
-#ifdef EDE_WINDOWS
-    WIN32_FIND_DATA find_data;
-    char search_path[MAX_PATH_LENGTH];
-    snprintf(search_path, sizeof(search_path), "%s\\*", path);
-    
-    HANDLE hFind = FindFirstFile(search_path, &find_data);
-    if (hFind == INVALID_HANDLE_VALUE) return;
-    
-    do {
-        if (file_browser.count >= MAX_FILE_ENTRIES) break;
-        
-        FileEntry *entry = &file_browser.entries[file_browser.count];
-        strncpy(entry->name, find_data.cFileName, MAX_PATH_LENGTH - 1);
-        snprintf(entry->full_path, MAX_PATH_LENGTH, "%s\\%s", path, find_data.cFileName);
-        entry->is_directory = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
-        entry->size = find_data.nFileSizeLow;
-        
-        file_browser.count++;
-    } while (FindNextFile(hFind, &find_data));
-    
-    FindClose(hFind);
-#else
-    DIR *dir = opendir(path);
-    if (!dir) return;
+/* The trigrams every match of the pattern contains. For a regex these
+   come from the runs of plain characters outside groups, classes and
+   optional atoms; an alternation at the top leaves none. */
+int indexPatternTrigrams(const char *pattern, int use_regex, uint32_t *want) {
+    int nwant = 0;
+    if (!use_regex) {
+        indexAddRun((const unsigned char *)pattern, strlen(pattern), want, &nwant);
+        return nwant;
+    }
     
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (file_browser.count >= MAX_FILE_ENTRIES) break;
-        
-        FileEntry *fe = &file_browser.entries[file_browser.count];
-        strncpy(fe->name, entry->d_name, MAX_PATH_LENGTH - 1);
-        snprintf(fe->full_path, MAX_PATH_LENGTH, "%s/%s", path, entry->d_name);
-        
-        struct stat st;
-        if (stat(fe->full_path, &st) == 0) {
-            fe->is_directory = S_ISDIR(st.st_mode);
-            fe->size = st.st_size;
+    unsigned char run[256];
+    int len = 0;
+    const char *p = pattern;
+    while (*p) {
+        int literal = 1;
+        unsigned char c = *p++;
+        if (c == '|') return 0;
+        if (c == '(') {
+            literal = 0;
+            for (int depth = 1; *p && depth > 0; p++) {
+                if (*p == '\\' && p[1]) p++;
+                else if (*p == '(') depth++;
+                else if (*p == ')') depth--;
+            }
+        } else if (c == '[') {
+            literal = 0;
+            if (*p == '^') p++;
+            if (*p == ']') p++;
+            while (*p && *p != ']') {
+                if (*p == '\\' && p[1]) p++;
+                p++;
+            }
+            if (*p) p++;
+        } else if (c == '.') {
+            literal = 0;
+        } else if (c == '\\' && *p) {
+            c = *p++;
+            if (c == 'd' || c == 'w' || c == 's') literal = 0;
+            else if (c == 't') c = '\t';
+            else if (c == 'n') c = '\n';
         }
         
-        file_browser.count++;
+        int optional = 0, repeated = 0;
+        for (; *p == '*' || *p == '+' || *p == '?'; p++) {
+            if (*p == '+') repeated = 1;
+            else optional = 1;
+        }
+        if (literal && !optional && len < (int)sizeof(run)) run[len++] = c;
+        if (!literal || optional || repeated) {
+            indexAddRun(run, len, want, &nwant);
+            len = 0;
+        }
     }
-    
-    closedir(dir);
-#endif
+    indexAddRun(run, len, want, &nwant);
+    return nwant;
 }
 
-void fileBrowserOpen(void) {
-    char cwd[MAX_PATH_LENGTH];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        fileBrowserLoadDirectory(cwd);
-        file_browser.active = 1;
-        editorSetStatusMessage("File browser (Enter=open, Esc=close, arrows=navigate)");
+int indexCompareCount(const void *a, const void *b) {
+    const IndexTrigramRec *x = *(IndexTrigramRec * const *)a;
+    const IndexTrigramRec *y = *(IndexTrigramRec * const *)b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+/* Queue what a search of root needs given its index: the files on the
+   lists of every trigram of job's pattern, and everything else the index
+   lists, to be searched or listed only if it changed. Returns how many
+   entries, or -1 when root has no index or the pattern no trigram to
+   look up, and the tree has to be walked. */
+int indexCandidates(GrepJob *job, const char *root) {
+    uint32_t want[INDEX_MAX_TRIGRAMS];
+    IndexTrigramRec *recs[INDEX_MAX_TRIGRAMS];
+    int nwant = indexPatternTrigrams(job->pattern, job->use_regex, want);
+    if (nwant == 0) return -1;
+    
+    IndexView *ix = malloc(sizeof(IndexView));
+    if (indexOpen(root, ix) != 0) {
+        free(ix);
+        return -1;
+    }
+    int nfiles = ix->header->nfiles;
+    int count = 0, id;
+    int *ids = NULL;
+    for (int i = 0; i < nwant; i++) {
+        recs[i] = indexFindTrigram(ix, want[i]);
+        if (!recs[i]) nwant = 0;    /* nothing indexed can match */
+    }
+    
+    /* Start from the shortest list and keep what every other one has */
+    if (nwant > 0) {
+        qsort(recs, nwant, sizeof(IndexTrigramRec *), indexCompareCount);
+        ids = malloc(sizeof(int) * (recs[0]->count + 1));
+        IndexCursor cur;
+        indexCursorInit(&cur, ix, recs[0]);
+        while ((id = indexCursorNext(&cur, ix)) >= 0) ids[count++] = id;
+    }
+    
+    for (int i = 1; i < nwant && count > 0; i++) {
+        int kept = 0;
+        IndexCursor cur;
+        indexCursorInit(&cur, ix, recs[i]);
+        id = indexCursorNext(&cur, ix);
+        for (int j = 0; j < count && id >= 0; j++) {
+            while (id >= 0 && id < ids[j]) id = indexCursorNext(&cur, ix);
+            if (id == ids[j]) ids[kept++] = id;
+        }
+        count = kept;
+    }
+    
+    /* ids is in increasing order */
+    for (int i = 0, j = 0; i < nfiles; i++) {
+        IndexFileRec *f = &ix->files[i];
+        char path[MAX_PATH_LENGTH];
+        indexPath(path, sizeof(path), root, indexFilePath(ix, i));
+        int candidate = j < count && ids[j] == i;
+        if (candidate) j++;
+        if (candidate && !(f->flags & INDEX_BINARY))
+            grepPush(job, strdup(path), 0, NULL, -1, -1, 0);
+        else
+            grepPush(job, strdup(path), (f->flags & INDEX_DIR) != 0, NULL, f->size, f->mtime, 1);
+    }
+    free(ids);
+    
+    /* Kept open while the walk runs, for the paths it already has */
+    job->index = ix;
+    job->root_len = strcmp(root, ".") == 0 ? 0 : strlen(root) + 1;
+    return nfiles;
+}
+
+/* Posting lists while building, in an open-addressed table by trigram */
+typedef struct IndexPosting {
+    uint32_t trigram;
+    int count;                     /* 0 for a free slot */
+    int last;                      /* last id added */
+    unsigned char *data;
+    int len;
+    int cap;
+} IndexPosting;
+
+typedef struct IndexTable {
+    IndexPosting *slots;
+    int cap;
+    int used;
+} IndexTable;
+
+IndexPosting *indexTableSlot(IndexPosting *slots, int cap, uint32_t trigram) {
+    unsigned int i = (unsigned int)((unsigned long long)trigram * 0x9E3779B97F4A7C15ull >> 40) & (cap - 1);
+    while (slots[i].count && slots[i].trigram != trigram) i = (i + 1) & (cap - 1);
+    return &slots[i];
+}
+
+/* Ids must arrive in increasing order for each trigram */
+void indexTableAdd(IndexTable *t, uint32_t trigram, int id) {
+    if (t->used * 2 >= t->cap) {
+        int cap = t->cap ? t->cap * 2 : 4096;
+        IndexPosting *slots = calloc(cap, sizeof(IndexPosting));
+        for (int i = 0; i < t->cap; i++) {
+            if (t->slots[i].count) *indexTableSlot(slots, cap, t->slots[i].trigram) = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->cap = cap;
     }
+    IndexPosting *p = indexTableSlot(t->slots, t->cap, trigram);
+    if (!p->count) {
+        p->trigram = trigram;
+        p->last = 0;
+        t->used++;
+    }
+    indexPutVarint(&p->data, &p->len, &p->cap, id - p->last);
+    p->last = id;
+    p->count++;
 }
 
-void fileBrowserClose(void) {
-    file_browser.active = 0;
+void indexTableFree(IndexTable *t) {
+    for (int i = 0; i < t->cap; i++) free(t->slots[i].data);
+    free(t->slots);
+    memset(t, 0, sizeof(IndexTable));
 }
 
-void fileBrowserNavigate(int direction) {
-    if (!file_browser.active) return;
+/* One round of reading changed files: workers claim files of the batch
+   and leave each one's distinct trigrams behind */
+typedef struct IndexBatch {
+    const char *root;
+    GrepEntry *files;
+    int count;
+    int next;                      /* next file to claim */
+    uint32_t **trigrams;           /* per file; NULL if binary or unreadable */
+    int *ntrigrams;
+    int *binary;
+} IndexBatch;
+
+void *indexWorker(void *arg) {
+    IndexBatch *b = arg;
+    unsigned char *seen = calloc(1 << 21, 1);   /* a bit per trigram */
+    char *buf = NULL;
+    int buf_cap = 0;
     
-    file_browser.selected += direction;
-    if (file_browser.selected < 0) file_browser.selected = 0;
-    if (file_browser.selected >= file_browser.count) {
-        file_browser.selected = file_browser.count - 1;
+    int i;
+    while ((i = atomicAdd(&b->next, 1) - 1) < b->count) {
+        char path[MAX_PATH_LENGTH];
+        GrepFile file;
+        indexPath(path, sizeof(path), b->root, b->files[i].path);
+        b->trigrams[i] = NULL;
+        b->ntrigrams[i] = 0;
+        b->binary[i] = 0;
+        if (b->files[i].is_dir || !grepLoad(path, &file, &buf, &buf_cap)) continue;
+        
+        const unsigned char *data = (const unsigned char *)file.data;
+        int size = file.size;
+        int probe = size < EDE_GREP_BINARY_PROBE ? size : EDE_GREP_BINARY_PROBE;
+        if (memchr(data, '\0', probe)) {
+            b->binary[i] = 1;
+        } else {
+            uint32_t *list = NULL;
+            int n = 0, cap = 0;
+            for (int k = 0; k + 3 <= size; k++) {
+                uint32_t t = indexTrigram(data + k);
+                if (seen[t >> 3] & (1 << (t & 7))) continue;
+                seen[t >> 3] |= 1 << (t & 7);
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    list = realloc(list, sizeof(uint32_t) * cap);
+                }
+                list[n++] = t;
+            }
+            for (int k = 0; k < n; k++) seen[list[k] >> 3] = 0;
+            b->trigrams[i] = list;
+            b->ntrigrams[i] = n;
+        }
+        grepUnload(&file);
     }
-}
-
-void fileBrowserSelect(void) {
-    if (!file_browser.active || file_browser.selected >= file_browser.count) return;
     
-    FileEntry *entry = &file_browser.entries[file_browser.selected];
+    free(seen);
+    free(buf);
+    return NULL;
+}
+
+int indexComparePath(const void *a, const void *b) {
+    return strcmp(((const GrepEntry *)a)->path, ((const GrepEntry *)b)->path);
+}
+
+int indexComparePosting(const void *a, const void *b) {
+    uint32_t x = (*(IndexPosting * const *)a)->trigram;
+    uint32_t y = (*(IndexPosting * const *)b)->trigram;
+    return (x > y) - (x < y);
+}
+
+void indexWriteAlign(FILE *fp, uint64_t *at) {
+    static const char zero[8] = {0};
+    int pad = (8 - (*at & 7)) & 7;
+    fwrite(zero, 1, pad, fp);
+    *at += pad;
+}
+
+/* Write the index of files (in id order) and postings t to a temporary
+   file and move it over the old one. Returns the size written, or -1. */
+long long indexWrite(const char *root, GrepEntry *files, int nfiles, const int *flags,
+                     IndexTable *t) {
+    char path[MAX_PATH_LENGTH], tmp[MAX_PATH_LENGTH + 8];
+    indexPath(path, sizeof(path), root, INDEX_NAME);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return -1;
+    
+    IndexPosting **lists = malloc(sizeof(IndexPosting *) * (t->used + 1));
+    int nlists = 0;
+    for (int i = 0; i < t->cap; i++) if (t->slots[i].count) lists[nlists++] = &t->slots[i];
+    qsort(lists, nlists, sizeof(IndexPosting *), indexComparePosting);
+    
+    /* The path order, for looking files up when the index is updated */
+    GrepEntry *by_path = malloc(sizeof(GrepEntry) * (nfiles + 1));
+    for (int i = 0; i < nfiles; i++) {
+        by_path[i].path = files[i].path;
+        by_path[i].size = i;
+    }
+    qsort(by_path, nfiles, sizeof(GrepEntry), indexComparePath);
+    
+    IndexHeader h = {0};
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.nfiles = nfiles;
+    h.ntrigrams = nlists;
+    uint64_t at = sizeof(IndexHeader);
+    fwrite(&h, sizeof(h), 1, fp);
+    
+    h.files_off = at;
+    uint64_t path_off = 0;
+    for (int i = 0; i < nfiles; i++) {
+        IndexFileRec rec = {0};
+        rec.path = path_off;
+        rec.size = files[i].size;
+        rec.mtime = files[i].mtime;
+        rec.flags = flags[i];
+        fwrite(&rec, sizeof(rec), 1, fp);
+        path_off += strlen(files[i].path) + 1;
+    }
+    at += (uint64_t)nfiles * sizeof(IndexFileRec);
+    
+    h.order_off = at;
+    for (int i = 0; i < nfiles; i++) {
+        uint32_t id = by_path[i].size;
+        fwrite(&id, sizeof(id), 1, fp);
+    }
+    at += (uint64_t)nfiles * sizeof(uint32_t);
+    indexWriteAlign(fp, &at);
+    
+    h.trigrams_off = at;
+    uint64_t post_off = 0;
+    for (int i = 0; i < nlists; i++) {
+        IndexTrigramRec rec;
+        rec.trigram = lists[i]->trigram;
+        rec.count = lists[i]->count;
+        rec.offset = post_off;
+        fwrite(&rec, sizeof(rec), 1, fp);
+        post_off += lists[i]->len;
+    }
+    at += (uint64_t)nlists * sizeof(IndexTrigramRec);
+    
+    h.postings_off = at;
+    for (int i = 0; i < nlists; i++) fwrite(lists[i]->data, 1, lists[i]->len, fp);
+    at += post_off;
+    
+    h.paths_off = at;
+    for (int i = 0; i < nfiles; i++) fwrite(files[i].path, 1, strlen(files[i].path) + 1, fp);
+    at += path_off;
+    h.end = at;
+    
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, fp);
+    int ok = !ferror(fp);
+    ok = (fclose(fp) == 0) && ok;
+    free(lists);
+    free(by_path);
     
-    if (entry->is_directory) {
-        if (strcmp(entry->name, ".") == 0) {
-            return;
-        } else if (strcmp(entry->name, "..") == 0) {
-            /* Go to parent directory */
-            char parent[MAX_PATH_LENGTH];
-            strncpy(parent, file_browser.current_dir, MAX_PATH_LENGTH - 1);
-            
-            char *last_slash = strrchr(parent, '/');
-            if (!last_slash) last_slash = strrchr(parent, '\\');
-            if (last_slash) *last_slash = '\0';
-            
-            fileBrowserLoadDirectory(parent);
-        } else {
-            chdir(entry->full_path);
-            fileBrowserLoadDirectory(entry->full_path);
+#ifdef EDE_WINDOWS
+    if (ok) remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return at;
+}
+
+typedef struct IndexStats {
+    int files;
+    int read;                      /* new or changed since the last index */
+    int trigrams;
+    long long bytes;               /* read */
+    long long size;                /* of the index */
+} IndexStats;
+
+/* Build or update root's index. Returns NULL, or why it failed. */
+const char *indexBuild(const char *dir, IndexStats *stats) {
+    char root[MAX_PATH_LENGTH];
+    snprintf(root, sizeof(root), "%s", *dir ? dir : ".");
+    int len = strlen(root);
+    while (len > 1 && root[len - 1] == '/') root[--len] = '\0';
+    memset(stats, 0, sizeof(IndexStats));
+    
+    /* mtimes are only as fine as a second: an entry changed from a second
+       before the walk on may change again without its mtime moving, so it
+       is recorded as changed, and every :grep looks at it until the next
+       :index (as git treats racily clean files) */
+    long long racy = (long long)time(NULL) - 1;
+#ifdef EDE_WINDOWS
+    racy = (racy + 11644473600LL) * 10000000LL;    /* as a FILETIME */
+#endif
+    
+    /* List every file :grep would search and every directory it would
+       walk, with their size and mtime */
+    GrepJob walk = {0};
+    walk.collect = 1;
+    walk.root_len = strcmp(root, ".") == 0 ? 0 : len + 1;
+    grepPush(&walk, strdup(root), 1, NULL, -1, -1, 0);
+    grepStart(&walk);
+    grepWait(&walk);
+    GrepEntry *listed = walk.listed;
+    int nlisted = walk.listed_count;
+    qsort(listed, nlisted, sizeof(GrepEntry), indexComparePath);
+    
+    /* Files unchanged since the old index keep their postings. They take
+       the first ids, in their old order, so the old lists carry over as
+       they are; new and changed files follow. */
+    IndexView old;
+    int have_old = indexOpen(root, &old) == 0;
+    int old_count = have_old ? old.header->nfiles : 0;
+    int *old_id = malloc(sizeof(int) * (nlisted + 1));
+    int *new_id = malloc(sizeof(int) * (old_count + 1));
+    for (int i = 0; i < old_count; i++) new_id[i] = -1;
+    for (int i = 0; i < nlisted; i++) {
+        old_id[i] = have_old ? indexFindPath(&old, listed[i].path) : -1;
+        if (old_id[i] >= 0 && (old.files[old_id[i]].size != listed[i].size ||
+                               old.files[old_id[i]].mtime != listed[i].mtime)) old_id[i] = -1;
+        if (old_id[i] >= 0) new_id[old_id[i]] = i;
+    }
+    
+    GrepEntry *files = malloc(sizeof(GrepEntry) * (nlisted + 1));
+    int *flags = calloc(nlisted + 1, sizeof(int));
+    int nfiles = 0;
+    for (int i = 0; i < old_count; i++) {
+        if (new_id[i] < 0) continue;
+        files[nfiles] = listed[new_id[i]];
+        flags[nfiles] = old.files[i].flags;
+        new_id[i] = nfiles++;
+    }
+    int first_read = nfiles;
+    for (int i = 0; i < nlisted; i++) {
+        if (old_id[i] < 0) {
+            if (listed[i].is_dir) flags[nfiles] = INDEX_DIR;
+            files[nfiles++] = listed[i];
+        }
+    }
+    
+    IndexTable table = {0};
+    if (have_old) {
+        for (uint32_t i = 0; i < old.header->ntrigrams; i++) {
+            IndexCursor cur;
+            int id;
+            indexCursorInit(&cur, &old, &old.trigrams[i]);
+            while ((id = indexCursorNext(&cur, &old)) >= 0) {
+                if (new_id[id] >= 0) indexTableAdd(&table, old.trigrams[i].trigram, new_id[id]);
+            }
+        }
+        indexClose(&old);
+    }
+    
+    IndexBatch batch = {0};
+    batch.root = root;
+    batch.trigrams = malloc(sizeof(uint32_t *) * INDEX_BATCH);
+    batch.ntrigrams = malloc(sizeof(int) * INDEX_BATCH);
+    batch.binary = malloc(sizeof(int) * INDEX_BATCH);
+    for (int start = first_read; start < nfiles; start += INDEX_BATCH) {
+        EdeThread threads[EDE_MAX_THREADS];
+        int nthreads = 0;
+        batch.files = files + start;
+        batch.count = nfiles - start < INDEX_BATCH ? nfiles - start : INDEX_BATCH;
+        batch.next = 0;
+        for (int i = 0; i < threadCount(); i++) {
+            if (threadStart(&threads[nthreads], indexWorker, &batch) == 0) nthreads++;
+        }
+        if (nthreads == 0) indexWorker(&batch);
+        for (int i = 0; i < nthreads; i++) threadJoin(&threads[i]);
+        
+        for (int i = 0; i < batch.count; i++) {
+            if (batch.binary[i]) flags[start + i] |= INDEX_BINARY;
+            if (!files[start + i].is_dir) {
+                stats->bytes += files[start + i].size;
+                stats->read++;
+            }
+            for (int k = 0; k < batch.ntrigrams[i]; k++)
+                indexTableAdd(&table, batch.trigrams[i][k], start + i);
+            free(batch.trigrams[i]);
         }
-    } else {
-        /* Open file */
-        editorOpen(entry->full_path);
-        fileBrowserClose();
-        editorSetStatusMessage("Opened %s", entry->name);
     }
+    
+    for (int i = 0; i < nfiles; i++) {
+        if (!(flags[i] & INDEX_DIR)) stats->files++;
+        if (files[i].mtime >= racy) files[i].mtime = -1;
+    }
+    stats->trigrams = table.used;
+    stats->size = indexWrite(root, files, nfiles, flags, &table);
+    
+    indexTableFree(&table);
+    free(batch.trigrams);
+    free(batch.ntrigrams);
+    free(batch.binary);
+    for (int i = 0; i < nlisted; i++) free(listed[i].path);
+    free(listed);
+    free(files);
+    free(flags);
+    free(old_id);
+    free(new_id);
+    return stats->size < 0 ? "can't write " INDEX_NAME : NULL;
 }
 
 /*** Git Integration ***/
@@ -3491,6 +9299,10 @@ void sessionSave(const char *session_name) {
 }
 
 void sessionLoad(const char *session_name) {
+    if (E.dirty) {
+        editorSetStatusMessage("Unsaved changes! Use :w before loading a session");
+        return;
+    }
     char path[MAX_PATH_LENGTH];
     snprintf(path, sizeof(path), ".ede_session_%s", session_name);
     
@@ -3506,6 +9318,7 @@ void sessionLoad(const char *session_name) {
             char filename[MAX_PATH_LENGTH];
             int cx, cy;
             if (sscanf(line + 5, "%[^:]:%d:%d", filename, &cx, &cy) == 3) {
+                editorCloseBuffer();
                 editorOpen(filename);
                 E.cx = cx;
                 E.cy = cy;
@@ -3518,6 +9331,119 @@ void sessionLoad(const char *session_name) {
     editorSetStatusMessage("Session loaded: %s", session_name);
 }
 
+/*** Gutter ***/
+
+/* Gutter layout: [sign][line number][fold marker][space]. The width only
+   changes when E.numrows crosses a power of ten, so it is cached along
+   with the row-count range it is valid for. */
+
+typedef struct Gutter {
+    char *signs;
+    char *folds;
+    int cap;
+} Gutter;
+
+Gutter gutters[2] = {{0}}; /* marks for each split pane */
+
+const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Write v right-aligned in a field of width bytes, two digits per step */
+void formatUintRight(char *dst, int width, unsigned int v) {
+    char *p = dst + width;
+    while (v >= 100) {
+        unsigned int q = v / 100;
+        p -= 2;
+        memcpy(p, &digit_pairs[(v - q * 100) * 2], 2);
+        v = q;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[v * 2], 2);
+    } else {
+        *--p = '0' + v;
+    }
+    while (p > dst) *--p = ' ';
+}
+
+void gutterInvalidate(void) {
+    E.gutter_lo = 0;
+    E.gutter_hi = 0;
+}
+
+void gutterUpdateWidth(void) {
+    if (!E.show_line_numbers) {
+        E.gutter_width = 0;
+        return;
+    }
+    if (E.numrows >= E.gutter_lo && E.numrows < E.gutter_hi) return;
+    
+    int digits = 1;
+    int lo = 0, hi = 10;
+    while (E.numrows >= hi && hi <= 100000000) {
+        lo = hi;
+        hi *= 10;
+        digits++;
+    }
+    if (digits < 3) digits = 3;
+    E.gutter_lo = lo;
+    E.gutter_hi = hi;
+    E.gutter_width = digits + 3;
+}
+
+/* Collect bookmark, diagnostic and fold marks for the visible rows once
+   per frame, so drawing a row never scans the managers. */
+void gutterPrepare(Gutter *gutter, int rowoff, int rows) {
+    if (rows > gutter->cap) {
+        gutter->signs = realloc(gutter->signs, rows);
+        gutter->folds = realloc(gutter->folds, rows);
+        gutter->cap = rows;
+    }
+    memset(gutter->signs, ' ', rows);
+    memset(gutter->folds, ' ', rows);
+    
+    for (int i = 0; i < bookmark_manager.count; i++) {
+        int y = bookmark_manager.bookmarks[i].row - rowoff;
+        if (y >= 0 && y < rows) gutter->signs[y] = '*';
+    }
+    
+    /* Diagnostics win over bookmarks; the most severe one is shown */
+    for (int i = 0; i < lsp_client.diagnostic_count; i++) {
+        LSPDiagnostic *d = &lsp_client.diagnostics[i];
+        int y = d->line - rowoff;
+        if (y < 0 || y >= rows || d->severity < 1 || d->severity > 4) continue;
+        char sign = "EWIH"[d->severity - 1];
+        char *cur = strchr("EWIH", gutter->signs[y]);
+        if (!cur || cur > strchr("EWIH", sign)) gutter->signs[y] = sign;
+    }
+    
+    for (int i = 0; i < fold_manager.count; i++) {
+        int y = fold_manager.folds[i].start_row - rowoff;
+        if (y >= 0 && y < rows) gutter->folds[y] = fold_manager.folds[i].folded ? '+' : '-';
+    }
+}
+
+void editorDrawGutter(StringBuffer *sb, Gutter *gutter, int filerow, int y, int cy) {
+    char buf[16];
+    int width = E.gutter_width;
+    int digits = width - 3;
+    unsigned int num = filerow + 1;
+    
+    if (E.relative_line_numbers && filerow != cy)
+        num = (filerow > cy) ? filerow - cy : cy - filerow;
+    
+    buf[0] = gutter->signs[y];
+    formatUintRight(&buf[1], digits, num);
+    buf[digits + 1] = gutter->folds[y];
+    buf[digits + 2] = ' ';
+    
+    sbAppend(sb, theme.seq[COLOR_LINENR], theme.seq_len[COLOR_LINENR]);
+    sbAppend(sb, buf, width);
+    sbAppend(sb, theme.seq[COLOR_NORMAL], theme.seq_len[COLOR_NORMAL]);
+}
+
 /*** VIM mode ***/
 
 void executeVimCommand(const char *cmd) {
@@ -3540,12 +9466,10 @@ void executeVimCommand(const char *cmd) {
             editorSetStatusMessage("Warning: unsaved changes! Use :q! to force quit");
             return;
         }
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
+        editorClearScreen();
         exit(0);
     } else if (strcmp(cmd, "q!") == 0 || strcmp(cmd, "quit!") == 0) {
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
+        editorClearScreen();
         exit(0);
     }
     
@@ -3558,8 +9482,7 @@ void executeVimCommand(const char *cmd) {
         }
     } else if (strcmp(cmd, "wq") == 0 || strcmp(cmd, "x") == 0) {
         if (editorSave() == 0) {
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            editorClearScreen();
             exit(0);
         } else {
             editorSetStatusMessage("Error saving file");
@@ -3586,6 +9509,7 @@ void executeVimCommand(const char *cmd) {
             editorSetStatusMessage("Unsaved changes! Use :e! to force or :w to save first");
             return;
         }
+        editorCloseBuffer();
         editorOpen((char*)filename);
         editorSetStatusMessage("Opened: %s", filename);
     }
@@ -3597,11 +9521,14 @@ void executeVimCommand(const char *cmd) {
         if (*query) {
             strncpy(search_ctx.query, query, sizeof(search_ctx.query) - 1);
             search_ctx.query_len = strlen(query);
-            search_ctx.case_sensitive = 1;
-            findAllMatches();
-            if (search_ctx.match_count > 0) {
-                gotoNextMatch();
-                editorSetStatusMessage("Found %d matches for '%s'", search_ctx.match_count, query);
+            search_ctx.case_sensitive = searchCaseSensitive(query);
+            const char *error = searchBegin();
+            if (error) {
+                editorSetStatusMessage("Bad pattern: %s", error);
+            } else if (gotoNextMatch()) {
+                if (!search_job.running) {
+                    editorSetStatusMessage("Found %d matches for '%s'", search_ctx.match_count, query);
+                }
             } else {
                 editorSetStatusMessage("Pattern not found: %s", query);
             }
@@ -3612,11 +9539,14 @@ void executeVimCommand(const char *cmd) {
         if (*query) {
             strncpy(search_ctx.query, query, sizeof(search_ctx.query) - 1);
             search_ctx.query_len = strlen(query);
-            search_ctx.case_sensitive = 1;
-            findAllMatches();
-            if (search_ctx.match_count > 0) {
-                gotoPrevMatch();
-                editorSetStatusMessage("Found %d matches for '%s'", search_ctx.match_count, query);
+            search_ctx.case_sensitive = searchCaseSensitive(query);
+            const char *error = searchBegin();
+            if (error) {
+                editorSetStatusMessage("Bad pattern: %s", error);
+            } else if (gotoPrevMatch()) {
+                if (!search_job.running) {
+                    editorSetStatusMessage("Found %d matches for '%s'", search_ctx.match_count, query);
+                }
             } else {
                 editorSetStatusMessage("Pattern not found: %s", query);
             }
@@ -3640,12 +9570,11 @@ void executeVimCommand(const char *cmd) {
                 search_ctx.query_len = strlen(old_text);
                 strncpy(search_ctx.replace_text, new_text, sizeof(search_ctx.replace_text) - 1);
                 search_ctx.replace_len = strlen(new_text);
-                search_ctx.case_sensitive = 1;
+                search_ctx.case_sensitive = searchCaseSensitive(old_text);
                 findAllMatches();
                 
                 if (search_ctx.match_count > 0) {
                     replaceAllMatches();
-                    editorSetStatusMessage("Replaced %d occurrences", search_ctx.match_count);
                 } else {
                     editorSetStatusMessage("Pattern not found: %s", old_text);
                 }
@@ -3656,10 +9585,123 @@ void executeVimCommand(const char *cmd) {
     /* Line number display */
     else if (strcmp(cmd, "set nu") == 0 || strcmp(cmd, "set number") == 0) {
         E.show_line_numbers = 1;
+        gutterInvalidate();
         editorSetStatusMessage("Line numbers enabled");
     } else if (strcmp(cmd, "set nonu") == 0 || strcmp(cmd, "set nonumber") == 0) {
         E.show_line_numbers = 0;
         editorSetStatusMessage("Line numbers disabled");
+    } else if (strcmp(cmd, "set rnu") == 0 || strcmp(cmd, "set relativenumber") == 0) {
+        E.relative_line_numbers = 1;
+        editorSetStatusMessage("Relative line numbers enabled");
+    } else if (strcmp(cmd, "set nornu") == 0 || strcmp(cmd, "set norelativenumber") == 0) {
+        E.relative_line_numbers = 0;
+        editorSetStatusMessage("Relative line numbers disabled");
+    } else if (strcmp(cmd, "set rainbow") == 0) {
+        E.rainbow_brackets = 1;
+        editorSetStatusMessage("Rainbow brackets enabled");
+    } else if (strcmp(cmd, "set regex") == 0) {
+        search_ctx.use_regex = 1;
+        editorSetStatusMessage("Searches use regular expressions");
+    } else if (strcmp(cmd, "set noregex") == 0) {
+        search_ctx.use_regex = 0;
+        editorSetStatusMessage("Searches match literally");
+    } else if (strcmp(cmd, "set ic") == 0 || strcmp(cmd, "set ignorecase") == 0) {
+        search_ctx.ignore_case = 1;
+        editorSetStatusMessage("Searches ignore case");
+    } else if (strcmp(cmd, "set noic") == 0 || strcmp(cmd, "set noignorecase") == 0) {
+        search_ctx.ignore_case = 0;
+        editorSetStatusMessage("Searches match case");
+    } else if (strcmp(cmd, "set scs") == 0 || strcmp(cmd, "set smartcase") == 0) {
+        search_ctx.smart_case = 1;
+        editorSetStatusMessage("Queries with upper case match case");
+    } else if (strcmp(cmd, "set noscs") == 0 || strcmp(cmd, "set nosmartcase") == 0) {
+        search_ctx.smart_case = 0;
+        editorSetStatusMessage("Smart case disabled");
+    } else if (strcmp(cmd, "noh") == 0 || strcmp(cmd, "nohlsearch") == 0) {
+        searchFinish();
+        freeSearchMatches();
+    } else if (strcmp(cmd, "set norainbow") == 0) {
+        E.rainbow_brackets = 0;
+        editorSetStatusMessage("Rainbow brackets disabled");
+    }
+    
+    /* Split views */
+    else if (strcmp(cmd, "split") == 0 || strcmp(cmd, "sp") == 0) {
+        splitHorizontal();
+    } else if (strcmp(cmd, "vsplit") == 0 || strcmp(cmd, "vs") == 0) {
+        splitVertical();
+    } else if (strcmp(cmd, "close") == 0 || strcmp(cmd, "only") == 0) {
+        splitClose();
+    }
+    
+    /* Themes */
+    else if (strcmp(cmd, "theme default") == 0) {
+        themeLoadDefaults(&theme);
+        editorSetStatusMessage("Default theme restored");
+    } else if (strncmp(cmd, "theme ", 6) == 0) {
+        int rc = themeLoad(cmd + 6);
+        if (rc == 0) {
+            editorSetStatusMessage("Theme loaded: %s", cmd + 6);
+        } else if (rc == -1) {
+            editorSetStatusMessage("Cannot open theme: %s", cmd + 6);
+        }
+    }
+    
+    /* Syntax definitions */
+    else if (strncmp(cmd, "syntax ", 7) == 0) {
+        int rc = syntaxLoadFile(cmd + 7);
+        if (rc == 0) {
+            editorSelectSyntaxHighlight();
+            editorSetStatusMessage("Syntax loaded: %s", cmd + 7);
+        } else if (rc == -1) {
+            editorSetStatusMessage("Cannot open syntax file: %s", cmd + 7);
+        }
+    }
+    
+    /* Project search: :grep pattern [dir], :grep "two words" [dir] */
+    else if (strncmp(cmd, "grep ", 5) == 0) {
+        char pattern[256];
+        const char *p = cmd + 5;
+        int len = 0;
+        while (*p == ' ') p++;
+        if (*p == '"' && strchr(p + 1, '"')) {
+            const char *close = strchr(p + 1, '"');
+            len = close - p - 1;
+            if (len >= (int)sizeof(pattern)) len = sizeof(pattern) - 1;
+            memcpy(pattern, p + 1, len);
+            p = close + 1;
+        } else {
+            while (p[len] && p[len] != ' ' && len < (int)sizeof(pattern) - 1) len++;
+            memcpy(pattern, p, len);
+            p += len;
+        }
+        pattern[len] = '\0';
+        while (*p == ' ') p++;
+        
+        if (len == 0) {
+            editorSetStatusMessage("Usage: :grep pattern [dir]");
+        } else {
+            const char *error = grepBegin(pattern, *p ? p : ".");
+            if (error) editorSetStatusMessage("Bad pattern: %s", error);
+            else editorSetStatusMessage("grep: searching %s for '%s'", *p ? p : ".", pattern);
+        }
+    } else if (strcmp(cmd, "index") == 0 || strncmp(cmd, "index ", 6) == 0) {
+        IndexStats stats;
+        const char *dir = cmd + 5;
+        while (*dir == ' ') dir++;
+        if (!*dir) dir = ".";
+        editorSetStatusMessage("index: reading %s...", dir);
+        editorRefreshScreen();
+        const char *error = indexBuild(dir, &stats);
+        if (error) editorSetStatusMessage("index: %s", error);
+        else editorSetStatusMessage("index: %d files (%d read), %d trigrams, %.1f MB",
+            stats.files, stats.read, stats.trigrams, stats.size / (1024.0 * 1024));
+    } else if (strcmp(cmd, "cn") == 0 || strcmp(cmd, "cnext") == 0) {
+        grepGoto(grep_job.current + 1);
+    } else if (strcmp(cmd, "cp") == 0 || strcmp(cmd, "cprevious") == 0) {
+        grepGoto(grep_job.current - 1);
+    } else if (strcmp(cmd, "cc") == 0 || strncmp(cmd, "cc ", 3) == 0) {
+        grepGoto(cmd[2] ? atoi(cmd + 3) - 1 : (grep_job.current > 0 ? grep_job.current : 0));
     }
     
     /* Help */
@@ -3676,6 +9718,10 @@ void executeVimCommand(const char *cmd) {
 /*** Output ***/
 
 void editorScroll(void) {
+    Pane panes[2];
+    int count = editorLayoutPanes(panes);
+    Pane *pane = &panes[count == 2 ? split.focus : 0];
+    
     E.rx = 0;
     if (E.cy < E.numrows) {
         E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
@@ -3684,65 +9730,210 @@ void editorScroll(void) {
     if (E.cy < E.rowoff) {
         E.rowoff = E.cy;
     }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
+    if (E.cy >= E.rowoff + pane->rows) {
+        E.rowoff = E.cy - pane->rows + 1;
+    }
+    gutterUpdateWidth();
+    int textcols = pane->cols - (E.gutter_width < pane->cols ? E.gutter_width : 0);
+    if (textcols < 1) textcols = 1;
+    
+    /* Edits made in the focused pane can leave the other one past EOF */
+    if (count == 2) {
+        Pane *other = &panes[!split.focus];
+        if (split.cy2 > E.numrows) split.cy2 = E.numrows;
+        if (split.cy2 < split.rowoff2) split.rowoff2 = split.cy2;
+        if (split.cy2 >= split.rowoff2 + other->rows) split.rowoff2 = split.cy2 - other->rows + 1;
     }
+    
     if (E.rx < E.coloff) {
         E.coloff = E.rx;
     }
-    if (E.rx >= E.coloff + E.screencols) {
-        E.coloff = E.rx - E.screencols + 1;
+    if (E.rx >= E.coloff + textcols) {
+        E.coloff = E.rx - textcols + 1;
     }
 }
 
-void editorDrawRows(StringBuffer *sb) {
-    int y;
-    for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows / 3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                    "GNU ede v%s -- A nano-like editor", EDE_VERSION);
-                if (welcomelen > E.screencols) welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    sbAppend(sb, "~", 1);
-                    padding--;
-                }
-                while (padding--) sbAppend(sb, " ", 1);
-                sbAppend(sb, welcome, welcomelen);
-            } else {
+void sbAppendSpaces(StringBuffer *sb, int count) {
+    static const char spaces[] = "                                ";
+    while (count > 0) {
+        int n = count < (int)sizeof(spaces) - 1 ? count : (int)sizeof(spaces) - 1;
+        sbAppend(sb, spaces, n);
+        count -= n;
+    }
+}
+
+/* Draw row y of a pane. Both panes read the same E.row render/hl data, so
+   a split costs only the extra bytes on screen. When pad is set the row is
+   filled with spaces to the pane width, because erase-to-EOL would also
+   clear the pane on its right. */
+void editorDrawPaneRow(StringBuffer *sb, Pane *pane, Gutter *gutter, int y, int pad) {
+    int filerow = y + pane->rowoff;
+    int width = 0;
+    
+    if (filerow >= E.numrows) {
+        if (E.numrows == 0 && y == pane->rows / 3) {
+            char welcome[80];
+            int welcomelen = snprintf(welcome, sizeof(welcome),
+                "GNU ede v%s -- A nano-like editor", EDE_VERSION);
+            if (welcomelen > pane->cols) welcomelen = pane->cols;
+            int padding = (pane->cols - welcomelen) / 2;
+            if (padding) {
                 sbAppend(sb, "~", 1);
+                padding--;
+                width++;
             }
+            sbAppendSpaces(sb, padding);
+            sbAppend(sb, welcome, welcomelen);
+            width += padding + welcomelen;
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
+            sbAppend(sb, "~", 1);
+            width = 1;
+        }
+    } else {
+        int textcols = pane->cols;
+        if (E.gutter_width && E.gutter_width < pane->cols) {
+            editorDrawGutter(sb, gutter, filerow, y, pane->cy);
+            textcols -= E.gutter_width;
+            width = E.gutter_width;
+        }
+        
+        EditorRow *row = &E.row[filerow];
+        int len = row->rsize - pane->coloff;
+        if (len < 0) len = 0;
+        if (len > textcols) len = textcols;
+        
+        char *c = &row->render[pane->coloff];
+        
+        if (row->hl_in_comment < 0) {
+            /* Not highlighted yet: draw it plain */
+            sbAppend(sb, c, len);
+        } else {
+            unsigned char *hl = &row->hl[pane->coloff];
+            int current = COLOR_NORMAL;
+            int run = 0;
+            int depth = 0;
             int j;
+            OverlayRow *ov = overlayRow(filerow);
+            int span = 0;
+            
+            if (E.rainbow_brackets) {
+                /* Rows are drawn top to bottom, so the depth usually
+                   carries over from the row above */
+                BracketSummary *bs = bracketRowSummary(row);
+                depth = (filerow == pane->depth_row) ? pane->depth : bracketDepthBefore(filerow);
+                pane->depth_row = filerow + 1;
+                pane->depth = depth + bs->delta[0] + bs->delta[1] + bs->delta[2];
+                for (j = 0; j < pane->coloff && j < row->rsize; j++) {
+                    if (charIs(row->render[j], CHAR_BRACKET) && bracketInCode(row->hl, j))
+                        bracketRainbowClass(row->render[j], &depth);
+                }
+            }
+            
+            /* Copy runs of one class at a time, switching with the
+               theme's precompiled sequence */
             for (j = 0; j < len; j++) {
-                if (hl[j] == COLOR_NORMAL) {
-                    if (current_color != -1) {
-                        sbAppend(sb, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    sbAppend(sb, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        sbAppend(sb, buf, clen);
-                    }
-                    sbAppend(sb, &c[j], 1);
+                int h = hl[j];
+                if (E.rainbow_brackets && charIs(c[j], CHAR_BRACKET) && bracketInCode(hl, j))
+                    h = bracketRainbowClass(c[j], &depth);
+                if (ov) {
+                    int x = pane->coloff + j;
+                    while (span < ov->count && ov->spans[2 * span + 1] <= x) span++;
+                    if (span < ov->count && ov->spans[2 * span] <= x) h = COLOR_MATCH;
+                }
+                h = theme.canon[h];
+                if (h != current) {
+                    sbAppend(sb, &c[run], j - run);
+                    if (current == COLOR_MATCH && !theme.full) sbAppend(sb, "\x1b[m", 3);
+                    sbAppend(sb, theme.seq[h], theme.seq_len[h]);
+                    current = h;
+                    run = j;
                 }
             }
-            sbAppend(sb, "\x1b[39m", 5);
+            sbAppend(sb, &c[run], len - run);
+            if (current == COLOR_MATCH && !theme.full) sbAppend(sb, "\x1b[m", 3);
+            if (current != COLOR_NORMAL)
+                sbAppend(sb, theme.seq[COLOR_NORMAL], theme.seq_len[COLOR_NORMAL]);
+        }
+        width += len;
+    }
+    
+    if (pad && width < pane->cols) sbAppendSpaces(sb, pane->cols - width);
+}
+
+/* One line of the Ctrl-O list; index 0 is the best */
+void finderDrawRow(StringBuffer *sb, int index) {
+    FinderHit *hit = &finder.best[index];
+    EditorRow *row = &E.row[hit->row];
+    int pos[EDE_FINDER_MAX_QUERY];
+    char num[16];
+    finderScore(row, pos);
+    
+    int digits = snprintf(num, sizeof(num), "%d", E.numrows);
+    int nlen = snprintf(num, sizeof(num), "%*d ", digits, hit->row + 1);
+    int width = E.screencols - 2 - nlen;
+    if (width <= 0) return;
+    
+    sbAppend(sb, index == finder.selected ? "> " : "  ", 2);
+    sbAppend(sb, theme.seq[COLOR_LINENR], theme.seq_len[COLOR_LINENR]);
+    sbAppend(sb, num, nlen);
+    sbAppend(sb, theme.seq[COLOR_NORMAL], theme.seq_len[COLOR_NORMAL]);
+    
+    /* Shift long lines left so that the last match shows */
+    int start = 0, end = row->rsize, k = 0;
+    if (pos[finder.len - 1] >= width) start = pos[finder.len - 1] - width + 1;
+    if (start > pos[0]) start = pos[0];
+    if (end > start + width) end = start + width;
+    while (k < finder.len && pos[k] < start) k++;
+    
+    for (int i = start; i < end; i++) {
+        unsigned char c = row->render[i];
+        if (iscntrl(c)) c = '?';
+        if (k < finder.len && pos[k] == i) {
+            sbAppend(sb, theme.seq[COLOR_MATCH], theme.seq_len[COLOR_MATCH]);
+            sbAppend(sb, (char *)&c, 1);
+            if (!theme.full) sbAppend(sb, "\x1b[m", 3);
+            sbAppend(sb, theme.seq[COLOR_NORMAL], theme.seq_len[COLOR_NORMAL]);
+            k++;
+        } else {
+            sbAppend(sb, (char *)&c, 1);
+        }
+    }
+}
+
+void editorDrawRows(StringBuffer *sb) {
+    Pane panes[2];
+    int count = editorLayoutPanes(panes);
+    int y;
+    
+    for (int i = 0; i < count; i++) {
+        editorSyntaxPrepareView(i, panes[i].rowoff, panes[i].rowoff + panes[i].rows);
+        if (E.gutter_width) gutterPrepare(&gutters[i], panes[i].rowoff, panes[i].rows);
+    }
+    if (E.rainbow_brackets) bracketIndexSync();
+    overlayPrepare();
+    
+    int list = finderListRows();
+    
+    sbAppend(sb, theme.seq[COLOR_NORMAL], theme.seq_len[COLOR_NORMAL]);
+    for (y = 0; y < E.screenrows; y++) {
+        if (y >= E.screenrows - list) {
+            finderDrawRow(sb, E.screenrows - 1 - y);
+        } else if (count == 1) {
+            editorDrawPaneRow(sb, &panes[0], &gutters[0], y, 0);
+        } else if (split.vertical) {
+            editorDrawPaneRow(sb, &panes[0], &gutters[0], y, 1);
+            sbAppend(sb, theme.seq[COLOR_LINENR], theme.seq_len[COLOR_LINENR]);
+            sbAppend(sb, "|", 1);
+            sbAppend(sb, theme.seq[COLOR_NORMAL], theme.seq_len[COLOR_NORMAL]);
+            editorDrawPaneRow(sb, &panes[1], &gutters[1], y, 0);
+        } else if (y < panes[0].rows) {
+            editorDrawPaneRow(sb, &panes[0], &gutters[0], y, 0);
+        } else if (y < panes[1].top) {
+            sbAppend(sb, theme.seq[COLOR_LINENR], theme.seq_len[COLOR_LINENR]);
+            for (int x = 0; x < E.screencols; x++) sbAppend(sb, "-", 1);
+            sbAppend(sb, theme.seq[COLOR_NORMAL], theme.seq_len[COLOR_NORMAL]);
+        } else {
+            editorDrawPaneRow(sb, &panes[1], &gutters[1], y - panes[1].top, 0);
         }
         
         sbAppend(sb, "\x1b[K", 3);
@@ -3793,16 +9984,21 @@ void editorDrawMessageBar(StringBuffer *sb) {
 }
 
 void editorRefreshScreen(void) {
+    long long start = E.headless ? editorNowNs() : 0;
+    
     editorScroll();
     
-    StringBuffer sb = STRBUF_INIT;
+    StringBuffer *sb = &output_queue;
     
-    sbAppend(&sb, "\x1b[?25l", 6);
-    sbAppend(&sb, "\x1b[H", 3);
+    /* Synchronized update: the terminal holds the old frame until the
+       closing sequence arrives, so large redraws never tear */
+    if (E.sync_output) sbAppend(sb, "\x1b[?2026h", 8);
+    sbAppend(sb, "\x1b[?25l", 6);
+    sbAppend(sb, "\x1b[H", 3);
     
-    editorDrawRows(&sb);
-    editorDrawStatusBar(&sb);
-    editorDrawMessageBar(&sb);
+    editorDrawRows(sb);
+    editorDrawStatusBar(sb);
+    editorDrawMessageBar(sb);
     
     /* Call module render hooks */
     for (int i = 0; i < E.module_count; i++) {
@@ -3811,16 +10007,21 @@ void editorRefreshScreen(void) {
         }
     }
     
+    Pane panes[2];
+    Pane *pane = &panes[editorLayoutPanes(panes) == 2 ? split.focus : 0];
+    int gutter_width = E.gutter_width < pane->cols ? E.gutter_width : 0;
+    
     char buf[32];
     snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 
-            (E.cy - E.rowoff) + 1,
-            (E.rx - E.coloff) + 1);
-    sbAppend(&sb, buf, strlen(buf));
+            pane->top + (E.cy - E.rowoff) + 1,
+            pane->left + gutter_width + (E.rx - E.coloff) + 1);
+    sbAppend(sb, buf, strlen(buf));
     
-    sbAppend(&sb, "\x1b[?25h", 6);
+    sbAppend(sb, "\x1b[?25h", 6);
+    if (E.sync_output) sbAppend(sb, "\x1b[?2026l", 8);
     
-    write(STDOUT_FILENO, sb.b, sb.len);
-    sbFree(&sb);
+    if (E.headless) headlessRecordFrame(editorNowNs() - start, sb->len);
+    editorFlushOutput();
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -3946,8 +10147,7 @@ void editorProcessKeypress(void) {
                         strcmp(response, "save") == 0 || strcmp(response, "s") == 0) {
                         if (editorSave() == 0) {
                             free(response);
-                            write(STDOUT_FILENO, "\x1b[2J", 4);
-                            write(STDOUT_FILENO, "\x1b[H", 3);
+                            editorClearScreen();
                             exit(0);
                         } else {
                             editorSetStatusMessage("Error saving! Press Ctrl-Q again to quit without saving");
@@ -3957,8 +10157,7 @@ void editorProcessKeypress(void) {
                     } else if (strcmp(response, "no") == 0 || strcmp(response, "n") == 0 || 
                                strcmp(response, "discard") == 0 || strcmp(response, "d") == 0) {
                         free(response);
-                        write(STDOUT_FILENO, "\x1b[2J", 4);
-                        write(STDOUT_FILENO, "\x1b[H", 3);
+                        editorClearScreen();
                         exit(0);
                     } else if (strcmp(response, "cancel") == 0 || strcmp(response, "c") == 0) {
                         editorSetStatusMessage("Quit cancelled");
@@ -3975,8 +10174,7 @@ void editorProcessKeypress(void) {
                     return;
                 }
             } else {
-                write(STDOUT_FILENO, "\x1b[2J", 4);
-                write(STDOUT_FILENO, "\x1b[H", 3);
+                editorClearScreen();
                 exit(0);
             }
             break;
@@ -3997,16 +10195,16 @@ void editorProcessKeypress(void) {
             editorReplace();
             break;
             
+        case CTRL_KEY('o'):
+            finderOpen();
+            break;
+            
         case CTRL_KEY('n'):
-            if (search_ctx.match_count > 0) {
-                gotoNextMatch();
-            }
+            gotoNextMatch();
             break;
             
         case CTRL_KEY('p'):
-            if (search_ctx.match_count > 0) {
-                gotoPrevMatch();
-            }
+            gotoPrevMatch();
             break;
             
         case CTRL_KEY('k'):
@@ -4037,6 +10235,10 @@ void editorProcessKeypress(void) {
             toggleFold(E.cy);
             break;
             
+        case CTRL_KEY(']'):
+            gotoMatchingBracket();
+            break;
+            
         case CTRL_KEY('d'):
             multiCursorAdd(E.cx, E.cy);
             editorSetStatusMessage("Multi-cursor added (%d total)", multi_cursor.count);
@@ -4114,6 +10316,792 @@ void editorProcessKeypress(void) {
     quit_times = 1;
 }
 
+/*** Headless mode ***/
+
+/* In headless mode no tty is touched: keys come from a script given on the
+   command line and every flushed byte is fed to a small VT emulator that
+   keeps a cell grid. At exit the grid is printed to stdout and frame
+   statistics to stderr, which is enough to assert screen contents in
+   tests and to measure frame build time and bytes per frame. */
+
+#define VT_ATTR_REVERSE (1<<3)
+
+typedef struct VTCell {
+    char ch;
+    ThemeStyle style;
+} VTCell;
+
+typedef struct VTScreen {
+    int rows, cols;
+    VTCell *cells;
+    int cx, cy;
+    int wrap_pending;
+    ThemeStyle pen;
+    int cursor_visible;
+    int sync;
+    int state; /* 0 = ground, 1 = after ESC, 2 = in CSI */
+    char params[64];
+    int param_len;
+} VTScreen;
+
+typedef struct Headless {
+    int rows, cols;
+    char *keys;
+    int keys_len;
+    int key_pos;
+    int done;
+    const char *expect;    /* --expect: text the final screen must show */
+    long frames;
+    long long bytes;
+    int max_bytes;
+    long long build_ns;
+    VTScreen vt;
+} Headless;
+
+Headless headless = {0};
+
+void vtInit(VTScreen *vt, int rows, int cols) {
+    ThemeStyle plain = { THEME_COLOR_DEFAULT, THEME_COLOR_DEFAULT, 0 };
+    vt->rows = rows;
+    vt->cols = cols;
+    vt->cells = malloc(sizeof(VTCell) * rows * cols);
+    vt->pen = plain;
+    for (int i = 0; i < rows * cols; i++) {
+        vt->cells[i].ch = ' ';
+        vt->cells[i].style = plain;
+    }
+    vt->cursor_visible = 1;
+}
+
+void vtErase(VTScreen *vt, int from, int to) {
+    for (int i = from; i < to; i++) {
+        vt->cells[i].ch = ' ';
+        vt->cells[i].style = vt->pen;
+    }
+}
+
+void vtLineFeed(VTScreen *vt) {
+    if (vt->cy < vt->rows - 1) {
+        vt->cy++;
+        return;
+    }
+    memmove(vt->cells, &vt->cells[vt->cols], sizeof(VTCell) * (vt->rows - 1) * vt->cols);
+    vtErase(vt, (vt->rows - 1) * vt->cols, vt->rows * vt->cols);
+}
+
+void vtPutChar(VTScreen *vt, char c) {
+    if (vt->wrap_pending) {
+        vt->cx = 0;
+        vtLineFeed(vt);
+        vt->wrap_pending = 0;
+    }
+    VTCell *cell = &vt->cells[vt->cy * vt->cols + vt->cx];
+    cell->ch = c;
+    cell->style = vt->pen;
+    if (vt->cx == vt->cols - 1) vt->wrap_pending = 1;
+    else vt->cx++;
+}
+
+/* Parse "a;b;c" into at most max numbers, -1 for omitted ones */
+int vtParams(VTScreen *vt, int *out, int max) {
+    int n = 0;
+    char *p = vt->params;
+    if (*p == '?') p++;
+    while (n < max) {
+        out[n++] = isdigit((unsigned char)*p) ? atoi(p) : -1;
+        while (isdigit((unsigned char)*p)) p++;
+        if (*p != ';' && *p != ':') break;
+        p++;
+    }
+    return n;
+}
+
+int vtSgrColor(int *p, int n, int *i) {
+    if (*i + 1 < n && p[*i + 1] == 5 && *i + 2 < n) {
+        *i += 2;
+        return p[*i];
+    }
+    if (*i + 1 < n && p[*i + 1] == 2 && *i + 4 < n) {
+        int rgb = THEME_COLOR_RGB | (p[*i + 2] << 16) | (p[*i + 3] << 8) | p[*i + 4];
+        *i += 4;
+        return rgb;
+    }
+    return THEME_COLOR_DEFAULT;
+}
+
+void vtSgr(VTScreen *vt) {
+    int p[32];
+    int n = vtParams(vt, p, 32);
+    for (int i = 0; i < n; i++) {
+        int v = p[i] < 0 ? 0 : p[i];
+        ThemeStyle *pen = &vt->pen;
+        if (v == 0) {
+            pen->fg = pen->bg = THEME_COLOR_DEFAULT;
+            pen->attrs = 0;
+        }
+        else if (v == 1) pen->attrs |= THEME_ATTR_BOLD;
+        else if (v == 3) pen->attrs |= THEME_ATTR_ITALIC;
+        else if (v == 4) pen->attrs |= THEME_ATTR_UNDERLINE;
+        else if (v == 7) pen->attrs |= VT_ATTR_REVERSE;
+        else if (v == 22) pen->attrs &= ~THEME_ATTR_BOLD;
+        else if (v == 23) pen->attrs &= ~THEME_ATTR_ITALIC;
+        else if (v == 24) pen->attrs &= ~THEME_ATTR_UNDERLINE;
+        else if (v == 27) pen->attrs &= ~VT_ATTR_REVERSE;
+        else if (v >= 30 && v <= 37) pen->fg = v - 30;
+        else if (v == 38) pen->fg = vtSgrColor(p, n, &i);
+        else if (v == 39) pen->fg = THEME_COLOR_DEFAULT;
+        else if (v >= 40 && v <= 47) pen->bg = v - 40;
+        else if (v == 48) pen->bg = vtSgrColor(p, n, &i);
+        else if (v == 49) pen->bg = THEME_COLOR_DEFAULT;
+        else if (v >= 90 && v <= 97) pen->fg = v - 90 + 8;
+        else if (v >= 100 && v <= 107) pen->bg = v - 100 + 8;
+    }
+}
+
+void vtCsi(VTScreen *vt, char final) {
+    int p[4];
+    int n = vtParams(vt, p, 4);
+    int a = (n > 0 && p[0] > 0) ? p[0] : 1;
+    int pos = vt->cy * vt->cols + vt->cx;
+    
+    if (vt->params[0] == '?') {
+        if (final != 'h' && final != 'l') return;
+        if (p[0] == 25) vt->cursor_visible = (final == 'h');
+        if (p[0] == 2026) vt->sync = (final == 'h');
+        return;
+    }
+    
+    vt->wrap_pending = 0;
+    switch (final) {
+        case 'H':
+        case 'f':
+            vt->cy = a - 1;
+            vt->cx = (n > 1 && p[1] > 0) ? p[1] - 1 : 0;
+            break;
+        case 'A': vt->cy -= a; break;
+        case 'B': vt->cy += a; break;
+        case 'C': vt->cx += a; break;
+        case 'D': vt->cx -= a; break;
+        case 'K': {
+            int line = vt->cy * vt->cols;
+            int mode = p[0] < 0 ? 0 : p[0];
+            if (mode == 0) vtErase(vt, pos, line + vt->cols);
+            else if (mode == 1) vtErase(vt, line, pos + 1);
+            else vtErase(vt, line, line + vt->cols);
+            break;
+        }
+        case 'J': {
+            int mode = p[0] < 0 ? 0 : p[0];
+            if (mode == 0) vtErase(vt, pos, vt->rows * vt->cols);
+            else if (mode == 1) vtErase(vt, 0, pos + 1);
+            else vtErase(vt, 0, vt->rows * vt->cols);
+            break;
+        }
+        case 'm':
+            vtSgr(vt);
+            break;
+    }
+    
+    if (vt->cy < 0) vt->cy = 0;
+    if (vt->cy >= vt->rows) vt->cy = vt->rows - 1;
+    if (vt->cx < 0) vt->cx = 0;
+    if (vt->cx >= vt->cols) vt->cx = vt->cols - 1;
+}
+
+void vtFeed(VTScreen *vt, const char *s, int len) {
+    for (int i = 0; i < len; i++) {
+        char c = s[i];
+        
+        if (vt->state == 1) {
+            if (c == '[') {
+                vt->state = 2;
+                vt->param_len = 0;
+                vt->params[0] = '\0';
+            } else {
+                vt->state = 0;
+            }
+            continue;
+        }
+        if (vt->state == 2) {
+            if (c >= 0x40 && c <= 0x7e) {
+                vtCsi(vt, c);
+                vt->state = 0;
+            } else if (vt->param_len < (int)sizeof(vt->params) - 1) {
+                vt->params[vt->param_len++] = c;
+                vt->params[vt->param_len] = '\0';
+            }
+            continue;
+        }
+        
+        switch (c) {
+            case '\x1b': vt->state = 1; break;
+            case '\r': vt->cx = 0; vt->wrap_pending = 0; break;
+            case '\n': vtLineFeed(vt); vt->wrap_pending = 0; break;
+            case '\b': if (vt->cx > 0) vt->cx--; break;
+            default:
+                if ((unsigned char)c >= 0x20) vtPutChar(vt, c);
+        }
+    }
+}
+
+/* Translate C-style escapes (\e \r \n \t \\ \xHH) in a key script */
+int headlessSetKeys(const char *script) {
+    int len = strlen(script);
+    headless.keys = malloc(len + 1);
+    headless.keys_len = 0;
+    
+    for (int i = 0; i < len; i++) {
+        char c = script[i];
+        if (c == '\\' && i + 1 < len) {
+            char e = script[++i];
+            if (e == 'e') c = '\x1b';
+            else if (e == 'r') c = '\r';
+            else if (e == 'n') c = '\n';
+            else if (e == 't') c = '\t';
+            else if (e == 'x' && i + 2 < len && isxdigit((unsigned char)script[i + 1]) &&
+                     isxdigit((unsigned char)script[i + 2])) {
+                char hex[3] = { script[i + 1], script[i + 2], '\0' };
+                c = (char)strtol(hex, NULL, 16);
+                i += 2;
+            } else c = e;
+        }
+        headless.keys[headless.keys_len++] = c;
+    }
+    return 0;
+}
+
+int headlessReadByte(char *c) {
+    if (headless.key_pos >= headless.keys_len) {
+        headless.done = 1;
+        return 0;
+    }
+    *c = headless.keys[headless.key_pos++];
+    return 1;
+}
+
+int headlessInputPending(void) {
+    return headless.key_pos < headless.keys_len;
+}
+
+void headlessWrite(const char *s, int len) {
+    vtFeed(&headless.vt, s, len);
+}
+
+void headlessRecordFrame(long long build_ns, int bytes) {
+    headless.frames++;
+    headless.bytes += bytes;
+    headless.build_ns += build_ns;
+    if (bytes > headless.max_bytes) headless.max_bytes = bytes;
+}
+
+void headlessDump(void) {
+    VTScreen *vt = &headless.vt;
+    char *line = malloc(vt->cols + 1);
+    
+    for (int y = 0; y < vt->rows; y++) {
+        int len = 0;
+        for (int x = 0; x < vt->cols; x++) line[len++] = vt->cells[y * vt->cols + x].ch;
+        while (len > 0 && line[len - 1] == ' ') len--;
+        fwrite(line, 1, len, stdout);
+        fputc('\n', stdout);
+    }
+    free(line);
+    fflush(stdout);
+    
+    long frames = headless.frames ? headless.frames : 1;
+    fprintf(stderr, "frames: %ld  bytes: %lld  bytes/frame: %lld  max: %d  "
+        "build: %.1f us/frame  cursor: %d,%d\n",
+        headless.frames, headless.bytes, headless.bytes / frames, headless.max_bytes,
+        headless.build_ns / 1000.0 / frames, vt->cy + 1, vt->cx + 1);
+}
+
+/* Exit status for --expect: 0 if some row of the final screen contains
+   the text */
+int headlessCheckExpect(void) {
+    VTScreen *vt = &headless.vt;
+    if (!headless.expect) return 0;
+    
+    int n = strlen(headless.expect);
+    char *line = malloc(vt->cols + 1);
+    int found = 0;
+    for (int y = 0; y < vt->rows && !found; y++) {
+        for (int x = 0; x < vt->cols; x++) line[x] = vt->cells[y * vt->cols + x].ch;
+        for (int x = 0; x + n <= vt->cols && !found; x++)
+            found = memcmp(&line[x], headless.expect, n) == 0;
+    }
+    free(line);
+    if (!found) fprintf(stderr, "expected '%s' is not on the screen\n", headless.expect);
+    return found ? 0 : 1;
+}
+
+/* Parse "ROWSxCOLS" for --headless */
+int headlessSetSize(const char *spec) {
+    int rows, cols;
+    if (sscanf(spec, "%dx%d", &rows, &cols) != 2 || rows < 3 || cols < 1) return -1;
+    headless.rows = rows;
+    headless.cols = cols;
+    return 0;
+}
+
+/*** Benchmarks ***/
+
+/* --bench-highlight times the highlighter over a set of corpora: the files
+   given on the command line, or when there are none, synthetic C, Python
+   and JavaScript generated here from a fixed seed, including long comment
+   blocks full of near-miss delimiters and rows of hundreds of kilobytes.
+   --hl-golden DIR compares the highlighting of the same corpora against
+   DIR/<corpus>.hl, and --hl-golden-update DIR writes those files. The
+   golden files for the built-in corpora live in tests/golden. */
+
+typedef struct BenchCorpus {
+    const char *name;
+    const char *filename;               /* file to load, NULL if generated */
+    void (*generate)(StringBuffer *sb);
+} BenchCorpus;
+
+/* One letter per highlight class in golden files */
+const char hl_golden_letters[COLOR_COUNT + 1] = ".kscnfpotl123m";
+
+unsigned int bench_seed;
+
+unsigned int benchRand(int n) {
+    bench_seed = bench_seed * 1103515245u + 12345u;
+    return (bench_seed >> 16) % n;
+}
+
+void benchAppendf(StringBuffer *sb, const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(buf)) len = sizeof(buf) - 1;
+    sbAppend(sb, buf, len);
+}
+
+const char *bench_words[] = {
+    "count", "buffer", "node", "value", "index", "result", "state", "limit",
+    "offset", "length", "entry", "table", "cursor", "width", "handle", "flags"
+};
+
+#define BENCH_WORD() bench_words[benchRand(sizeof(bench_words) / sizeof(bench_words[0]))]
+
+void benchGenC(StringBuffer *sb) {
+    for (int f = 0; f < 2000; f++) {
+        benchAppendf(sb, "/* %s_%d: update the %s of a %s */\n", BENCH_WORD(), f, BENCH_WORD(), BENCH_WORD());
+        benchAppendf(sb, "static int %s_%d(struct %s *%s, const char *name, size_t len) {\n",
+            BENCH_WORD(), f, BENCH_WORD(), BENCH_WORD());
+        benchAppendf(sb, "    unsigned long %s = %u, %s = 0x%x;\n", BENCH_WORD(), benchRand(100000), BENCH_WORD(), benchRand(65536));
+        benchAppendf(sb, "    if (%s[%d] == '%c' && name[len - 1] != '\\\\') {\n", BENCH_WORD(), benchRand(64), 'a' + benchRand(26));
+        benchAppendf(sb, "        printf(\"%s %%d: \\\"%%s\\\"\\n\", %s, name); // %s\n", BENCH_WORD(), BENCH_WORD(), BENCH_WORD());
+        benchAppendf(sb, "    }\n");
+        benchAppendf(sb, "    for (int i = 0; i < %d; i++) %s += i * %d.%de-3;\n", benchRand(1000), BENCH_WORD(), benchRand(10), benchRand(100));
+        benchAppendf(sb, "    return %s ? %s->%s : -%d;\n", BENCH_WORD(), BENCH_WORD(), BENCH_WORD(), benchRand(10));
+        benchAppendf(sb, "}\n\n");
+        if (f % 10 == 0) benchAppendf(sb, "#define %s_%d(x) ((x) + %d)\n\n", BENCH_WORD(), f, benchRand(100));
+    }
+}
+
+/* Block comments from a few rows to a few hundred, with delimiters inside
+   strings, line comments and comments, so a wrong comment state shows up
+   as thousands of wrongly colored rows */
+void benchGenCComments(StringBuffer *sb) {
+    for (int block = 0; block < 300; block++) {
+        int rows = 1 + benchRand(benchRand(4) ? 20 : 400);
+        benchAppendf(sb, "int %s_%d = %d; /* opens\n", BENCH_WORD(), block, benchRand(1000));
+        for (int r = 0; r < rows; r++) {
+            switch (benchRand(6)) {
+                case 0: benchAppendf(sb, " * /* /* /* %s %d\n", BENCH_WORD(), r); break;
+                case 1: benchAppendf(sb, " * \"*/ is not the end inside a comment? it is: */ int %s;\n", BENCH_WORD());
+                        benchAppendf(sb, "char *s%d = \"/*\"; /* \"\n", r); break;
+                case 2: benchAppendf(sb, " ** %s ** / * * / *\n", BENCH_WORD()); break;
+                case 3: benchAppendf(sb, "   // %s %s\n", BENCH_WORD(), BENCH_WORD()); break;
+                case 4: benchAppendf(sb, "\n"); break;
+                default: benchAppendf(sb, " * %s(%d, '%c');\n", BENCH_WORD(), benchRand(100), '"'); break;
+            }
+        }
+        benchAppendf(sb, " */ int %s = %d; // /* not a block\n", BENCH_WORD(), benchRand(1000));
+        benchAppendf(sb, "char *q%d = \"/* \\\" */\"; /**/ /***/ int x%d;\n", block, block);
+    }
+}
+
+void benchGenPython(StringBuffer *sb) {
+    for (int f = 0; f < 2000; f++) {
+        benchAppendf(sb, "class %s%d(object):\n", BENCH_WORD(), f);
+        benchAppendf(sb, "    \"\"\"Keep the %s of a %s.\n\n    Returns None when empty.\n    \"\"\"\n", BENCH_WORD(), BENCH_WORD());
+        benchAppendf(sb, "    def %s(self, %s=%d, name='%s'):  # %s\n", BENCH_WORD(), BENCH_WORD(), benchRand(100), BENCH_WORD(), BENCH_WORD());
+        benchAppendf(sb, "        if self.%s is not None and %s > %d.%d:\n", BENCH_WORD(), BENCH_WORD(), benchRand(100), benchRand(10));
+        benchAppendf(sb, "            return [x * %d for x in self.%s]\n", benchRand(10), BENCH_WORD());
+        benchAppendf(sb, "        raise ValueError(\"bad %s: %%r\" %% (%s,))\n\n", BENCH_WORD(), BENCH_WORD());
+    }
+}
+
+void benchGenJs(StringBuffer *sb) {
+    for (int f = 0; f < 2000; f++) {
+        benchAppendf(sb, "export async function %s%d(%s, %s = %d) {\n", BENCH_WORD(), f, BENCH_WORD(), BENCH_WORD(), benchRand(100));
+        benchAppendf(sb, "    const %s = await fetch(`/api/%s/${%s}`); /* %s */\n", BENCH_WORD(), BENCH_WORD(), BENCH_WORD(), BENCH_WORD());
+        benchAppendf(sb, "    let %s = { key: '%s', n: %d.%d, ok: true };\n", BENCH_WORD(), BENCH_WORD(), benchRand(100), benchRand(100));
+        benchAppendf(sb, "    if (typeof %s === \"undefined\" || %s instanceof Array) return null;\n", BENCH_WORD(), BENCH_WORD());
+        benchAppendf(sb, "    return %s.map((x) => x * %d); // %s\n}\n\n", BENCH_WORD(), benchRand(10), BENCH_WORD());
+    }
+}
+
+/* A few rows of several hundred kilobytes, like minified code or logs */
+void benchGenLongLines(StringBuffer *sb) {
+    for (int r = 0; r < 8; r++) {
+        for (int k = 0; k < 8000; k++) {
+            switch (benchRand(4)) {
+                case 0: benchAppendf(sb, "%s(%d,\"%s\");", BENCH_WORD(), benchRand(1000), BENCH_WORD()); break;
+                case 1: benchAppendf(sb, "/* %s */", BENCH_WORD()); break;
+                case 2: benchAppendf(sb, "if(%s>%d.%d){", BENCH_WORD(), benchRand(100), benchRand(100)); break;
+                default: benchAppendf(sb, "return %s;}", BENCH_WORD()); break;
+            }
+        }
+        benchAppendf(sb, "\n");
+    }
+}
+
+BenchCorpus bench_corpora[] = {
+    {"synthetic.c", NULL, benchGenC},
+    {"comments.c", NULL, benchGenCComments},
+    {"synthetic.py", NULL, benchGenPython},
+    {"synthetic.js", NULL, benchGenJs},
+    {"longlines.js", NULL, benchGenLongLines},
+};
+
+#define BENCH_CORPORA (sizeof(bench_corpora) / sizeof(bench_corpora[0]))
+
+/* Replace the buffer with a corpus. The corpus name picks the syntax. */
+void benchLoadCorpus(BenchCorpus *c) {
+    editorCloseBuffer();
+    
+    if (c->filename) {
+        editorOpen((char *)c->filename);
+        return;
+    }
+    free(E.filename);
+    E.filename = strdup(c->name);
+    editorSelectSyntaxHighlight();
+    
+    StringBuffer sb = STRBUF_INIT;
+    bench_seed = 1;
+    c->generate(&sb);
+    int start = 0;
+    for (int i = 0; i < sb.len; i++) {
+        if (sb.b[i] != '\n') continue;
+        editorInsertRow(E.numrows, &sb.b[start], i - start);
+        start = i + 1;
+    }
+    sbFree(&sb);
+    E.dirty = 0;
+}
+
+/* Highlight every row from the top, as opening the file and scrolling
+   through it would */
+void benchHighlightAll(void) {
+    int state = 0;
+    for (int r = 0; r < E.numrows; r++) state = editorHighlightRow(&E.row[r], state);
+}
+
+int longLongCompare(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void benchHighlight(BenchCorpus *c) {
+    long long bytes = 0;
+    for (int r = 0; r < E.numrows; r++) bytes += E.row[r].rsize;
+    
+    long long best = -1, total = 0;
+    for (int it = 0; it < EDE_BENCH_ITERATIONS; it++) {
+        /* Each pass starts from an empty highlight cache */
+        hlCacheClear();
+        long long start = editorNowNs();
+        benchHighlightAll();
+        long long elapsed = editorNowNs() - start;
+        
+        total += elapsed;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    
+    /* One more pass timing each row on its own. The clock reads add a few
+       tens of nanoseconds to every sample. */
+    long long *lat = malloc(sizeof(long long) * (E.numrows ? E.numrows : 1));
+    hlCacheClear();
+    int state = 0;
+    for (int r = 0; r < E.numrows; r++) {
+        long long start = editorNowNs();
+        state = editorHighlightRow(&E.row[r], state);
+        lat[r] = editorNowNs() - start;
+    }
+    qsort(lat, E.numrows, sizeof(long long), longLongCompare);
+    int last = E.numrows ? E.numrows - 1 : 0;
+    
+    double mean = (double)total / EDE_BENCH_ITERATIONS;
+    printf("%s: %d rows, %lld bytes, %d passes\n", c->name, E.numrows, bytes, EDE_BENCH_ITERATIONS);
+    printf("  best %.2f ms  mean %.2f ms  %.1f ns/row  %.1f MB/s\n",
+        best / 1e6, mean / 1e6, (double)best / (E.numrows ? E.numrows : 1),
+        bytes / (best / 1e9) / (1024 * 1024));
+    printf("  per row: p50 %lld ns  p90 %lld ns  p99 %lld ns  max %lld ns\n",
+        lat[last * 50 / 100], lat[last * 90 / 100], lat[last * 99 / 100], lat[last]);
+    printf("  %d distinct results for %d rows\n", hl_cache.count, E.numrows);
+    free(lat);
+}
+
+/* Compare the highlighting of the loaded corpus with its golden file, or
+   rewrite the file. Returns 0 if they match. */
+int benchGolden(BenchCorpus *c, const char *dir, int update) {
+    char path[MAX_PATH_LENGTH];
+    const char *base = strrchr(c->name, '/');
+    snprintf(path, sizeof(path), "%s/%s.hl", dir, base ? base + 1 : c->name);
+    
+    hlCacheClear();
+    benchHighlightAll();
+    
+    FILE *fp = fopen(path, update ? "w" : "r");
+    if (fp == NULL) {
+        printf("%s: cannot open %s\n", c->name, path);
+        return 1;
+    }
+    
+    if (update) {
+        for (int r = 0; r < E.numrows; r++) {
+            EditorRow *row = &E.row[r];
+            for (int i = 0; i < row->rsize; i++) fputc(hl_golden_letters[row->hl[i]], fp);
+            fputc('\n', fp);
+        }
+        fclose(fp);
+        printf("%s: wrote %s\n", c->name, path);
+        return 0;
+    }
+    
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int r = 0, bad = 0;
+    while ((linelen = bare_getline(&line, &linecap, fp)) != -1) {
+        if (linelen > 0 && line[linelen - 1] == '\n') linelen--;
+        if (r >= E.numrows) {
+            r++;
+            continue;
+        }
+        EditorRow *row = &E.row[r];
+        int i = 0;
+        while (i < row->rsize && i < linelen && hl_golden_letters[row->hl[i]] == line[i]) i++;
+        if (i < row->rsize || i < linelen) {
+            if (bad < 5) {
+                printf("%s:%d:%d: expected '%c', got '%c'\n", c->name, r + 1, i + 1,
+                    i < linelen ? line[i] : '$', i < row->rsize ? hl_golden_letters[row->hl[i]] : '$');
+            }
+            bad++;
+        }
+        r++;
+    }
+    free(line);
+    fclose(fp);
+    
+    if (r != E.numrows) {
+        printf("%s: %d rows, golden file has %d\n", c->name, E.numrows, r);
+        bad++;
+    }
+    printf("%s: %s (%d rows differ)\n", c->name, bad ? "FAIL" : "ok", bad);
+    return bad != 0;
+}
+
+/* --bench-search: find every occurrence of a literal in every row, as
+   findAllMatches does, matching case and ignoring it */
+void benchSearch(BenchCorpus *c, const char *pattern) {
+    long long bytes = 0;
+    for (int r = 0; r < E.numrows; r++) bytes += E.row[r].rsize;
+    printf("%s: %d rows, %lld bytes, %d passes\n", c->name, E.numrows, bytes, EDE_BENCH_ITERATIONS);
+    
+    for (int ignore_case = 0; ignore_case < 2; ignore_case++) {
+        Searcher searcher;
+        searcherInit(&searcher, pattern, strlen(pattern), ignore_case);
+        long long best = -1, found = 0;
+        
+        for (int it = 0; it < EDE_BENCH_ITERATIONS; it++) {
+            long long start = editorNowNs();
+            found = 0;
+            for (int r = 0; r < E.numrows; r++) {
+                EditorRow *row = &E.row[r];
+                int col = 0;
+                while ((col = searcherFind(&searcher, row->render, col, row->rsize)) >= 0) {
+                    found++;
+                    col += searcher.len;
+                }
+            }
+            long long elapsed = editorNowNs() - start;
+            if (best < 0 || elapsed < best) best = elapsed;
+        }
+        
+        printf("  %s: best %.2f ms  %.1f MB/s  %lld matches\n",
+            ignore_case ? "ignore case" : "match case ", best / 1e6,
+            bytes / (best / 1e9) / (1024 * 1024), found);
+        searcherFree(&searcher);
+    }    
+    /* The pattern as a regex, against the literal passes above */
+    Regex re;
+    const char *error = regexCompile(&re, pattern, 0);
+    if (error) {
+        printf("  regex      : %s\n", error);
+    } else {
+        long long best = -1, found = 0;
+        for (int it = 0; it < EDE_BENCH_ITERATIONS; it++) {
+            long long start = editorNowNs();
+            found = 0;
+            for (int r = 0; r < E.numrows; r++) {
+                EditorRow *row = &E.row[r];
+                int col = 0, len;
+                while ((col = regexFind(&re, row->render, col, row->rsize, &len)) >= 0) {
+                    found++;
+                    col += len;
+                }
+            }
+            long long elapsed = editorNowNs() - start;
+            if (best < 0 || elapsed < best) best = elapsed;
+        }
+        printf("  regex      : best %.2f ms  %.1f MB/s  %lld matches%s\n", best / 1e6,
+            bytes / (best / 1e9) / (1024 * 1024), found, re.prefix.len ? "" : "  (no literal prefix)");
+        regexFree(&re);
+    }
+    
+    /* The same search through findAllMatches, spread over the thread pool */
+    strncpy(search_ctx.query, pattern, sizeof(search_ctx.query) - 1);
+    search_ctx.query_len = strlen(search_ctx.query);
+    search_ctx.case_sensitive = 1;
+    search_ctx.whole_word = 0;
+    long long best = -1;
+    for (int it = 0; it < EDE_BENCH_ITERATIONS; it++) {
+        long long start = editorNowNs();
+        findAllMatches();
+        long long elapsed = editorNowNs() - start;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    printf("  %d threads  : best %.2f ms  %.1f MB/s  %d matches\n",
+        threadCount(), best / 1e6, bytes / (best / 1e9) / (1024 * 1024), search_ctx.match_count);
+    freeSearchMatches();
+}
+
+/* --bench-grep: a :grep over a tree, timed until the last worker is
+   done. The first pass also reads the files into the page cache, so it
+   is reported on its own. */
+#define EDE_BENCH_GREP_PASSES 5
+
+int benchGrep(const char *pattern, const char *dir) {
+    GrepJob *job = &grep_job;
+    long long first = 0, best = -1;
+    
+    for (int it = 0; it < EDE_BENCH_GREP_PASSES; it++) {
+        long long start = editorNowNs();
+        const char *error = grepBegin(pattern, dir);
+        if (error) {
+            fprintf(stderr, "Bad pattern: %s\n", error);
+            return 1;
+        }
+        grepJoin();
+        long long elapsed = editorNowNs() - start;
+        if (it == 0) first = elapsed;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    
+    printf("%s: %d files, %.1f MB, %d threads\n", dir, job->searched,
+        job->bytes / (1024.0 * 1024), threadCount());
+    printf("  first pass: %.1f ms\n", first / 1e6);
+    printf("  best      : %.1f ms  %.1f MB/s  %d matching lines in %d files\n", best / 1e6,
+        job->bytes / (best / 1e9) / (1024 * 1024), job->result_count, job->file_count);
+    grepClear();
+    return 0;
+}
+
+/* --bench-finder: the Ctrl-O query typed one key at a time, each key
+   rescoring from the previous prefix, then from scratch and backspaced */
+void benchFinder(BenchCorpus *c, const char *query) {
+    char prefix[EDE_FINDER_MAX_QUERY + 1];
+    int len = strlen(query);
+    if (len > EDE_FINDER_MAX_QUERY) len = EDE_FINDER_MAX_QUERY;
+    printf("%s: %d rows\n", c->name, E.numrows);
+    if (E.numrows == 0) return;
+    
+    long long typed = 0;
+    finderReset();
+    for (int k = 1; k <= len; k++) {
+        memcpy(prefix, query, k);
+        prefix[k] = '\0';
+        long long start = editorNowNs();
+        finderUpdate(prefix);
+        long long elapsed = editorNowNs() - start;
+        typed += elapsed;
+        printf("  %-*s: %8.2f ms  %d lines\n", len, prefix, elapsed / 1e6,
+            finder.levels[finder.depth - 1].count);
+    }
+    printf("  typed      : %.2f ms in all\n", typed / 1e6);
+    
+    long long best = -1;
+    for (int it = 0; it < EDE_BENCH_ITERATIONS; it++) {
+        finderReset();
+        long long start = editorNowNs();
+        memcpy(prefix, query, len);
+        prefix[len] = '\0';
+        finderUpdate(prefix);
+        long long elapsed = editorNowNs() - start;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    printf("  from empty : best %.2f ms  %d lines\n", best / 1e6,
+        finder.levels[finder.depth - 1].count);
+    
+    best = -1;
+    for (int k = len - 1; k >= 1; k--) {
+        prefix[k] = '\0';
+        long long start = editorNowNs();
+        finderUpdate(prefix);
+        long long elapsed = editorNowNs() - start;
+        if (elapsed > best) best = elapsed;
+    }
+    printf("  backspace  : worst %.2f ms\n", best / 1e6);
+    finderReset();
+}
+
+/* Run the benchmark or golden comparison over the given files, or the
+   built-in corpora. Returns the process exit status. */
+int benchRun(char **files, int nfiles, const char *golden_dir, int update,
+             const char *search_pattern, const char *finder_query) {
+    BenchCorpus *corpora = bench_corpora;
+    int count = BENCH_CORPORA;
+    int failed = 0;
+    
+    if (nfiles > 0) {
+        corpora = calloc(nfiles, sizeof(BenchCorpus));
+        for (int i = 0; i < nfiles; i++) {
+            corpora[i].name = files[i];
+            corpora[i].filename = files[i];
+        }
+        count = nfiles;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        benchLoadCorpus(&corpora[i]);
+        if (search_pattern) {
+            benchSearch(&corpora[i], search_pattern);
+            continue;
+        }
+        if (finder_query) {
+            benchFinder(&corpora[i], finder_query);
+            continue;
+        }
+        if (E.syntax == NULL) {
+            printf("%s: no syntax highlighting for this file type\n", corpora[i].name);
+            failed = 1;
+            continue;
+        }
+        if (golden_dir) failed |= benchGolden(&corpora[i], golden_dir, update);
+        else benchHighlight(&corpora[i]);
+    }
+    
+    if (corpora != bench_corpora) free(corpora);
+    return failed;
+}
+
 /*** Init ***/
 
 void initEditor(void) {
@@ -4140,14 +11128,29 @@ void initEditor(void) {
     E.search_direction = 1;
     E.module_count = 0;
     E.show_line_numbers = 1;
+    E.relative_line_numbers = 0;
+    E.rainbow_brackets = 1;
+    E.gutter_width = 0;
+    gutterInvalidate();
     E.ctrl_c_pressed = 0;
     E.ctrl_c_time = 0;
+    E.sync_output = 0;
+    
+    themeLoadDefaults(&theme);
+    
+    if (E.headless) {
+        vtInit(&headless.vt, headless.rows, headless.cols);
+        E.screenrows = headless.rows - 2;
+        E.screencols = headless.cols;
+        return;
+    }
     
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -= 2;
     
 #ifdef EDE_UNIX
     signal(SIGWINCH, handleSigwinch);
+    E.sync_output = editorDetectSyncOutput();
 #endif
 }
 
@@ -4159,6 +11162,27 @@ void printUsage(void) {
     printf("Options:\n");
     printf("  -m <module>    Load a compiled module (.emod file)\n");
     printf("  -o <output>    Specify output file (used with module compilation)\n");
+    printf("  -t <theme>     Load a color theme (default: ~/.ede_theme)\n");
+    printf("  --headless RxC Render to an in-memory RxC screen instead of the tty,\n");
+    printf("                 print it on exit along with frame statistics\n");
+    printf("  --keys <keys>  Key script for headless mode (\\e \\r \\xHH escapes)\n");
+    printf("  --expect TEXT  Exit with status 1 unless the final headless screen\n");
+    printf("                 shows TEXT\n");
+    printf("  --bench-highlight [FILE...]\n");
+    printf("                 Time syntax highlighting of the files, or of built-in\n");
+    printf("                 synthetic corpora, and exit\n");
+    printf("  --bench-search PATTERN [FILE...]\n");
+    printf("                 Time a literal search through the same corpora\n");
+    printf("  --bench-finder QUERY [FILE...]\n");
+    printf("                 Time the Ctrl-O line finder as QUERY is typed\n");
+    printf("  --bench-grep PATTERN [DIR]\n");
+    printf("                 Time :grep over the tree under DIR\n");
+    printf("  --index [DIR]  Build or update the :grep index of DIR and exit\n");
+    printf("  --hl-golden DIR [FILE...]\n");
+    printf("                 Compare highlighting with golden files DIR/<name>.hl\n");
+    printf("                 (tests/golden for the built-in corpora)\n");
+    printf("  --hl-golden-update DIR [FILE...]\n");
+    printf("                 Write the golden files\n");
     printf("  -h, --help     Show this help message\n");
     printf("  -v, --version  Show version information\n\n");
     printf("Module compilation:\n");
@@ -4167,6 +11191,7 @@ void printUsage(void) {
     printf("  Ctrl-Q         Quit (prompts to save/discard)\n");
     printf("  Ctrl-S         Save file\n");
     printf("  Ctrl-F         Find text\n");
+    printf("  Ctrl-O         Find a line by some of its characters\n");
     printf("  Ctrl-Z         Undo\n");
     printf("  Ctrl-Y         Redo\n");
     printf("  Ctrl-C Ctrl-M  Toggle vim command mode\n\n");
@@ -4181,10 +11206,22 @@ void printVersion(void) {
 }
 
 int main(int argc, char *argv[]) {
+    charClassInit();
+    
     char *filename = NULL;
     char *module_file = NULL;
     char *output_file = NULL;
+    char *theme_file = NULL;
     int compile_mode = 0;
+    int bench_highlight = 0;
+    char *golden_dir = NULL;
+    char *search_pattern = NULL;
+    char *finder_query = NULL;
+    char *grep_pattern = NULL;
+    int build_index = 0;
+    int golden_update = 0;
+    char **files = calloc(argc, sizeof(char *));
+    int nfiles = 0;
     
     /* Parse command line arguments */
     for (int i = 1; i < argc; i++) {
@@ -4201,6 +11238,72 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Error: -m requires an argument\n");
                 return 1;
             }
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            if (i + 1 < argc && headlessSetSize(argv[i + 1]) == 0) {
+                E.headless = 1;
+                i++;
+            } else {
+                fprintf(stderr, "Error: --headless requires ROWSxCOLS\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--keys") == 0) {
+            if (i + 1 < argc) {
+                headlessSetKeys(argv[++i]);
+            } else {
+                fprintf(stderr, "Error: --keys requires an argument\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--expect") == 0) {
+            if (i + 1 < argc) {
+                headless.expect = argv[++i];
+            } else {
+                fprintf(stderr, "Error: --expect requires an argument\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-highlight") == 0) {
+            bench_highlight = 1;
+        } else if (strcmp(argv[i], "--bench-search") == 0) {
+            if (i + 1 < argc && argv[i + 1][0]) {
+                search_pattern = argv[++i];
+                bench_highlight = 1;
+            } else {
+                fprintf(stderr, "Error: --bench-search requires a pattern\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-finder") == 0) {
+            if (i + 1 < argc && argv[i + 1][0]) {
+                finder_query = argv[++i];
+                bench_highlight = 1;
+            } else {
+                fprintf(stderr, "Error: --bench-finder requires a query\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-grep") == 0) {
+            if (i + 1 < argc && argv[i + 1][0]) {
+                grep_pattern = argv[++i];
+            } else {
+                fprintf(stderr, "Error: --bench-grep requires a pattern\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--index") == 0) {
+            build_index = 1;
+        } else if (strcmp(argv[i], "--hl-golden") == 0 ||
+                   strcmp(argv[i], "--hl-golden-update") == 0) {
+            if (i + 1 < argc) {
+                golden_update = (strcmp(argv[i], "--hl-golden-update") == 0);
+                golden_dir = argv[++i];
+                bench_highlight = 1;
+            } else {
+                fprintf(stderr, "Error: %s requires a directory\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-t") == 0) {
+            if (i + 1 < argc) {
+                theme_file = argv[++i];
+            } else {
+                fprintf(stderr, "Error: -t requires an argument\n");
+                return 1;
+            }
         } else if (strcmp(argv[i], "-o") == 0) {
             if (i + 1 < argc) {
                 output_file = argv[++i];
@@ -4211,6 +11314,7 @@ int main(int argc, char *argv[]) {
             }
         } else if (argv[i][0] != '-') {
             filename = argv[i];
+            files[nfiles++] = argv[i];
         }
     }
     
@@ -4230,9 +11334,57 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    enableRawMode();
+    if (grep_pattern) {
+        E.headless = 1;
+        headlessSetSize("24x80");
+        initEditor();
+        return benchGrep(grep_pattern, nfiles > 0 ? files[0] : ".");
+    }
+    
+    if (build_index) {
+        IndexStats stats;
+        const char *dir = nfiles > 0 && files[0][0] ? files[0] : ".";
+        long long start = editorNowNs();
+        const char *error = indexBuild(dir, &stats);
+        if (error) {
+            fprintf(stderr, "Error: %s\n", error);
+            return 1;
+        }
+        printf("%s: %d files, %d read (%.1f MB), %d trigrams, index %.1f MB, %.1f ms\n",
+            dir, stats.files, stats.read, stats.bytes / (1024.0 * 1024), stats.trigrams,
+            stats.size / (1024.0 * 1024), (editorNowNs() - start) / 1e6);
+        return 0;
+    }
+    
+    /* Benchmark mode: load the corpora off-screen, time or check them and
+       exit */
+    if (bench_highlight) {
+        E.headless = 1;
+        headlessSetSize("24x80");
+        initEditor();
+        syntaxLoadUserFiles();
+        return benchRun(files, nfiles, golden_dir, golden_update, search_pattern,
+            finder_query);
+    }
+    
+    if (E.headless) {
+        atexit(headlessDump);
+    } else {
+        enableRawMode();
+    }
     initEditor();
     
+    if (theme_file != NULL) {
+        if (themeLoad(theme_file) == -1) {
+            editorSetStatusMessage("Cannot open theme: %s", theme_file);
+        }
+    } else if (getenv("HOME")) {
+        char theme_path[MAX_PATH_LENGTH];
+        snprintf(theme_path, sizeof(theme_path), "%s/.ede_theme", getenv("HOME"));
+        themeLoad(theme_path);
+    }
+    syntaxLoadUserFiles();
+    
     if (filename != NULL) {
         editorOpen(filename);
     }
@@ -4248,10 +11400,11 @@ int main(int argc, char *argv[]) {
     editorSetStatusMessage(
         "HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find | Ctrl-C Ctrl-M = vim mode");
     
-    while (1) {
+    while (!headless.done) {
         editorRefreshScreen();
         editorProcessKeypress();
     }
+    editorRefreshScreen();
     
-    return 0;
+    return headlessCheckExpect();
 }
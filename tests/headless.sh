@@ -0,0 +1,26 @@
+#!/bin/sh
+# Headless regression cases: each loads a small file, runs a key script
+# and checks the final screen with --expect.
+# Usage: tests/headless.sh [path/to/ede]
+
+ede=${1:-./ede}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+# check NAME CONTENTS KEYS TEXT: CONTENTS is a printf format
+check() {
+    printf "$2" > "$dir/$1"
+    if "$ede" --headless 24x80 --keys "$3" --expect "$4" "$dir/$1" > /dev/null 2>&1; then
+        echo "$1: ok"
+    else
+        echo "$1: FAILED"
+        fail=1
+    fi
+}
+
+# A regex match that spans a tab replaces the tab, not the text after it
+check regex-tab.txt 'a\tbcdefg\n' '\x03\r:set regex\r:s/a\x5cs+/X/\r' 'Xbcdefg'
+check regex-in-tab.txt 'x\ty\tz\n' '\x03\r:set regex\r:s/\x5cs/_/\r' 'x_y_z'
+
+exit $fail